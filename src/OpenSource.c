@@ -6,6 +6,8 @@
 #include "texture.h"
 #include "profiler.h"
 #include "camera.h"
+#include "bvh.h"
+#include "occlusion.h"
 #include "vmfparser.h"
 
 #include "atto/app.h"
@@ -48,6 +50,7 @@ typedef struct Map {
 	struct Map *prev, *next;
 	const struct Map *parent;
 	struct AVec3f parent_offset;
+	ROcclusion occlusion;
 } Map;
 
 typedef struct Patch {
@@ -70,6 +73,17 @@ static struct {
 	Map *maps_begin, *maps_end;
 	int maps_count, maps_limit;
 	Map *selected_map;
+
+	/* over translated bounds of loaded maps, rebuilt when any of them moves */
+	struct BVH maps_bvh;
+	int maps_bvh_dirty;
+	Map **bvh_maps;
+	struct AABB *bvh_boxes;
+	int *visible_maps;
+	/* per bvh_maps entry, to sort visible maps front to back */
+	float *map_distance;
+
+	int depth_prepass, overdraw, gpu_culling, multi_draw;
 } g;
 
 static Map *opensrcAllocMap(StringView name) {
@@ -122,6 +136,7 @@ void openSourceAddMap(StringView name) {
 static void mapUpdatePosition(Map *map) {
 	if (map->parent && !(map->flags & MapFlags_FixedOffset))
 		map->offset = aVec3fAdd(map->parent_offset, aVec3fAdd(map->parent->offset, map->parent->debug_offset));
+	g.maps_bvh_dirty = 1;
 
 	PRINTF("Map %s global_offset %f %f %f", map->name,
 		map->offset.x, map->offset.y, map->offset.z);
@@ -268,9 +283,23 @@ static void opensrcInit() {
 		PRINT("Failed to initialize render");
 		aAppTerminate(-1);
 	}
+	/* off by default, toggled with G and M where supported */
+	g.gpu_culling = renderSetGpuCulling(0);
+	g.multi_draw = renderSetMultiDraw(0);
 
 	bspInit();
 
+	g.bvh_maps = stackAlloc(&stack_persistent, sizeof(Map*) * g.maps_limit);
+	g.bvh_boxes = stackAlloc(&stack_persistent, sizeof(struct AABB) * g.maps_limit);
+	g.visible_maps = stackAlloc(&stack_persistent, sizeof(int) * g.maps_limit);
+	g.map_distance = stackAlloc(&stack_persistent, sizeof(float) * g.maps_limit);
+	if (!g.bvh_maps || !g.bvh_boxes || !g.visible_maps || !g.map_distance
+			|| !bvhInit(&g.maps_bvh, &stack_persistent, g.maps_limit)
+			|| !occlusionInit(&stack_persistent)) {
+		PRINT("Not enough memory");
+		aAppTerminate(-1);
+	}
+
 	if (BSPLoadResult_Success != loadMap(g.maps_begin, g.collection_chain))
 		aAppTerminate(-2);
 
@@ -297,6 +326,52 @@ static void opensrcResize(ATimeUs timestamp, unsigned int old_w, unsigned int ol
 	cameraRecompute(&g.camera);
 }
 
+static void opensrcRebuildMapsBVH() {
+	int count = 0;
+	for (Map *map = g.maps_begin; map; map = map->next) {
+		if (!(map->flags & MapFlags_Loaded) || (map->flags & MapFlags_Broken))
+			continue;
+
+		const struct AVec3f translation = aVec3fAdd(map->offset, map->debug_offset);
+		g.bvh_maps[count] = map;
+		g.bvh_boxes[count].min = aVec3fAdd(map->model.aabb.min, translation);
+		g.bvh_boxes[count].max = aVec3fAdd(map->model.aabb.max, translation);
+		++count;
+	}
+
+	bvhBuild(&g.maps_bvh, g.bvh_boxes, count);
+	g.maps_bvh_dirty = 0;
+}
+
+/* maps closest to the camera hide the most, only their occluders are rasterized */
+#define OPENSRC_OCCLUDER_MAPS 8
+
+static int opensrcMapDistanceCompare(const void *a, const void *b) {
+	const float da = g.map_distance[*(const int*)a], db = g.map_distance[*(const int*)b];
+	return da < db ? -1 : (da > db);
+}
+
+/* Near maps are drawn first, so that depth test rejects what they hide in far ones */
+static void opensrcSortVisibleMaps(int visible_count) {
+	for (int i = 0; i < visible_count; ++i) {
+		const int index = g.visible_maps[i];
+		g.map_distance[index] = bvhBoxDistance(g.bvh_boxes[index].min, g.bvh_boxes[index].max, g.camera.pos);
+	}
+	qsort(g.visible_maps, visible_count, sizeof(*g.visible_maps), opensrcMapDistanceCompare);
+}
+
+/* Rasterizes occluders of the closest of visible maps for software occlusion culling,
+ * visible maps are sorted by distance */
+static void opensrcRasterizeOccluders(int visible_count) {
+	occlusionBegin(&g.camera);
+	for (int i = 0; i < visible_count && i < OPENSRC_OCCLUDER_MAPS; ++i) {
+		const Map *map = g.bvh_maps[g.visible_maps[i]];
+		occlusionAddTriangles(map->model.occluders, map->model.occluders_count,
+			aVec3fAdd(map->offset, map->debug_offset));
+	}
+	occlusionRasterize();
+}
+
 static void opensrcPaint(ATimeUs timestamp, float dt) {
 	(void)(timestamp); (void)(dt);
 
@@ -306,19 +381,34 @@ static void opensrcPaint(ATimeUs timestamp, float dt) {
 
 	renderBegin();
 
-	int triangles = 0;
-	int can_load_map = 1;
+	/* one map is loaded per frame */
 	for (struct Map *map = g.maps_begin; map; map = map->next) {
-		if (map->flags & MapFlags_Broken)
+		if (map->flags & (MapFlags_Broken | MapFlags_Loaded))
 			continue;
 
-		if (!(map->flags & MapFlags_Loaded)) {
-			if (can_load_map) {
-				if (BSPLoadResult_Success != loadMap(map, g.collection_chain))
-					map->flags |= MapFlags_Broken;
-			}
+		if (BSPLoadResult_Success != loadMap(map, g.collection_chain))
+			map->flags |= MapFlags_Broken;
+		break;
+	}
+
+	if (g.maps_bvh_dirty)
+		opensrcRebuildMapsBVH();
+
+	struct CameraFrustum frustum;
+	cameraFrustum(&g.camera, aVec3ff(0), &frustum);
+	const int visible_count = bvhCullFrustum(&g.maps_bvh, g.bvh_boxes, &frustum, g.visible_maps);
+	const int closest = bvhClosest(&g.maps_bvh, g.bvh_boxes, g.camera.pos, NULL);
 
-			can_load_map = 0;
+	opensrcSortVisibleMaps(visible_count);
+	opensrcRasterizeOccluders(visible_count);
+
+	int occluded = 0;
+	for (int i = 0; i < visible_count; ++i) {
+		const int index = g.visible_maps[i];
+		Map *map = g.bvh_maps[index];
+		if (!occlusionVisible(g.bvh_boxes[index].min, g.bvh_boxes[index].max)
+				|| !renderOcclusionVisible(&map->occlusion, &g.camera, g.bvh_boxes[index].min, g.bvh_boxes[index].max)) {
+			++occluded;
 			continue;
 		}
 
@@ -329,15 +419,20 @@ static void opensrcPaint(ATimeUs timestamp, float dt) {
 		};
 
 		renderModelDraw(&params, &map->model);
-
-		for (int i = 0; i < map->model.detailed.draws_count; ++i)
-			triangles += map->model.detailed.draws[i].count / 3;
 	}
 
-	renderEnd(&g.camera);
+	renderEnd(&g.camera, closest >= 0 ? &g.bvh_maps[closest]->model : NULL);
 
 	if (profilerFrame(&stack_temp)) {
-		PRINTF("Total triangles: %d", triangles);
+		PRINTF("Total triangles: %d, maps: %d of %d in frustum, %d occluded",
+			renderGetTriangles(), visible_count, g.maps_bvh.items_count, occluded);
+		if (g.overdraw && renderGetOverdraw() >= 0.f)
+			PRINTF("Overdraw: %.2f fragments per pixel, depth prepass %s",
+				renderGetOverdraw(), g.depth_prepass ? "on" : "off");
+
+		int state_issued, state_skipped;
+		renderGetStateCalls(&state_issued, &state_skipped);
+		PRINTF("GL state calls: %d made, %d skipped", state_issued, state_skipped);
 	}
 }
 
@@ -381,6 +476,28 @@ static void opensrcKeyPress(ATimeUs timestamp, AKey key, int pressed) {
 		case AK_Q:
 			g.selected_map = NULL;
 			break;
+		case AK_P:
+			g.depth_prepass = !g.depth_prepass;
+			renderSetDepthPrepass(g.depth_prepass);
+			PRINTF("Depth prepass %s", g.depth_prepass ? "on" : "off");
+			break;
+		case AK_O:
+			g.overdraw = !g.overdraw;
+			renderSetOverdraw(g.overdraw);
+			break;
+		case AK_G:
+			if (!renderSupportsGpuCulling()) {
+				PRINT("GPU culling is not supported");
+				break;
+			}
+			g.gpu_culling = renderSetGpuCulling(!g.gpu_culling);
+			PRINTF("GPU culling %s", g.gpu_culling ? "on" : "off");
+			break;
+		case AK_M:
+			/* compare "detailed submit" profiler times */
+			g.multi_draw = renderSetMultiDraw(!g.multi_draw);
+			PRINTF("Multi draw %s", g.multi_draw ? "on" : "off");
+			break;
 		default: break;
 		}
 
@@ -1,96 +1,234 @@
 #include "atlas.h"
 
-struct AtlasRect { unsigned int x, y, w, h; };
+/* a page never has more segments than pixel columns, nor more than rects placed + 1 */
+static unsigned int atlasSegmentsCapacity(unsigned int rects_count, unsigned int width) {
+	return 1 + (rects_count < width ? rects_count : width);
+}
+
+unsigned int atlasTempSize(unsigned int rects_count, unsigned int max_rect_side,
+		unsigned int width, unsigned int max_pages) {
+	if (max_pages < 1) max_pages = 1;
+	return sizeof(unsigned int) * (max_rect_side + 1) /* counting sort buckets */
+		+ sizeof(unsigned int) * 2 * rects_count /* sort order + scratch */
+		+ sizeof(unsigned int) * max_pages /* segments count per page */
+		+ sizeof(struct AtlasSegment) * atlasSegmentsCapacity(rects_count, width) * max_pages;
+}
+
+static const struct AtlasVec *atlasRect(const struct AtlasContext *context, unsigned int index) {
+	return (const void*)((const char*)context->rects + index * context->rects_stride);
+}
+
+/* stable counting sort of order[] by a rect side, larger first */
+static void atlasSortBySide(const struct AtlasContext *context, unsigned int *counts, unsigned int max_side,
+		const unsigned int *order, unsigned int *sorted, int use_height) {
+	for (unsigned int i = 0; i <= max_side; ++i)
+		counts[i] = 0;
+
+	for (unsigned int i = 0; i < context->rects_count; ++i) {
+		const struct AtlasVec *r = atlasRect(context, order[i]);
+		++counts[max_side - (use_height ? r->y : r->x)];
+	}
+
+	unsigned int offset = 0;
+	for (unsigned int i = 0; i <= max_side; ++i) {
+		const unsigned int count = counts[i];
+		counts[i] = offset;
+		offset += count;
+	}
+
+	for (unsigned int i = 0; i < context->rects_count; ++i) {
+		const struct AtlasVec *r = atlasRect(context, order[i]);
+		sorted[counts[max_side - (use_height ? r->y : r->x)]++] = order[i];
+	}
+}
+
+struct AtlasFit {
+	unsigned int segment;
+	unsigned int y, top;
+	unsigned int waste;
+};
+
+/* find the lowest position for item on a skyline, least wasted area breaks ties
+ * returns 0 if it doesn't fit */
+static int atlasSkylineFind(const struct AtlasSegment *segs, unsigned int segs_count,
+		unsigned int width, unsigned int height, struct AtlasVec item, struct AtlasFit *fit) {
+	int found = 0;
+	for (unsigned int j = 0; j < segs_count && segs[j].x + item.x <= width; ++j) {
+		const unsigned int span_end = segs[j].x + item.x;
+		unsigned int y = segs[j].y;
+		for (unsigned int k = j + 1; k < segs_count && segs[k].x < span_end; ++k)
+			if (segs[k].y > y) y = segs[k].y;
+
+		const unsigned int top = y + item.y;
+		if (top > height || (found && top > fit->top))
+			continue;
+
+		unsigned int waste = 0;
+		for (unsigned int k = j; k < segs_count && segs[k].x < span_end; ++k) {
+			const unsigned int right = segs[k].x + segs[k].w;
+			waste += (y - segs[k].y) * ((right < span_end ? right : span_end) - segs[k].x);
+		}
+
+		if (!found || top < fit->top || waste < fit->waste) {
+			found = 1;
+			fit->segment = j;
+			fit->y = y;
+			fit->top = top;
+			fit->waste = waste;
+		}
+	}
+
+	return found;
+}
+
+/* raise the skyline over a found fit, returns 1 if the fit exactly covered a segment */
+static int atlasSkylinePlace(struct AtlasSegment *segs, unsigned int *segs_count,
+		struct AtlasVec item, const struct AtlasFit *fit) {
+	const unsigned int best = fit->segment;
+	const unsigned int x = segs[best].x;
+	const unsigned int end = x + item.x;
+
+	/* drop covered segments, trim the partially covered one */
+	unsigned int last = best;
+	while (last < *segs_count && segs[last].x + segs[last].w <= end)
+		++last;
+
+	const int exact = last == best + 1 && segs[best].w == item.x;
+
+	if (last < *segs_count && segs[last].x < end) {
+		segs[last].w -= end - segs[last].x;
+		segs[last].x = end;
+	}
+
+	/* segments [best, last) are replaced by the new one */
+	if (last == best) {
+		for (unsigned int k = *segs_count; k > best; --k)
+			segs[k] = segs[k - 1];
+		++*segs_count;
+	} else if (last > best + 1) {
+		const unsigned int removed = last - best - 1;
+		for (unsigned int k = best + 1; k + removed < *segs_count; ++k)
+			segs[k] = segs[k + removed];
+		*segs_count -= removed;
+	}
+
+	segs[best].x = x;
+	segs[best].y = fit->top;
+	segs[best].w = item.x;
+
+	/* merge with neighbours at the same level */
+	if (best + 1 < *segs_count && segs[best + 1].y == fit->top) {
+		segs[best].w += segs[best + 1].w;
+		for (unsigned int k = best + 1; k + 1 < *segs_count; ++k)
+			segs[k] = segs[k + 1];
+		--*segs_count;
+	}
+	if (best > 0 && segs[best - 1].y == fit->top) {
+		segs[best - 1].w += segs[best].w;
+		for (unsigned int k = best; k + 1 < *segs_count; ++k)
+			segs[k] = segs[k + 1];
+		--*segs_count;
+	}
+
+	return exact;
+}
 
 /* temp memory is freed by caller */
 enum AtlasResult atlasCompute(const struct AtlasContext* context) {
-	const unsigned int max_rects_count = 1 + context->rects_count;
-	unsigned int rects_count = 1;
-	if (context->temp_storage.size < sizeof(struct AtlasRect) * max_rects_count)
+	const unsigned int max_pages = context->page ? (context->max_pages > 0 ? context->max_pages : 1) : 1;
+
+	unsigned int max_side = 0;
+	for (unsigned int i = 0; i < context->rects_count; ++i) {
+		const struct AtlasVec *r = atlasRect(context, i);
+		if (r->x > max_side) max_side = r->x;
+		if (r->y > max_side) max_side = r->y;
+	}
+
+	if (context->temp_storage.size < atlasTempSize(context->rects_count, max_side, context->width, max_pages))
 		return Atlas_ErrorInsufficientTemp;
-	struct AtlasRect *rects = context->temp_storage.ptr;
 
-	rects[0].x = rects[0].y = 0;
-	rects[0].w = context->width; rects[0].h = context->height;
+	unsigned int *const counts = context->temp_storage.ptr;
+	unsigned int *const order = counts + max_side + 1;
+	unsigned int *const scratch = order + context->rects_count;
+	unsigned int *const page_segs_count = scratch + context->rects_count;
+	struct AtlasSegment *const segs = (void*)(page_segs_count + max_pages);
+	const unsigned int segs_capacity = atlasSegmentsCapacity(context->rects_count, context->width);
+
+	/* sort by height, then by width, tallest and widest first */
+	for (unsigned int i = 0; i < context->rects_count; ++i)
+		scratch[i] = i;
+	atlasSortBySide(context, counts, max_side, scratch, order, 0);
+	atlasSortBySide(context, counts, max_side, order, scratch, 1);
+
+	struct AtlasStats stats = { 0, 0, { 0, 0 }, 0, 0 };
 
 	for (unsigned int i = 0; i < context->rects_count; ++i) {
-		const struct AtlasVec * const item = (void*)((char*)context->rects + i * context->rects_stride);
-		const unsigned int area = item->x * item->y;
-
-		/* find best fit for this rect */
-		struct AtlasRect *fit = 0;
-		struct AtlasRect *first_empty = 0; /* optimization */
-		unsigned int wasted_area = context->width * context->height;
-		for (unsigned int j = 0; j < rects_count; ++j) {
-			struct AtlasRect *const r = rects + j;
-			if (!first_empty && (!r->w || !r->h)) first_empty = r;
-
-			if (r->w < item->x || r->h < item->y)
-				continue;
-
-			/* exact match is the best */
-			if (r->w == item->x && r->h == item->y) {
-				fit = r;
+		const unsigned int index = scratch[i];
+		const struct AtlasVec item = *atlasRect(context, index);
+
+		/* first page that fits wins, open a new one when none does */
+		struct AtlasFit fit;
+		unsigned int page = 0;
+		for (; page < stats.pages; ++page)
+			if (atlasSkylineFind(segs + page * segs_capacity, page_segs_count[page],
+						context->width, context->height, item, &fit))
 				break;
-			}
-
-			const unsigned int r_area = r->w * r->h;
-			const unsigned int fit_waste = r_area - area;
-			if (!fit || ((r->w < fit->w || r->h < fit->h) && (fit_waste <= wasted_area))) {
-				wasted_area = fit_waste;
-				fit = r;
-			}
-		} /* find best fit in all empty rects */
-
-		if (!fit)
-			/* cannot allocate space for this lightmap fragment */
-			return Atlas_ErrorDoesntFit;
-
-		struct AtlasVec * const pos = (void*)((char*)context->pos + i * context->pos_stride);
-
-		pos->x = fit->x;
-		pos->y = fit->y;
-
-		/* how to split */
-		unsigned int rem_width = fit->w - item->x;
-		unsigned int rem_height = fit->h - item->y;
-		if (!rem_width && !rem_height) {
-			fit->w = fit->h = 0;
-			continue;
+
+		if (page == stats.pages) {
+			if (stats.pages == max_pages)
+				/* cannot allocate space for this lightmap fragment */
+				return Atlas_ErrorDoesntFit;
+
+			struct AtlasSegment *const page_segs = segs + page * segs_capacity;
+			page_segs[0].x = page_segs[0].y = 0;
+			page_segs[0].w = context->width;
+			page_segs_count[page] = 1;
+			++stats.pages;
+
+			if (!atlasSkylineFind(page_segs, 1, context->width, context->height, item, &fit))
+				return Atlas_ErrorDoesntFit;
 		}
 
-		if (rem_width && rem_height && !first_empty)
-			first_empty = rects + (rects_count++);
-
-		/* split! */
-		if (rem_width > rem_height) {
-			if (rem_height) {
-				first_empty->x = fit->x + item->x;
-				first_empty->y = fit->y;
-				first_empty->w = rem_width;
-				first_empty->h = fit->h;
-				fit->y += item->y;
-				fit->w = item->x;
-				fit->h = rem_height;
-			} else {
-				fit->x += item->x;
-				fit->w = rem_width;
-			}
-		} else {
-			if (rem_width) {
-				first_empty->x = fit->x;
-				first_empty->y = fit->y + item->y;
-				first_empty->w = fit->w;
-				first_empty->h = rem_height;
-				fit->x += item->x;
-				fit->w = rem_width;
-				fit->h = item->y;
-			} else {
-				fit->y += item->y;
-				fit->h = rem_height;
-			}
-		} /* split */
+		struct AtlasSegment *const page_segs = segs + page * segs_capacity;
+		struct AtlasVec * const pos = (void*)((char*)context->pos + index * context->pos_stride);
+		pos->x = page_segs[fit.segment].x;
+		pos->y = fit.y;
+		if (context->page)
+			*(unsigned int*)((char*)context->page + index * context->page_stride) = page;
+
+		stats.used_pixels += item.x * item.y;
+		stats.wasted_pixels += fit.waste;
+		if (pos->x + item.x > stats.extent.x) stats.extent.x = pos->x + item.x;
+		if (fit.top > stats.extent.y) stats.extent.y = fit.top;
+
+		stats.exact_matches += atlasSkylinePlace(page_segs, page_segs_count + page, item, &fit);
 	} /* for all input rects */
 
+	if (context->stats)
+		*context->stats = stats;
+
+	return Atlas_Success;
+}
+
+void atlasPageInit(struct AtlasPage *page, unsigned int width, unsigned int height) {
+	page->width = width;
+	page->height = height;
+	page->segments_count = 1;
+	page->segments[0].x = page->segments[0].y = 0;
+	page->segments[0].w = width;
+}
+
+enum AtlasResult atlasPageInsert(struct AtlasPage *page, struct AtlasVec size, struct AtlasVec *pos) {
+	/* placing a rect adds at most one segment */
+	if (page->segments_count == ATLAS_PAGE_MAX_SEGMENTS)
+		return Atlas_ErrorDoesntFit;
+
+	struct AtlasFit fit;
+	if (!atlasSkylineFind(page->segments, page->segments_count, page->width, page->height, size, &fit))
+		return Atlas_ErrorDoesntFit;
+
+	pos->x = page->segments[fit.segment].x;
+	pos->y = fit.y;
+	atlasSkylinePlace(page->segments, &page->segments_count, size, &fit);
 	return Atlas_Success;
 }
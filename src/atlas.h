@@ -9,14 +9,30 @@ enum AtlasResult {
 
 struct AtlasVec { unsigned int x, y; };
 
+/* horizontal skyline segment: everything below y in [x, x + w) is occupied */
+struct AtlasSegment { unsigned int x, y, w; };
+
+struct AtlasStats {
+	/* sum of areas of all input rects */
+	unsigned int used_pixels;
+	/* pixels left unreachable below the skyline */
+	unsigned int wasted_pixels;
+	/* bounding box of all placed rects on all pages, atlas can be cropped to it */
+	struct AtlasVec extent;
+	/* rects that covered a skyline segment exactly */
+	unsigned int exact_matches;
+	/* pages that were actually used */
+	unsigned int pages;
+};
+
 struct AtlasContext {
 	/* temporary buffer/scrap space for atlas to use */
-	/* worst case consumption: 4 * sizeof(unsigned int) * (1 + rects_count) */
+	/* worst case consumption: see atlasTempSize() */
 	struct {
 		void *ptr;
 		unsigned int size;
 	} temp_storage;
-	
+
 	/* input */
 	unsigned int width, height;
 	const struct AtlasVec *rects;
@@ -26,16 +42,38 @@ struct AtlasContext {
 	/* output */
 	struct AtlasVec *pos;
 	unsigned int pos_stride;
-};
 
-/* TODO ?
-struct AtlasStats {
-	unsigned int wasted_pixels;
-	struct AtlasVec min_waste, max_waste;
-	unsigned int exact_matches;
+	/* optional: when set, rects that don't fit spill into up to max_pages
+	 * pages of width x height each, and the page index of each rect is written here */
+	unsigned int *page;
+	unsigned int page_stride;
+	unsigned int max_pages;
+
+	/* optional output, can be NULL */
+	struct AtlasStats *stats;
 };
-*/
 
+/* how much temp_storage atlasCompute() may need for the given input */
+unsigned int atlasTempSize(unsigned int rects_count, unsigned int max_rect_side,
+		unsigned int width, unsigned int max_pages);
+
+/* Skyline bottom-left packer. Rects are placed tallest first,
+ * free space is tracked as a list of skyline segments ordered by x */
 enum AtlasResult atlasCompute(const struct AtlasContext* context);
 
+#define ATLAS_PAGE_MAX_SEGMENTS 256
+
+/* Single skyline page that keeps its state between insertions,
+ * e.g. for an atlas that is shared by several loads */
+struct AtlasPage {
+	unsigned int width, height;
+	unsigned int segments_count;
+	struct AtlasSegment segments[ATLAS_PAGE_MAX_SEGMENTS];
+};
+
+void atlasPageInit(struct AtlasPage *page, unsigned int width, unsigned int height);
+
+/* returns Atlas_ErrorDoesntFit when there's no room left, or skyline got too fragmented */
+enum AtlasResult atlasPageInsert(struct AtlasPage *page, struct AtlasVec size, struct AtlasVec *pos);
+
 #endif /* ATLAS_H__INCLUDED */
@@ -1,13 +1,26 @@
 #include "bsp.h"
 #include "atlas.h"
+#include "dxt.h"
+#include "etcpack.h"
+#include "meshopt.h"
 #include "vbsp.h"
 #include "collection.h"
 #include "mempools.h"
 #include "vmfparser.h"
 #include "common.h"
+#include "profiler.h"
 
 // DEBUG
 #include "texture.h"
+#include "atto/app.h"
+
+#include <float.h> /* FLT_MAX */
+#include <stdlib.h> /* qsort */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BSP_SSE
+#include <emmintrin.h>
+#endif
 
 #define R2S(r) bspLoadResultString(r)
 
@@ -35,7 +48,7 @@ struct Lumps {
 	BSPLUMP(Plane, struct VBSPLumpPlane, planes); \
 	BSPLUMP(TexData, struct VBSPLumpTexData, texdata); \
 	BSPLUMP(Vertex, struct VBSPLumpVertex, vertices); \
-	\
+	BSPLUMP(Visibility, uint8_t, visibility); \
 	BSPLUMP(Node, struct VBSPLumpNode, nodes); \
 	BSPLUMP(TexInfo, struct VBSPLumpTexInfo, texinfos); \
 	BSPLUMP(Face, struct VBSPLumpFace, faces); \
@@ -68,23 +81,41 @@ struct Lumps {
 #undef BSPLUMP
 };
 
-/* data needed for making lightmap atlas */
-struct Face {
-	const struct VBSPLumpFace *vface;
+/* Face metadata as parallel arrays of faces_count entries each,
+ * so that every pass streams through only the fields it needs */
+struct Faces {
 	/* read directly from lumps */
-	int vertices;
-	int indices;
-	int width, height;
-	const struct VBSPLumpLightMap *samples;
-	const struct VBSPLumpTexInfo *texinfo;
-	const struct VBSPLumpTexData *texdata;
-	const struct VBSPLumpDispInfo *dispinfo;
-	int dispquadvtx[4]; // filled only when displaced
-	int dispstartvtx;
-	const Material *material;
+	const struct VBSPLumpFace **vface;
+	const struct VBSPLumpTexInfo **texinfo;
+	const struct VBSPLumpDispInfo **dispinfo; /* NULL when not displaced */
+	const struct VBSPLumpLightMap **samples;
+	const Material **material;
+	int *vertices;
+	int *indices;
+	/* lightmap size in luxels */
+	struct AtlasVec *lightmap_size;
+	/* offset into LoadModelContext.corners */
+	unsigned int *first_corner;
+
+	/* lightmap rect in atlas, including padding and alignment */
+	struct AtlasVec *atlas_size;
 
 	/* filled as a result of atlas allocation */
-	int atlas_x, atlas_y;
+	struct AtlasVec *atlas_pos;
+	unsigned int *atlas_page;
+
+	/* see bspFaceDrawKey() */
+	uint32_t *draw_key;
+	/* see bspLoadModelNodes() */
+	unsigned int *group;
+};
+
+/* full precision vertex, packed into BSPModelVertex once the whole model is generated */
+struct LoadVertex {
+	struct AVec3f vertex;
+	struct AVec2f lightmap_uv;
+	struct AVec2f tex_uv;
+	uint16_t average_color;
 };
 
 struct LoadModelContext {
@@ -92,8 +123,14 @@ struct LoadModelContext {
 	struct ICollection *collection;
 	const struct Lumps *lumps;
 	const struct VBSPLumpModel *model;
-	struct Face *faces;
+	/* resolved once per texdata entry, NULL for unused ones */
+	const Material **texdata_materials;
+	struct Faces faces;
 	int faces_count;
+	/* lump vertex indices of all face polygons, validated while preloading,
+	 * so that vertex generation doesn't walk surfedges again. Displacement
+	 * corners are rotated so that the first one is at dispinfo->start_pos */
+	const uint32_t *corners;
 	int vertices;
 	int indices;
 	int max_draw_vertices;
@@ -101,24 +138,67 @@ struct LoadModelContext {
 		int pixels;
 		int max_width;
 		int max_height;
-		RTexture texture;
 	} lightmap;
 };
 
 enum FacePreload {
 	FacePreload_Ok,
 	FacePreload_Skip,
-	FacePreload_Inconsistent
+	FacePreload_Inconsistent,
+	FacePreload_OutOfMemory
 };
 
+#ifdef ATTO_PLATFORM_RPI
+/* ETC1 textures cannot be updated partially, so every map region gets its own page */
+#define BSP_MAX_SHARED_LIGHTMAP_PAGES 256
+#else
+#define BSP_MAX_SHARED_LIGHTMAP_PAGES 16
+#endif
+
 static struct {
 	const Material *coarse_material;
+	unsigned int lightmap_page_side;
+	/* compressed one if supported, RGB565 otherwise */
+	RTexFormat lightmap_format;
+	/* lightmaps of all loaded maps live in these pages */
+	struct {
+		int pages_count;
+		/* pages past pages_count may have a texture left by a map that failed to load */
+		int textures_count;
+		struct {
+			RTexture texture;
+#ifndef ATTO_PLATFORM_RPI
+			struct AtlasPage atlas;
+#endif
+		} pages[BSP_MAX_SHARED_LIGHTMAP_PAGES];
+	} lightmap_atlas;
 	struct {
 		int color[256];
 		int exponent[256];
 	} lightmap_tables;
 } bsp_global;
 
+#ifdef ATTO_PLATFORM_RPI
+const int c_max_draw_vertices = 65536;
+#else
+/* 32 bit indices, never split */
+const int c_max_draw_vertices = 0x7fffffff;
+#endif
+
+/* Face lightmaps are surrounded by a copy of their edge luxels so that
+ * bilinear filtering doesn't bleed from neighbours, and are aligned to 4 luxels
+ * so that compression blocks and the first two mip levels don't mix faces */
+const int c_lightmap_padding = 1;
+#ifdef ATTO_PLATFORM_RPI
+/* GLES2 needs complete mip chains, levels past 2x downscale will mix faces */
+const int c_lightmap_mip_levels = 32;
+#else
+/* the padding protects no more levels than these */
+const int c_lightmap_mip_levels = 2;
+/* regions are aligned so that they are block aligned at the last mip level */
+const unsigned int c_lightmap_region_align = 4 << 1;
+#endif
+
 static inline int shouldSkipFace(const struct VBSPLumpFace *face, const struct Lumps *lumps) {
 	(void)(face); (void)(lumps);
 	//const struct VBSPLumpTexInfo *tinfo = lumps->texinfos.p + face->texinfo;
@@ -126,61 +206,58 @@ static inline int shouldSkipFace(const struct VBSPLumpFace *face, const struct L
 		|| face->lightmap_offset < 4;
 }
 
-static enum FacePreload bspFacePreloadMetadata(struct LoadModelContext *ctx,
-		struct Face *face, unsigned index) {
+static enum FacePreload bspFacePreloadMetadata(struct LoadModelContext *ctx, unsigned index) {
 	const struct Lumps * const lumps = ctx->lumps;
+	struct Faces * const faces = &ctx->faces;
+	const int slot = ctx->faces_count;
 #define FACE_CHECK(cond) \
 	if (!(cond)) { PRINTF("F%u: check failed: (%s)", index, #cond); return FacePreload_Inconsistent; }
 	FACE_CHECK(index < lumps->faces.n);
 
 	const struct VBSPLumpFace * const vface = lumps->faces.p + index;
-	face->vface = vface;
+	faces->vface[slot] = vface;
 
 	if (vface->texinfo < 0) return FacePreload_Skip;
 	FACE_CHECK((unsigned)vface->texinfo < lumps->texinfos.n);
-	face->texinfo = lumps->texinfos.p + vface->texinfo;
+	const struct VBSPLumpTexInfo * const texinfo = lumps->texinfos.p + vface->texinfo;
+	faces->texinfo[slot] = texinfo;
 
 	if (shouldSkipFace(vface, lumps)) return FacePreload_Skip;
-	FACE_CHECK(face->texinfo->texdata < lumps->texdata.n);
-	face->texdata = lumps->texdata.p + face->texinfo->texdata;
-
-	FACE_CHECK(face->texdata->name_string_table_id < lumps->texdatastringtable.n);
-	const int32_t texdatastringdata_offset = lumps->texdatastringtable.p[face->texdata->name_string_table_id];
-	FACE_CHECK(texdatastringdata_offset >= 0 && (uint32_t)texdatastringdata_offset < lumps->texdatastringdata.n);
-	/* FIXME validate string: has \0 earlier than end */
-	const char *texture = lumps->texdatastringdata.p + texdatastringdata_offset;
-	//PRINTF("F%u: texture %s", index, face->texture);
-	face->material = materialGet(texture, ctx->collection, ctx->tmp);
-	if (!face->material)
+	FACE_CHECK(texinfo->texdata < lumps->texdata.n);
+
+	faces->material[slot] = ctx->texdata_materials[texinfo->texdata];
+	if (!faces->material[slot])
 		return FacePreload_Skip;
 
+	const struct VBSPLumpDispInfo *dispinfo = 0;
 	if (vface->dispinfo >= 0) {
 		FACE_CHECK((unsigned)vface->dispinfo < lumps->dispinfos.n);
-		face->dispinfo = lumps->dispinfos.p + vface->dispinfo;
-		const int side = (1 << face->dispinfo->power) + 1;
+		dispinfo = lumps->dispinfos.p + vface->dispinfo;
+		FACE_CHECK(dispinfo->power >= 2 && dispinfo->power <= 4);
+		const int side = (1 << dispinfo->power) + 1;
 		FACE_CHECK(vface->num_edges == 4);
-		face->vertices = side * side;
-		face->indices = (side - 1) * (side - 1) * 6; /* triangle list */
+		FACE_CHECK(dispinfo->vtx_start >= 0 && (uint32_t)dispinfo->vtx_start <= lumps->dispverts.n
+			&& lumps->dispverts.n - dispinfo->vtx_start >= (uint32_t)(side * side));
+		faces->vertices[slot] = side * side;
+		faces->indices[slot] = (side - 1) * (side - 1) * 6; /* triangle list */
 
 		/* TODO
 		 * some of the episode 2 maps have the min_tess set to flag mode, and flags are 0xe
 		 *
-		if (face->dispinfo->min_tess != 0) {
-			if ((uint32_t)face->dispinfo->min_tess & 0x80000000u) {
-				if ((uint32_t)face->dispinfo->min_tess & 0x7fffffffu)
-					PRINTF("min_tess has flags: %x", (uint32_t)face->dispinfo->min_tess & 0x7fffffffu);
+		if (dispinfo->min_tess != 0) {
+			if ((uint32_t)dispinfo->min_tess & 0x80000000u) {
+				if ((uint32_t)dispinfo->min_tess & 0x7fffffffu)
+					PRINTF("min_tess has flags: %x", (uint32_t)dispinfo->min_tess & 0x7fffffffu);
 			} else
 				PRINTF("Power: %d, min_tess: %d, vertices: %d",
-					face->dispinfo->power, face->dispinfo->min_tess, face->vertices);
+					dispinfo->power, dispinfo->min_tess, faces->vertices[slot]);
 		}
 		*/
-
-		face->dispstartvtx = 0;
 	} else {
-		face->dispinfo = 0;
-		face->vertices = vface->num_edges;
-		face->indices = (face->vertices - 2) * 3;
+		faces->vertices[slot] = vface->num_edges;
+		faces->indices[slot] = (vface->num_edges - 2) * 3;
 	}
+	faces->dispinfo[slot] = dispinfo;
 
 	/* Check for basic reference consistency */
 	FACE_CHECK(vface->plane < lumps->planes.n);
@@ -195,8 +272,17 @@ static enum FacePreload bspFacePreloadMetadata(struct LoadModelContext *ctx,
 	const unsigned sample_offset = vface->lightmap_offset / sizeof(struct VBSPLumpLightMap);
 	FACE_CHECK(sample_offset < lumps->lightmaps.n && lumps->lightmaps.n - sample_offset >= lightmap_size);
 
+	/* corners are appended right after previous faces' ones */
+	uint32_t * const corners = stackAlloc(ctx->tmp, sizeof(uint32_t) * vface->num_edges);
+	if (!corners) {
+		PRINTF("Error: cannot allocate %zu temp bytes", sizeof(uint32_t) * vface->num_edges);
+		return FacePreload_OutOfMemory;
+	}
+	faces->first_corner[slot] = corners - ctx->corners;
+
 	const int32_t *surfedges = lumps->surfedges.p + vface->first_edge;
 	unsigned int prev_end = 0xffffffffu;
+	int dispstartvtx = 0;
 	for (int i = 0; i < vface->num_edges; ++i) {
 		uint32_t edge_index;
 		int istart;
@@ -218,36 +304,52 @@ static enum FacePreload bspFacePreloadMetadata(struct LoadModelContext *ctx,
 		const unsigned int vstart = lumps->edges.p[edge_index].v[istart];
 		const unsigned int vend = lumps->edges.p[edge_index].v[1^istart];
 
-		if (face->dispinfo) {
-			face->dispquadvtx[i] = vstart;
-			if (fabs(lumps->vertices.p[vstart].x - face->dispinfo->start_pos.x) < .5f
-					&& fabs(lumps->vertices.p[vstart].y - face->dispinfo->start_pos.y) < .5f
-					&& fabs(lumps->vertices.p[vstart].z - face->dispinfo->start_pos.z) < .5f) {
-				face->dispstartvtx = i;
-			}
-		}
-
 		FACE_CHECK(vstart < lumps->vertices.n);
 		FACE_CHECK(prev_end == 0xffffffffu || prev_end == vstart);
 
+		corners[i] = vstart;
+		if (dispinfo
+				&& fabs(lumps->vertices.p[vstart].x - dispinfo->start_pos.x) < .5f
+				&& fabs(lumps->vertices.p[vstart].y - dispinfo->start_pos.y) < .5f
+				&& fabs(lumps->vertices.p[vstart].z - dispinfo->start_pos.z) < .5f) {
+			dispstartvtx = i;
+		}
+
 		prev_end = vend;
 	}
 
-	face->width = lm_width;
-	face->height = lm_height;
-	face->samples = lumps->lightmaps.p + sample_offset;
-	if (lm_width > ctx->lightmap.max_width) ctx->lightmap.max_width = lm_width;
-	if (lm_height > ctx->lightmap.max_height) ctx->lightmap.max_height = lm_height;
+	if (dispinfo) {
+		const uint32_t quad[4] = { corners[0], corners[1], corners[2], corners[3] };
+		for (int i = 0; i < 4; ++i)
+			corners[i] = quad[(dispstartvtx + i) % 4];
+	}
+
+	faces->lightmap_size[slot].x = lm_width;
+	faces->lightmap_size[slot].y = lm_height;
+	faces->samples[slot] = lumps->lightmaps.p + sample_offset;
 
-	ctx->lightmap.pixels += lightmap_size;
-	ctx->vertices += face->vertices;
-	ctx->indices += face->indices;
+	struct AtlasVec * const atlas_size = faces->atlas_size + slot;
+	atlas_size->x = (lm_width + 2 * c_lightmap_padding + 3) & ~3u;
+	atlas_size->y = (lm_height + 2 * c_lightmap_padding + 3) & ~3u;
+	if ((int)atlas_size->x > ctx->lightmap.max_width) ctx->lightmap.max_width = atlas_size->x;
+	if ((int)atlas_size->y > ctx->lightmap.max_height) ctx->lightmap.max_height = atlas_size->y;
+
+	ctx->lightmap.pixels += atlas_size->x * atlas_size->y;
+	ctx->vertices += faces->vertices[slot];
+	ctx->indices += faces->indices[slot];
 	ctx->faces_count++;
 
 	return FacePreload_Ok;
 }
 
-const int c_max_draw_vertices = 65536;
+/* smaller lightmap pages are friendlier to texture caches of small GPUs,
+ * large ones let more maps share a single page */
+#ifdef ATTO_PLATFORM_RPI
+const unsigned int c_max_lightmap_page_side = 1024;
+#else
+const unsigned int c_max_lightmap_page_side = 4096;
+#endif
+const unsigned int c_max_lightmap_pages = 16;
 
 static int scaleLightmapColor(int c, int exp) {
 	const int c2 =
@@ -259,26 +361,106 @@ static int scaleLightmapColor(int c, int exp) {
 	return c2 < 255 ? c2 : 255;
 }
 
+/* Resolves materials for all texdata entries referenced by visible faces of the model,
+ * each unique name only once. Face preload then only indexes into the table */
+static enum BSPLoadResult bspLoadModelMaterials(struct LoadModelContext *ctx) {
+	const struct Lumps * const lumps = ctx->lumps;
+	const Material **const materials = stackAlloc(ctx->tmp, sizeof(*materials) * lumps->texdata.n);
+	/* several texdata entries may share a name */
+	const Material **const by_name = stackAlloc(ctx->tmp, sizeof(*by_name) * lumps->texdatastringtable.n);
+	char *const resolved = stackAlloc(ctx->tmp, lumps->texdatastringtable.n);
+	if (!materials || !by_name || !resolved)
+		return BSPLoadResult_ErrorTempMemory;
+
+	for (unsigned int i = 0; i < lumps->texdata.n; ++i)
+		materials[i] = 0;
+	memset(resolved, 0, lumps->texdatastringtable.n);
+
+	int unique = 0;
+	for (int i = 0; i < ctx->model->num_faces; ++i) {
+		const unsigned int index = ctx->model->first_face + i;
+		if (index >= lumps->faces.n)
+			break; /* reported by bspFacePreloadMetadata() */
+
+		const struct VBSPLumpFace * const vface = lumps->faces.p + index;
+		if (vface->texinfo < 0 || (unsigned)vface->texinfo >= lumps->texinfos.n || shouldSkipFace(vface, lumps))
+			continue;
+
+		const uint32_t texdata_index = lumps->texinfos.p[vface->texinfo].texdata;
+		if (texdata_index >= lumps->texdata.n || materials[texdata_index])
+			continue;
+
+		const uint32_t name_id = lumps->texdata.p[texdata_index].name_string_table_id;
+		if (name_id >= lumps->texdatastringtable.n) {
+			PRINTF("Error: texdata %u references string %u > max strings %u",
+				texdata_index, name_id, lumps->texdatastringtable.n);
+			return BSPLoadResult_ErrorFileFormat;
+		}
+
+		if (!resolved[name_id]) {
+			const int32_t offset = lumps->texdatastringtable.p[name_id];
+			if (offset < 0 || (uint32_t)offset >= lumps->texdatastringdata.n) {
+				PRINTF("Error: texdata string %u has invalid offset %d", name_id, offset);
+				return BSPLoadResult_ErrorFileFormat;
+			}
+
+			/* FIXME validate string: has \0 earlier than end */
+			by_name[name_id] = materialGet(lumps->texdatastringdata.p + offset, ctx->collection, ctx->tmp);
+			resolved[name_id] = 1;
+			++unique;
+		}
+
+		materials[texdata_index] = by_name[name_id];
+	}
+
+	PRINTF("Materials: %d unique names for %u texdata entries", unique, lumps->texdata.n);
+
+	stackFreeUpToPosition(ctx->tmp, by_name);
+	ctx->texdata_materials = materials;
+	return BSPLoadResult_Success;
+}
+
 static enum BSPLoadResult bspLoadModelPreloadFaces(struct LoadModelContext *ctx) {
-	ctx->faces = stackGetCursor(ctx->tmp);
+	struct Faces * const faces = &ctx->faces;
+	const int capacity = ctx->model->num_faces;
+
+#define FACES_ALLOC(field) \
+	faces->field = stackAlloc(ctx->tmp, sizeof(*faces->field) * capacity); \
+	if (!faces->field) { \
+		PRINTF("Error: cannot allocate %zu temp bytes for " #field, sizeof(*faces->field) * capacity); \
+		return BSPLoadResult_ErrorTempMemory; \
+	}
+	FACES_ALLOC(vface);
+	FACES_ALLOC(texinfo);
+	FACES_ALLOC(dispinfo);
+	FACES_ALLOC(samples);
+	FACES_ALLOC(material);
+	FACES_ALLOC(vertices);
+	FACES_ALLOC(indices);
+	FACES_ALLOC(lightmap_size);
+	FACES_ALLOC(first_corner);
+	FACES_ALLOC(atlas_size);
+	FACES_ALLOC(atlas_pos);
+	FACES_ALLOC(atlas_page);
+	FACES_ALLOC(draw_key);
+	FACES_ALLOC(group);
+#undef FACES_ALLOC
+
+	/* grows with every preloaded face, nothing else is allocated until preload is done */
+	ctx->corners = stackGetCursor(ctx->tmp);
 
 	int current_draw_vertices = 0;
 
 	for (int i = 0; i < ctx->model->num_faces; ++i) {
-		struct Face face;
-		const enum FacePreload result = bspFacePreloadMetadata(ctx, &face, ctx->model->first_face + i);
+		const enum FacePreload result = bspFacePreloadMetadata(ctx, ctx->model->first_face + i);
 		if (result == FacePreload_Ok) {
-			current_draw_vertices += face.vertices;
-
-			struct Face *stored_face = stackAlloc(ctx->tmp, sizeof(struct Face));
-			if (!stored_face) {
-				PRINTF("Error: cannot allocate %zu temp bytes", sizeof(struct Face));
-				return BSPLoadResult_ErrorTempMemory;
-			}
-			*stored_face = face;
+			current_draw_vertices += faces->vertices[ctx->faces_count - 1];
 			continue;
 		}
 
+		if (result == FacePreload_OutOfMemory)
+			return BSPLoadResult_ErrorTempMemory;
+
 		if (result != FacePreload_Skip)
 			return BSPLoadResult_ErrorFileFormat;
 	}
@@ -293,400 +475,2297 @@ static enum BSPLoadResult bspLoadModelPreloadFaces(struct LoadModelContext *ctx)
 	return BSPLoadResult_Success;
 }
 
-static enum BSPLoadResult bspLoadModelLightmaps(struct LoadModelContext *ctx) {
-	/* TODO optional sort lightmaps */
+static inline int clampi(int x, int min, int max) {
+	return x < min ? min : (x > max ? max : x);
+}
+
+static unsigned int nextPowerOfTwo(unsigned int v) {
+	unsigned int p = 1;
+	while (p < v) p <<= 1;
+	return p;
+}
+
+static const RTexture *bspLightmapPage(unsigned int page) {
+	ASSERT(page < (unsigned)bsp_global.lightmap_atlas.pages_count);
+	return &bsp_global.lightmap_atlas.pages[page].texture;
+}
+
+#ifdef ATTO_PLATFORM_RPI
+static const RTexFormat c_lightmap_compressed_format = RTexFormat_Compressed_ETC1;
+#else
+static const RTexFormat c_lightmap_compressed_format = RTexFormat_Compressed_DXT1;
+#endif
+
+/* Finds room for a region in shared lightmap pages, opens a new page if needed.
+ * Returns page index, or -1 if all pages are taken */
+static int bspLightmapAtlasAlloc(struct AtlasVec size, struct AtlasVec *pos) {
+	int page = 0;
+#ifdef ATTO_PLATFORM_RPI
+	/* page texture is created when the region is uploaded */
+	(void)(size);
+	page = bsp_global.lightmap_atlas.pages_count;
+	pos->x = pos->y = 0;
+	if (page == BSP_MAX_SHARED_LIGHTMAP_PAGES)
+		return -1;
+	if (page == bsp_global.lightmap_atlas.textures_count) {
+		renderTextureInit(&bsp_global.lightmap_atlas.pages[page].texture);
+		++bsp_global.lightmap_atlas.textures_count;
+	}
+#else
+	for (; page < bsp_global.lightmap_atlas.pages_count; ++page)
+		if (atlasPageInsert(&bsp_global.lightmap_atlas.pages[page].atlas, size, pos) == Atlas_Success)
+			return page;
+
+	if (page == BSP_MAX_SHARED_LIGHTMAP_PAGES)
+		return -1;
+
+	const unsigned int side = bsp_global.lightmap_page_side;
+	atlasPageInit(&bsp_global.lightmap_atlas.pages[page].atlas, side, side);
+	if (atlasPageInsert(&bsp_global.lightmap_atlas.pages[page].atlas, size, pos) != Atlas_Success)
+		return -1;
+
+	/* contents are filled region by region */
+	if (page == bsp_global.lightmap_atlas.textures_count) {
+		renderTextureInit(&bsp_global.lightmap_atlas.pages[page].texture);
+		for (int level = 0; level < c_lightmap_mip_levels; ++level) {
+			RTextureUploadParams upload;
+			upload.width = side >> level;
+			upload.height = side >> level;
+			upload.format = bsp_global.lightmap_format;
+			upload.pixels = NULL;
+			upload.mip_level = level;
+			upload.type = RTexType_2D;
+			upload.wrap = RTexWrap_Clamp;
+			renderTextureUpload(&bsp_global.lightmap_atlas.pages[page].texture, upload);
+		}
+		++bsp_global.lightmap_atlas.textures_count;
+	}
+
+	PRINTF("Opened shared lightmap page %d", page);
+#endif
+	return ++bsp_global.lightmap_atlas.pages_count - 1;
+}
+
+/* Shared lightmap pages as they were before a map started loading */
+struct BSPLightmapAtlasMark {
+	int pages_count;
+#ifndef ATTO_PLATFORM_RPI
+	struct AtlasPage *pages;
+#endif
+};
+
+/* Returns 0 if there's no temp memory for it */
+static int bspLightmapAtlasMark(struct Stack *tmp, struct BSPLightmapAtlasMark *mark) {
+	mark->pages_count = bsp_global.lightmap_atlas.pages_count;
+#ifndef ATTO_PLATFORM_RPI
+	mark->pages = stackAlloc(tmp, sizeof(struct AtlasPage) * (mark->pages_count ? mark->pages_count : 1));
+	if (!mark->pages)
+		return 0;
+	for (int i = 0; i < mark->pages_count; ++i)
+		mark->pages[i] = bsp_global.lightmap_atlas.pages[i].atlas;
+#else
+	(void)(tmp);
+#endif
+	return 1;
+}
+
+/* Gives back all regions allocated since the mark. Textures of pages opened since then
+ * are kept for reuse, their contents are overwritten by regions allocated later */
+static void bspLightmapAtlasRollback(const struct BSPLightmapAtlasMark *mark) {
+#ifndef ATTO_PLATFORM_RPI
+	for (int i = 0; i < mark->pages_count; ++i)
+		bsp_global.lightmap_atlas.pages[i].atlas = mark->pages[i];
+#endif
+	bsp_global.lightmap_atlas.pages_count = mark->pages_count;
+}
+
+static uint16_t lightmapAverage565(uint16_t a, uint16_t b, uint16_t c, uint16_t d) {
+	const unsigned int
+		r = ((a >> 11) + (b >> 11) + (c >> 11) + (d >> 11) + 2) >> 2,
+		g = (((a >> 5) & 0x3f) + ((b >> 5) & 0x3f) + ((c >> 5) & 0x3f) + ((d >> 5) & 0x3f) + 2) >> 2,
+		bl = ((a & 0x1f) + (b & 0x1f) + (c & 0x1f) + (d & 0x1f) + 2) >> 2;
+	return (uint16_t)((r << 11) | (g << 5) | bl);
+}
+
+/* 2x2 box filter in place, width and height are updated to the next mip level */
+static void bspLightmapDownsample(uint16_t *pixels, int *width, int *height) {
+	const int w = *width, h = *height;
+	const int mw = w > 1 ? w / 2 : 1, mh = h > 1 ? h / 2 : 1;
+	for (int y = 0; y < mh; ++y) {
+		const uint16_t *row0 = pixels + (y * 2) * w;
+		const uint16_t *row1 = h > 1 ? row0 + w : row0;
+		for (int x = 0; x < mw; ++x) {
+			const int x0 = x * 2, x1 = w > 1 ? x0 + 1 : x0;
+			/* destination never overtakes the source rows being read */
+			pixels[x + y * mw] = lightmapAverage565(row0[x0], row0[x1], row1[x0], row1[x1]);
+		}
+	}
+	*width = mw;
+	*height = mh;
+}
+
+/* Encode RGB565 pixels into 4x4 blocks of c_lightmap_compressed_format, edges are clamped */
+static void bspLightmapCompress(const uint16_t *pixels, int width, int height, uint8_t *blocks) {
+	for (int by = 0; by < height; by += 4) {
+		for (int bx = 0; bx < width; bx += 4, blocks += 8) {
+#ifdef ATTO_PLATFORM_RPI
+			ETC1Color ec[16];
+			for (int x = 0; x < 4; ++x) {
+				for (int y = 0; y < 4; ++y) {
+					const int sx = bx + x < width ? bx + x : width - 1;
+					const int sy = by + y < height ? by + y : height - 1;
+					const unsigned p = pixels[sx + sy * width];
+					ec[x*4+y].r = (p & 0xf800u) >> 8;
+					ec[x*4+y].g = (p & 0x07e0u) >> 3;
+					ec[x*4+y].b = (p & 0x001fu) << 3;
+				}
+			}
+			etc1PackBlock(ec, blocks);
+#else
+			uint16_t block[16];
+			for (int y = 0; y < 4; ++y) {
+				for (int x = 0; x < 4; ++x) {
+					const int sx = bx + x < width ? bx + x : width - 1;
+					const int sy = by + y < height ? by + y : height - 1;
+					block[x + y * 4] = pixels[sx + sy * width];
+				}
+			}
+			dxt1PackBlock(block, blocks);
+#endif
+		}
+	}
+}
+
+/* Builds mip chain of a region, compresses and uploads it. Pixels are overwritten */
+static enum BSPLoadResult bspLightmapUploadRegion(struct Stack *tmp, int page,
+		struct AtlasVec offset, struct AtlasVec size, uint16_t *pixels) {
+	RTexture *const texture = &bsp_global.lightmap_atlas.pages[page].texture;
+	const int compressed = bsp_global.lightmap_format != RTexFormat_RGB565;
+	uint8_t *const blocks = compressed ? stackAlloc(tmp, ((size.x + 3) / 4) * ((size.y + 3) / 4) * 8) : NULL;
+	if (compressed && !blocks) return BSPLoadResult_ErrorTempMemory;
+
+	int width = size.x, height = size.y;
+	for (int level = 0;; ++level) {
+		if (compressed)
+			bspLightmapCompress(pixels, width, height, blocks);
+
+		RTextureUploadParams upload;
+		upload.width = width;
+		upload.height = height;
+		upload.format = bsp_global.lightmap_format;
+		upload.pixels = compressed ? (const void*)blocks : (const void*)pixels;
+		upload.mip_level = level;
+		upload.type = RTexType_2D;
+		upload.wrap = RTexWrap_Clamp;
+#ifdef ATTO_PLATFORM_RPI
+		(void)(offset);
+		renderTextureUpload(texture, upload);
+#else
+		renderTextureUploadRegion(texture, offset.x >> level, offset.y >> level, upload);
+#endif
+
+		if (level + 1 == c_lightmap_mip_levels || (width == 1 && height == 1))
+			break;
+
+		bspLightmapDownsample(pixels, &width, &height);
+	}
+
+	if (compressed)
+		stackFreeUpToPosition(tmp, blocks);
+	return BSPLoadResult_Success;
+}
+
+static enum BSPLoadResult bspLoadModelLightmaps(struct LoadModelContext *ctx) {
+	const unsigned int page_side = bsp_global.lightmap_page_side;
+	if ((unsigned)ctx->lightmap.max_width > page_side || (unsigned)ctx->lightmap.max_height > page_side) {
+		PRINTF("Lightmap %dx%d doesn't fit into %ux%u page",
+			ctx->lightmap.max_width, ctx->lightmap.max_height, page_side, page_side);
+		return BSPLoadResult_ErrorCapabilities;
+	}
+
+	struct AtlasStats stats;
+	struct AtlasContext atlas_context;
+	atlas_context.temp_storage.ptr = stackGetCursor(ctx->tmp);
+	atlas_context.temp_storage.size = stackGetFree(ctx->tmp);
+	atlas_context.height = page_side;
+	atlas_context.rects = ctx->faces.atlas_size;
+	atlas_context.rects_count = ctx->faces_count;
+	atlas_context.rects_stride = sizeof(struct AtlasVec);
+	atlas_context.pos = ctx->faces.atlas_pos;
+	atlas_context.pos_stride = sizeof(struct AtlasVec);
+	atlas_context.page = ctx->faces.atlas_page;
+	atlas_context.page_stride = sizeof(unsigned int);
+	atlas_context.max_pages = 1;
+	atlas_context.stats = &stats;
+
+	/* Predict the size up front: sorted skyline packing is dense enough for
+	 * a square-ish atlas of total lightmap area. Then try neighbouring widths
+	 * and keep the one that gives the smallest atlas after cropping */
+	unsigned int predicted_width = nextPowerOfTwo(ctx->lightmap.max_width);
+	while (predicted_width * predicted_width < (unsigned)ctx->lightmap.pixels)
+		predicted_width <<= 1;
+
+	const unsigned int candidates[3] = { predicted_width >> 1, predicted_width, predicted_width << 1 };
+	unsigned int best_width = 0, best_area = 0, last_width = 0;
+	for (int i = 0; i < 3; ++i) {
+		const unsigned int width = candidates[i];
+		if (width < (unsigned)ctx->lightmap.max_width || width > page_side)
+			continue;
+
+		atlas_context.width = width;
+		const enum AtlasResult result = atlasCompute(&atlas_context);
+		if (result == Atlas_ErrorInsufficientTemp)
+			return BSPLoadResult_ErrorTempMemory;
+
+		last_width = width;
+		if (result != Atlas_Success)
+			continue;
+
+		const unsigned int area = stats.extent.x * stats.extent.y;
+		if (!best_width || area < best_area) {
+			best_width = width;
+			best_area = area;
+		}
+	}
+
+	if (best_width) {
+		/* positions are written on every attempt, redo the best one if it wasn't the last */
+		atlas_context.width = best_width;
+		if (best_width != last_width && atlasCompute(&atlas_context) != Atlas_Success)
+			return BSPLoadResult_ErrorCapabilities;
+	} else {
+		/* doesn't fit into one page, spill into several full-sized ones */
+		atlas_context.width = page_side;
+		atlas_context.max_pages = c_max_lightmap_pages;
+		const enum AtlasResult result = atlasCompute(&atlas_context);
+		if (result == Atlas_ErrorInsufficientTemp)
+			return BSPLoadResult_ErrorTempMemory;
+		if (result != Atlas_Success)
+			return BSPLoadResult_ErrorCapabilities;
+	}
+
+	PRINTF("atlas: %u page(s) of %ux%u, %d lightmaps, used %u, wasted %u, exact %u",
+		stats.pages, atlas_context.width, page_side, ctx->faces_count, stats.used_pixels,
+		stats.wasted_pixels, stats.exact_matches);
+
+	/* Every local page becomes a region of a shared world-wide page */
+	struct {
+		int page;
+		struct AtlasVec offset;
+	} *const regions = stackAlloc(ctx->tmp, sizeof(*regions) * stats.pages);
+	if (!regions) return BSPLoadResult_ErrorTempMemory;
+
+	for (unsigned int page = 0; page < stats.pages; ++page) {
+		/* crop every region to what was actually packed into it */
+		struct AtlasVec size = { 0, 0 };
+		for (int i = 0; i < ctx->faces_count; ++i) {
+			if (ctx->faces.atlas_page[i] != page) continue;
+			const struct AtlasVec pos = ctx->faces.atlas_pos[i], rect = ctx->faces.atlas_size[i];
+			if (pos.x + rect.x > size.x) size.x = pos.x + rect.x;
+			if (pos.y + rect.y > size.y) size.y = pos.y + rect.y;
+		}
+
+#ifdef ATTO_PLATFORM_RPI
+		/* region is a whole mipmapped texture, GLES2 needs it to be power of two */
+		size.x = nextPowerOfTwo(size.x);
+		size.y = nextPowerOfTwo(size.y);
+#else
+		size.x = (size.x + c_lightmap_region_align - 1) & ~(c_lightmap_region_align - 1);
+		size.y = (size.y + c_lightmap_region_align - 1) & ~(c_lightmap_region_align - 1);
+#endif
+
+		regions[page].page = bspLightmapAtlasAlloc(size, &regions[page].offset);
+		if (regions[page].page < 0) {
+			PRINTF("No room left for %ux%u lightmap region in %d shared pages",
+				size.x, size.y, BSP_MAX_SHARED_LIGHTMAP_PAGES);
+			return BSPLoadResult_ErrorCapabilities;
+		}
+
+		/* Build region pixels based on calculated fragment positions */
+		const size_t region_size = sizeof(uint16_t) * size.x * size.y;
+		uint16_t *const pixels = stackAlloc(ctx->tmp, region_size);
+		if (!pixels) return BSPLoadResult_ErrorTempMemory;
+		memset(pixels, 0x0f, region_size); /* TODO debug pattern */
+
+		for (int i = 0; i < ctx->faces_count; ++i) {
+			if (ctx->faces.atlas_page[i] != page)
+				continue;
+
+			const struct AtlasVec pos = ctx->faces.atlas_pos[i], rect = ctx->faces.atlas_size[i];
+			const int width = ctx->faces.lightmap_size[i].x, height = ctx->faces.lightmap_size[i].y;
+			const struct VBSPLumpLightMap *const samples = ctx->faces.samples[i];
+			ASSERT(pos.x + rect.x <= size.x);
+			ASSERT(pos.y + rect.y <= size.y);
+			/* padding and alignment luxels repeat the nearest edge luxel */
+			for (int y = 0; y < (int)rect.y; ++y) {
+				const int sy = clampi(y - c_lightmap_padding, 0, height - 1);
+				for (int x = 0; x < (int)rect.x; ++x) {
+					const int sx = clampi(x - c_lightmap_padding, 0, width - 1);
+					const struct VBSPLumpLightMap *const pixel = samples + sx + sy * width;
+
+					const unsigned int
+						r = scaleLightmapColor(pixel->r, pixel->exponent),
+						g = scaleLightmapColor(pixel->g, pixel->exponent),
+						b = scaleLightmapColor(pixel->b, pixel->exponent);
+
+					pixels[pos.x + x + (pos.y + y) * size.x]
+						= ((r&0xf8) << 8) | ((g&0xfc) << 3) | (b >> 3);
+				} /* for x */
+			} /* for y */
+		} /* fot all visible faces */
+
+		const enum BSPLoadResult result = bspLightmapUploadRegion(ctx->tmp, regions[page].page,
+			regions[page].offset, size, pixels);
+		if (result != BSPLoadResult_Success)
+			return result;
+
+		/* pixels buffer is not needed anymore */
+		stackFreeUpToPosition(ctx->tmp, pixels);
+	}
+
+	/* remap faces from local pages to shared ones */
+	for (int i = 0; i < ctx->faces_count; ++i) {
+		const unsigned int page = ctx->faces.atlas_page[i];
+		ctx->faces.atlas_pos[i].x += regions[page].offset.x + c_lightmap_padding;
+		ctx->faces.atlas_pos[i].y += regions[page].offset.y + c_lightmap_padding;
+		ctx->faces.atlas_page[i] = regions[page].page;
+	}
+
+	stackFreeUpToPosition(ctx->tmp, regions);
+	return BSPLoadResult_Success;
+}
+
+static inline struct AVec3f aVec3fLumpVec(struct VBSPLumpVertex v) { return aVec3f(v.x, v.y, v.z); }
+
+static inline float clamp(float x, float min, float max) {
+	return x < min ? min : (x > max ? max : x);
+}
+
+/* displacement rows are generated in batches of SoA arrays, so that they can be processed 4 at a time */
+#define BSP_VERTEX_BATCH 64
+
+struct VertexBatch {
+	float x[BSP_VERTEX_BATCH], y[BSP_VERTEX_BATCH], z[BSP_VERTEX_BATCH];
+	float tex_u[BSP_VERTEX_BATCH], tex_v[BSP_VERTEX_BATCH];
+};
+
+/* out = dot(plane, (x, y, z, 1)) */
+static void bspProjectBatch(struct AVec4f plane, const struct VertexBatch *batch, int count, float *out) {
+	int i = 0;
+#ifdef BSP_SSE
+	const __m128 px = _mm_set1_ps(plane.x), py = _mm_set1_ps(plane.y),
+		pz = _mm_set1_ps(plane.z), pw = _mm_set1_ps(plane.w);
+	for (; i + 4 <= count; i += 4) {
+		const __m128 d = _mm_add_ps(
+			_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(batch->x + i), px), _mm_mul_ps(_mm_loadu_ps(batch->y + i), py)),
+			_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(batch->z + i), pz), pw));
+		_mm_storeu_ps(out + i, d);
+	}
+#endif
+	for (; i < count; ++i)
+		out[i] = plane.x * batch->x[i] + plane.y * batch->y[i] + plane.z * batch->z[i] + plane.w;
+}
+
+/* batch positions = mix(a, b, (first + i) * step) */
+static void bspMixBatch(struct AVec3f a, struct AVec3f b, float first, float step, int count, struct VertexBatch *batch) {
+	const struct AVec3f d = aVec3fSub(b, a);
+	int i = 0;
+#ifdef BSP_SSE
+	const __m128 ax = _mm_set1_ps(a.x), ay = _mm_set1_ps(a.y), az = _mm_set1_ps(a.z);
+	const __m128 dx = _mm_set1_ps(d.x), dy = _mm_set1_ps(d.y), dz = _mm_set1_ps(d.z);
+	const __m128 lanes = _mm_set_ps(3.f, 2.f, 1.f, 0.f), vstep = _mm_set1_ps(step);
+	for (; i + 4 <= count; i += 4) {
+		const __m128 t = _mm_mul_ps(_mm_add_ps(_mm_set1_ps(first + i), lanes), vstep);
+		_mm_storeu_ps(batch->x + i, _mm_add_ps(ax, _mm_mul_ps(dx, t)));
+		_mm_storeu_ps(batch->y + i, _mm_add_ps(ay, _mm_mul_ps(dy, t)));
+		_mm_storeu_ps(batch->z + i, _mm_add_ps(az, _mm_mul_ps(dz, t)));
+	}
+#endif
+	for (; i < count; ++i) {
+		const float t = (first + i) * step;
+		batch->x[i] = a.x + d.x * t;
+		batch->y[i] = a.y + d.y * t;
+		batch->z[i] = a.z + d.z * t;
+	}
+}
+
+#ifdef DEBUG_DISP_LIGHTMAP
+static int shouldSwapUV(struct AVec3f mapU, struct AVec3f mapV, const struct AVec3f *v) {
+	float mappedU = 0.f, mappedV = 0.f;
+	for (int i = 0; i < 4; ++i) {
+		const float U = aVec3fDot(mapU, aVec3fSub(v[(i+1)%4], v[i]));
+		if (U > mappedU) mappedU = U;
+		const float V = aVec3fDot(mapV, aVec3fSub(v[(i+1)%4], v[i]));
+		if (V > mappedV) mappedV = V;
+	}
+
+	const float dX1 = aVec3fLength2(aVec3fSub(v[3], v[0]));
+	const float dX2 = aVec3fLength2(aVec3fSub(v[2], v[1]));
+	const float dY1 = aVec3fLength2(aVec3fSub(v[1], v[0]));
+	const float dY2 = aVec3fLength2(aVec3fSub(v[2], v[3]));
+	const float maxDX = (dX1 > dX2) ? dX1 : dX2;
+	const float maxDY = (dY1 > dY2) ? dY1 : dY2;
+	//PRINTF("mappedU=%f mappedV=%f maxDX=%f, maxDY=%f", mappedU, mappedV, maxDX, maxDY);
+	return (mappedU > mappedV) != (maxDX > maxDY);
+}
+#endif /* DEBUG_DISP_LIGHTMAP */
+
+static void bspLoadDisplacement(
+		const struct LoadModelContext *ctx, int face,
+		struct LoadVertex *out_vertices, BSPIndex *out_indices, int index_shift) {
+	const struct VBSPLumpDispInfo *const dispinfo = ctx->faces.dispinfo[face];
+ 	const int side = (1 << dispinfo->power) + 1;
+	const struct VBSPLumpVertex *const vertices = ctx->lumps->vertices.p;
+	const struct VBSPLumpTexInfo * const tinfo = ctx->faces.texinfo[face];
+	const struct VBSPLumpDispVert *const dispvert = ctx->lumps->dispverts.p + dispinfo->vtx_start;
+	const uint32_t *const corners = ctx->corners + ctx->faces.first_corner[face];
+	const int width = ctx->faces.lightmap_size[face].x, height = ctx->faces.lightmap_size[face].y;
+
+	const struct AVec3f vec[4] = { /* bl, tl, tr, br */
+		aVec3fLumpVec(vertices[corners[0]]),
+		aVec3fLumpVec(vertices[corners[1]]),
+		aVec3fLumpVec(vertices[corners[2]]),
+		aVec3fLumpVec(vertices[corners[3]])};
+
+	/*
+	const struct AVec3f ovec[4] = {
+			aVec3fAdd(vec[0], aVec3fMulf(aVec3f(dispvert[0].x, dispvert[0].y, dispvert[0].z), dispvert[0].dist)),
+			aVec3fAdd(vec[1], aVec3fMulf(aVec3f(dispvert[side*(side-1)].x, dispvert[side*(side-1)].y, dispvert[side*(side-1)].z), dispvert[side*(side-1)].dist)),
+			aVec3fAdd(vec[2], aVec3fMulf(aVec3f(dispvert[side*side-1].x, dispvert[side*side-1].y, dispvert[side*side-1].z), dispvert[side*side-1].dist)),
+			aVec3fAdd(vec[3], aVec3fMulf(aVec3f(dispvert[side-1].x, dispvert[side-1].y, dispvert[side-1].z), dispvert[side-1].dist))};
+	*/
+
+	const struct AVec3f lm_map_u = aVec3f(
+		tinfo->lightmap_vecs[0][0], tinfo->lightmap_vecs[0][1], tinfo->lightmap_vecs[0][2]);
+	const float luxels_per_unit = aVec3fLength(lm_map_u);
+	float length_lm_u = luxels_per_unit * floatMax(
+			aVec3fLength(aVec3fSub(vec[3], vec[0])),
+			aVec3fLength(aVec3fSub(vec[2], vec[1])));
+	float length_lm_v = luxels_per_unit * floatMax(
+			aVec3fLength(aVec3fSub(vec[1], vec[0])),
+			aVec3fLength(aVec3fSub(vec[2], vec[3])));
+
+	const struct AVec4f tex_map_u = aVec4f(
+				tinfo->texture_vecs[0][0], tinfo->texture_vecs[0][1],
+				tinfo->texture_vecs[0][2], tinfo->texture_vecs[0][3]);
+	const struct AVec4f tex_map_v = aVec4f(
+				tinfo->texture_vecs[1][0], tinfo->texture_vecs[1][1],
+				tinfo->texture_vecs[1][2], tinfo->texture_vecs[1][3]);
+
+#ifdef DEBUG_DISP_LIGHTMAP
+	const int swap = shouldSwapUV(
+				aVec3f(tinfo->lightmap_vecs[0][0], tinfo->lightmap_vecs[0][1], tinfo->lightmap_vecs[0][2]),
+				aVec3f(tinfo->lightmap_vecs[1][0], tinfo->lightmap_vecs[1][1], tinfo->lightmap_vecs[1][2]), vec);
+#endif /*ifdef DEBUG_DISP_LIGHTMAP*/
+
+	const RTexture *const lightmap = bspLightmapPage(ctx->faces.atlas_page[face]);
+	const struct AVec2f atlas_scale = aVec2f(1.f / lightmap->width, 1.f / lightmap->height);
+	const struct AVec2f atlas_offset = aVec2f(
+			.5f + ctx->faces.atlas_pos[face].x /*+ tinfo->lightmap_vecs[0][3] - face->face->lightmap_min[0]*/,
+			.5f + ctx->faces.atlas_pos[face].y /*+ tinfo->lightmap_vecs[1][3] - face->face->lightmap_min[1]*/);
+
+	if (length_lm_u < 0. || length_lm_u >= width
+		|| length_lm_v < 0. || length_lm_v >= height) {
+		PRINTF("LM OOB: (%f, %f) (%d, %d)", length_lm_u, length_lm_v, width, height);
+		if (length_lm_u >= width) length_lm_u = (float)(width - 1);
+		if (length_lm_v >= height) length_lm_v = (float)(height - 1);
+	}
+
+	/*
+	PRINTF("%f %f %f %f",
+			tinfo->lightmap_vecs[0][3] * atlas_scale.x, face->face->lightmap_min[0] * atlas_scale.x,
+			tinfo->lightmap_vecs[1][3] * atlas_scale.y, face->face->lightmap_min[1] * atlas_scale.y);
+	*/
+
+	/* texture coordinates are projected from the undisplaced grid */
+	const float div_side = 1.f / (side - 1);
+	struct VertexBatch batch;
+	for (int y = 0; y < side; ++y) {
+		const float ty = (float)y * div_side;
+		const struct AVec3f vl = aVec3fMix(vec[0], vec[1], ty);
+		const struct AVec3f vr = aVec3fMix(vec[3], vec[2], ty);
+		const float lightmap_v = (ty * length_lm_v + atlas_offset.y) * atlas_scale.y;
+
+		for (int first = 0; first < side; first += BSP_VERTEX_BATCH) {
+			const int count = side - first < BSP_VERTEX_BATCH ? side - first : BSP_VERTEX_BATCH;
+			bspMixBatch(vl, vr, (float)first, div_side, count, &batch);
+			bspProjectBatch(tex_map_u, &batch, count, batch.tex_u);
+			bspProjectBatch(tex_map_v, &batch, count, batch.tex_v);
+
+			struct LoadVertex * const v = out_vertices + y * side + first;
+			const struct VBSPLumpDispVert * const dv = dispvert + y * side + first;
+			for (int i = 0; i < count; ++i) {
+				const float tx = (float)(first + i) * div_side;
+				v[i].vertex = aVec3f(
+					batch.x[i] + dv[i].x * dv[i].dist,
+					batch.y[i] + dv[i].y * dv[i].dist,
+					batch.z[i] + dv[i].z * dv[i].dist);
+
+				const float lu = tx * length_lm_u, lv = ty * length_lm_v;
+				if (lu < 0 || lv < 0 || lu > width || lv > height)
+					PRINTF("Error: DISP OOB LM F:V%d: x=%f y=%f z=%f tx=%f, ty=%f u=%f v=%f w=%d h=%d",
+							first + i + y * side, v[i].vertex.x, v[i].vertex.y, v[i].vertex.z, tx, ty, lu, lv, width, height);
+
+				v[i].lightmap_uv = aVec2f((lu + atlas_offset.x) * atlas_scale.x, lightmap_v);
+				v[i].tex_uv = aVec2f(batch.tex_u[i], batch.tex_v[i]);
+			}
+		}
+	}
+
+	for (int y = 0; y < side - 1; ++y) {
+		for (int x = 0; x < side - 1; ++x) {
+			const int base = index_shift + y * side + x;
+			*out_indices++ = base;
+			*out_indices++ = base + side + 1;
+			*out_indices++ = base + side;
+			*out_indices++ = base;
+			*out_indices++ = base + 1;
+			*out_indices++ = base + side + 1;
+		}
+	}
+}
+
+static void bspLoadFace(
+		const struct LoadModelContext *ctx, int face,
+		struct LoadVertex *out_vertices, BSPIndex *out_indices, int index_shift) {
+	const struct VBSPLumpFace *vface = ctx->faces.vface[face];
+	const struct VBSPLumpTexInfo * const tinfo = ctx->faces.texinfo[face];
+	const RTexture *const lightmap = bspLightmapPage(ctx->faces.atlas_page[face]);
+	const uint32_t *const corners = ctx->corners + ctx->faces.first_corner[face];
+	const float width = (float)ctx->faces.lightmap_size[face].x, height = (float)ctx->faces.lightmap_size[face].y;
+	const struct AtlasVec atlas_pos = ctx->faces.atlas_pos[face];
+	struct AVec3f normal;
+	normal.x = ctx->lumps->planes.p[vface->plane].x;
+	normal.y = ctx->lumps->planes.p[vface->plane].y;
+	normal.z = ctx->lumps->planes.p[vface->plane].z;
+	if (vface->side) normal = aVec3fNeg(normal);
+
+	const struct AVec4f lm_map_u = aVec4f(
+				tinfo->lightmap_vecs[0][0], tinfo->lightmap_vecs[0][1],
+				tinfo->lightmap_vecs[0][2], tinfo->lightmap_vecs[0][3] - vface->lightmap_min[0]);
+	const struct AVec4f lm_map_v = aVec4f(
+				tinfo->lightmap_vecs[1][0], tinfo->lightmap_vecs[1][1],
+				tinfo->lightmap_vecs[1][2], tinfo->lightmap_vecs[1][3] - vface->lightmap_min[1]);
+
+	const struct AVec4f tex_map_u = aVec4f(
+				tinfo->texture_vecs[0][0], tinfo->texture_vecs[0][1],
+				tinfo->texture_vecs[0][2], tinfo->texture_vecs[0][3]);
+	const struct AVec4f tex_map_v = aVec4f(
+				tinfo->texture_vecs[1][0], tinfo->texture_vecs[1][1],
+				tinfo->texture_vecs[1][2], tinfo->texture_vecs[1][3]);
+
+	for (int iedge = 0; iedge < vface->num_edges; ++iedge) {
+		const struct VBSPLumpVertex * const lv = ctx->lumps->vertices.p + corners[iedge];
+		struct LoadVertex * const vertex = out_vertices + iedge;
+
+		vertex->vertex = aVec3f(lv->x, lv->y, lv->z);
+		//vertex->normal = normal;
+		vertex->lightmap_uv = aVec2f(
+			aVec4fDot(aVec4f3(vertex->vertex, 1.f),	lm_map_u),
+			aVec4fDot(aVec4f3(vertex->vertex, 1.f), lm_map_v));
+		vertex->tex_uv = aVec2f(
+			aVec4fDot(aVec4f3(vertex->vertex, 1.f), tex_map_u),
+			aVec4fDot(aVec4f3(vertex->vertex, 1.f), tex_map_v));
+
+		vertex->lightmap_uv.x = clamp(vertex->lightmap_uv.x, 0.f, width);
+		vertex->lightmap_uv.y = clamp(vertex->lightmap_uv.y, 0.f, height);
+
+		/*
+		if (vertex->lightmap_uv.x < 0 || vertex->lightmap_uv.y < 0 || vertex->lightmap_uv.x > width || vertex->lightmap_uv.y > height)
+			PRINTF("Error: OOB LM F:V%u: x=%f y=%f z=%f u=%f v=%f w=%f h=%f", iedge, lv->x, lv->y, lv->z, vertex->lightmap_uv.x, vertex->lightmap_uv.y, width, height);
+		*/
+
+		vertex->lightmap_uv.x = (vertex->lightmap_uv.x + atlas_pos.x + .5f) / lightmap->width;
+		vertex->lightmap_uv.y = (vertex->lightmap_uv.y + atlas_pos.y + .5f) / lightmap->height;
+
+		if (iedge > 1) {
+			out_indices[(iedge-2)*3+0] = index_shift + 0;
+			out_indices[(iedge-2)*3+1] = index_shift + iedge;
+			out_indices[(iedge-2)*3+2] = index_shift + iedge - 1;
+		}
+	}
+}
+
+/* Whether texture coordinates up to magnitude repeats away from zero are off by half
+ * a texel at most once packed: fixed point ones are clamped beyond 32767 steps, half
+ * floats lose a mantissa bit with every power of two */
+static int bspTexCoordFits(float magnitude, const struct Texture *texture) {
+#ifdef BSP_TEX_UV_FIXED_SCALE
+	(void)texture;
+	return magnitude * BSP_TEX_UV_FIXED_SCALE <= 32767.f;
+#else
+	if (!texture || magnitude < 1.f)
+		return 1;
+
+	int exponent;
+	frexpf(magnitude, &exponent);
+	/* 10 bit mantissa, half float step at magnitude is 2^(exponent - 11) */
+	const float step = ldexpf(1.f, exponent - 11);
+	return step * fmaxf((float)texture->texture.width, (float)texture->texture.height) <= 1.f;
+#endif
+}
+
+/* Converts texture coordinates to repeats centred around the face, so that
+ * they stay small enough to pack, and sets average color.
+ * Returns the largest coordinate magnitude, negative if it doesn't fit packing precision */
+static float bspFinishFaceVertices(const struct LoadModelContext *ctx, int face, struct LoadVertex *vertices) {
+	const Material *const material = ctx->faces.material[face];
+	const int count = ctx->faces.vertices[face];
+	const struct Texture *const texture = material->base_texture.texture;
+	const struct AVec2f scale = texture
+		? aVec2f(1.f / texture->texture.width, 1.f / texture->texture.height)
+		: aVec2f(1.f, 1.f);
+
+	const uint16_t color =
+		(((unsigned)(material->average_color.x * 31.f + .5f) & 0x1f) << 11) |
+		(((unsigned)(material->average_color.y * 63.f + .5f) & 0x3f) << 5) |
+		((unsigned)(material->average_color.z * 31.f + .5f) & 0x1f);
+
+	struct AVec2f min = aVec2f(FLT_MAX, FLT_MAX), max = aVec2f(-FLT_MAX, -FLT_MAX);
+	for (int i = 0; i < count; ++i) {
+		const struct AVec2f uv = vertices[i].tex_uv = aVec2fMul(vertices[i].tex_uv, scale);
+		vertices[i].average_color = color;
+		min = aVec2f(fminf(min.x, uv.x), fminf(min.y, uv.y));
+		max = aVec2f(fmaxf(max.x, uv.x), fmaxf(max.y, uv.y));
+	}
+
+	/* by whole repeats only, so that the texture doesn't shift */
+	const struct AVec2f shift = aVec2f(-floorf((min.x + max.x) * .5f + .5f), -floorf((min.y + max.y) * .5f + .5f));
+	for (int i = 0; i < count; ++i)
+		vertices[i].tex_uv = aVec2fAdd(vertices[i].tex_uv, shift);
+
+	const float magnitude = fmaxf(
+		fmaxf(fabsf(min.x + shift.x), fabsf(max.x + shift.x)),
+		fmaxf(fabsf(min.y + shift.y), fabsf(max.y + shift.y)));
+	return bspTexCoordFits(magnitude, texture) ? magnitude : -magnitude;
+}
+
+#ifndef BSP_TEX_UV_FIXED_SCALE
+static uint16_t floatToHalf(float f) {
+	union { float f; uint32_t u; } v;
+	v.f = f;
+	const uint32_t sign = (v.u >> 16) & 0x8000u;
+	const int exponent = (int)((v.u >> 23) & 0xff) - 127 + 15;
+	const uint32_t mantissa = v.u & 0x7fffffu;
+
+	/* small values are flushed to zero, large ones to max half */
+	if (exponent <= 0) return (uint16_t)sign;
+	if (exponent >= 31) return (uint16_t)(sign | 0x7bffu);
+
+	const uint32_t half = sign | ((uint32_t)exponent << 10) | (mantissa >> 13);
+	/* round to nearest, carry into exponent is fine */
+	return (uint16_t)(half + ((mantissa >> 12) & 1));
+}
+#endif
+
+static uint16_t bspPackTexCoord(float uv) {
+#ifdef BSP_TEX_UV_FIXED_SCALE
+	const float fixed = uv * BSP_TEX_UV_FIXED_SCALE;
+	return (uint16_t)(int16_t)(fixed > 32767.f ? 32767 : (fixed < -32767.f ? -32767 : (int)floorf(fixed + .5f)));
+#else
+	return floatToHalf(uv);
+#endif
+}
+
+static uint16_t bspPackUnorm16(float v) {
+	return (uint16_t)(clamp(v, 0.f, 1.f) * 65535.f + .5f);
+}
+
+static void bspPackVertices(const struct LoadVertex *vertices, int count,
+		struct AABB *box, struct BSPModelVertex *out) {
+	box->min = box->max = vertices[0].vertex;
+	for (int i = 1; i < count; ++i) {
+		const struct AVec3f v = vertices[i].vertex;
+		if (v.x < box->min.x) box->min.x = v.x;
+		if (v.y < box->min.y) box->min.y = v.y;
+		if (v.z < box->min.z) box->min.z = v.z;
+		if (v.x > box->max.x) box->max.x = v.x;
+		if (v.y > box->max.y) box->max.y = v.y;
+		if (v.z > box->max.z) box->max.z = v.z;
+	}
+
+	const struct AVec3f size = aVec3fSub(box->max, box->min);
+	const struct AVec3f scale = aVec3f(
+		size.x > 0.f ? 1.f / size.x : 0.f,
+		size.y > 0.f ? 1.f / size.y : 0.f,
+		size.z > 0.f ? 1.f / size.z : 0.f);
+
+	for (int i = 0; i < count; ++i) {
+		const struct LoadVertex *const v = vertices + i;
+		const struct AVec3f p = aVec3fMul(aVec3fSub(v->vertex, box->min), scale);
+		out[i].vertex[0] = bspPackUnorm16(p.x);
+		out[i].vertex[1] = bspPackUnorm16(p.y);
+		out[i].vertex[2] = bspPackUnorm16(p.z);
+		out[i].vertex[3] = v->average_color;
+		out[i].lightmap_uv[0] = bspPackUnorm16(v->lightmap_uv.x);
+		out[i].lightmap_uv[1] = bspPackUnorm16(v->lightmap_uv.y);
+		out[i].tex_uv[0] = bspPackTexCoord(v->tex_uv.x);
+		out[i].tex_uv[1] = bspPackTexCoord(v->tex_uv.y);
+	}
+}
+
+static unsigned int bspVertexHash(const struct BSPModelVertex *v) {
+	uint32_t w[4];
+	memcpy(w, v, sizeof(w));
+	uint32_t h = (w[0] * 0x85ebca6bu) ^ (w[1] * 0xc2b2ae35u) ^ (w[2] * 0x27d4eb2fu) ^ (w[3] * 0x165667b1u);
+	h ^= h >> 15;
+	return h;
+}
+
+/* Welds bitwise identical vertices within each detailed draw. BSPModelVertex has
+ * only 16 bit fields, so there are no holes to confuse hashing and memcmp.
+ * Vertices are compacted
+ * in place, and indices and vbo offsets of all draws are remapped. New index
+ * of every old vertex is written to remap.
+ * Returns new vertex count, or -1 if out of temp memory */
+static int bspWeldVertices(struct Stack *tmp, struct BSPModel *model, const int *draw_first_vertex,
+		struct BSPModelVertex *vertices, int vertices_count, BSPIndex *indices, int *remap) {
+	void *const tmp_cursor = stackGetCursor(tmp);
+	const int draws_count = model->detailed.draws_count;
+
+	int max_draw_vertices = 0;
+	for (int i = 0; i < draws_count; ++i) {
+		const int end = i + 1 < draws_count ? draw_first_vertex[i + 1] : vertices_count;
+		if (end - draw_first_vertex[i] > max_draw_vertices)
+			max_draw_vertices = end - draw_first_vertex[i];
+	}
+
+	int *const table = stackAlloc(tmp, sizeof(int) * nextPowerOfTwo(max_draw_vertices * 2));
+	if (!table)
+		return -1;
+
+	int welded_count = 0;
+	for (int i = 0; i < draws_count; ++i) {
+		const int end = i + 1 < draws_count ? draw_first_vertex[i + 1] : vertices_count;
+		/* sized by each draw, so that clearing doesn't cost as much as the largest one */
+		const unsigned int table_mask = nextPowerOfTwo((end - draw_first_vertex[i]) * 2) - 1;
+		for (unsigned int j = 0; j <= table_mask; ++j)
+			table[j] = -1;
+
+		for (int v = draw_first_vertex[i]; v < end; ++v) {
+			unsigned int slot = bspVertexHash(vertices + v) & table_mask;
+			for (; table[slot] >= 0; slot = (slot + 1) & table_mask)
+				if (memcmp(vertices + table[slot], vertices + v, sizeof(*vertices)) == 0)
+					break;
+
+			if (table[slot] < 0) {
+				/* never overwrites vertices that haven't been read yet */
+				table[slot] = welded_count;
+				vertices[welded_count++] = vertices[v];
+			}
+			remap[v] = table[slot];
+		}
+	}
+
+	/* draw vertex ranges start both segments and draws, so they are never welded away */
+	for (int i = 0; i < draws_count; ++i) {
+		struct BSPDraw *const draw = model->detailed.draws + i;
+		const int new_offset = remap[draw->vbo_offset];
+		for (unsigned int j = draw->start; j < draw->start + draw->count; ++j)
+			indices[j] = (BSPIndex)(remap[indices[j] + draw->vbo_offset] - new_offset);
+		draw->vbo_offset = new_offset;
+	}
+
+	for (int i = 0; i < model->coarse[0].draws_count; ++i)
+		model->coarse[0].draws[i].vbo_offset = remap[model->coarse[0].draws[i].vbo_offset];
+
+	stackFreeUpToPosition(tmp, tmp_cursor);
+	return welded_count;
+}
+
+/* BSP subtrees with up to this many faces become one culling group */
+static const int c_node_group_faces = 128;
+
+/* deeper trees are considered broken, also guards against cycles */
+#define BSP_MAX_NODE_DEPTH 256
+
+struct NodeBuilder {
+	const struct Lumps *lumps;
+	const struct VBSPLumpModel *model;
+	/* preloaded face of every model face, -1 for skipped ones */
+	const int *face_slot;
+	unsigned int *face_group;
+	/* preloaded faces in subtree of every lump node */
+	int *subtree_faces;
+	struct BSPNode *nodes;
+	int nodes_count;
+	unsigned int groups_count;
+};
+
+static int bspNodeIsLeaf(uint32_t child) {
+	return (int32_t)child < 0;
+}
+
+/* Returns number of preloaded faces on the node itself, not its children.
+ * Moves them to group, unless it is NULL */
+static int bspNodeOwnFaces(struct NodeBuilder *b, const struct VBSPLumpNode *lnode, const unsigned int *group) {
+	const uint32_t model_first = b->model->first_face, model_count = b->model->num_faces;
+	int faces = 0;
+	for (uint32_t i = lnode->first_face; i < (uint32_t)lnode->first_face + lnode->num_faces; ++i) {
+		if (i < model_first || i - model_first >= model_count)
+			continue;
+
+		const int slot = b->face_slot[i - model_first];
+		if (slot < 0)
+			continue;
+
+		if (group)
+			b->face_group[slot] = *group;
+		++faces;
+	}
+	return faces;
+}
+
+/* Returns number of preloaded faces in subtree, -1 if tree is malformed */
+static int bspNodeCountFaces(struct NodeBuilder *b, uint32_t index, int depth) {
+	if (index >= b->lumps->nodes.n || depth > BSP_MAX_NODE_DEPTH)
+		return -1;
+
+	const struct VBSPLumpNode *const lnode = b->lumps->nodes.p + index;
+	int faces = bspNodeOwnFaces(b, lnode, NULL);
+
+	for (int k = 0; k < 2; ++k) {
+		if (bspNodeIsLeaf(lnode->children[k]))
+			continue;
+
+		const int child_faces = bspNodeCountFaces(b, lnode->children[k], depth + 1);
+		if (child_faces < 0)
+			return -1;
+		faces += child_faces;
+	}
+
+	b->subtree_faces[index] = faces;
+	return faces;
+}
+
+static void bspNodeAssignGroup(struct NodeBuilder *b, uint32_t index, unsigned int group) {
+	const struct VBSPLumpNode *const lnode = b->lumps->nodes.p + index;
+	bspNodeOwnFaces(b, lnode, &group);
+
+	for (int k = 0; k < 2; ++k)
+		if (!bspNodeIsLeaf(lnode->children[k]))
+			bspNodeAssignGroup(b, lnode->children[k], group);
+}
+
+static void bspAABBExtend(struct AABB *box, struct AVec3f min, struct AVec3f max) {
+	if (min.x < box->min.x) box->min.x = min.x;
+	if (min.y < box->min.y) box->min.y = min.y;
+	if (min.z < box->min.z) box->min.z = min.z;
+	if (max.x > box->max.x) box->max.x = max.x;
+	if (max.y > box->max.y) box->max.y = max.y;
+	if (max.z > box->max.z) box->max.z = max.z;
+}
+
+/* Returns index of new node */
+static int bspNodeBuild(struct NodeBuilder *b, uint32_t index) {
+	const struct VBSPLumpNode *const lnode = b->lumps->nodes.p + index;
+	const int node = b->nodes_count++;
+	b->nodes[node].children[0] = b->nodes[node].children[1] = -1;
+	b->nodes[node].first_group = b->groups_count;
+
+	int children_faces[2];
+	for (int k = 0; k < 2; ++k)
+		children_faces[k] = bspNodeIsLeaf(lnode->children[k]) ? 0 : b->subtree_faces[lnode->children[k]];
+
+	if (b->subtree_faces[index] <= c_node_group_faces || (!children_faces[0] && !children_faces[1])) {
+		bspNodeAssignGroup(b, index, b->groups_count++);
+		b->nodes[node].groups_count = 1;
+		return node;
+	}
+
+	for (int k = 0; k < 2; ++k)
+		if (children_faces[k])
+			b->nodes[node].children[k] = bspNodeBuild(b, lnode->children[k]);
+
+	/* faces on the splitting plane itself join some group below, bounds come from faces anyway */
+	bspNodeOwnFaces(b, lnode, &b->nodes[node].first_group);
+
+	b->nodes[node].groups_count = b->groups_count - b->nodes[node].first_group;
+	return node;
+}
+
+/* Cuts model BSP tree into face groups, so that whole groups can be frustum culled.
+ * Sets group of every preloaded face, node bounds are filled later from generated vertices */
+static enum BSPLoadResult bspLoadModelNodes(struct LoadModelContext *ctx, struct Stack *persistent,
+		struct BSPModel *model) {
+	void *const tmp_cursor = stackGetCursor(ctx->tmp);
+	const struct Lumps *const lumps = ctx->lumps;
+
+	struct NodeBuilder b;
+	b.lumps = lumps;
+	b.model = ctx->model;
+	b.face_group = ctx->faces.group;
+	b.nodes_count = 0;
+	b.groups_count = 0;
+
+	int *const face_slot = stackAlloc(ctx->tmp, sizeof(int) * ctx->model->num_faces);
+	b.subtree_faces = stackAlloc(ctx->tmp, sizeof(int) * (lumps->nodes.n + 1));
+	b.nodes = stackAlloc(ctx->tmp, sizeof(struct BSPNode) * (lumps->nodes.n + 1));
+	if (!face_slot || !b.subtree_faces || !b.nodes) return BSPLoadResult_ErrorTempMemory;
+	b.face_slot = face_slot;
+
+	for (int i = 0; i < ctx->model->num_faces; ++i)
+		face_slot[i] = -1;
+	for (int i = 0; i < ctx->faces_count; ++i) {
+		face_slot[ctx->faces.vface[i] - lumps->faces.p - ctx->model->first_face] = i;
+		/* faces not referenced by any node stay in the first group */
+		ctx->faces.group[i] = 0;
+	}
+
+	const int32_t head = ctx->model->head_node;
+	if (head >= 0 && bspNodeCountFaces(&b, head, 0) >= 0) {
+		bspNodeBuild(&b, head);
+	} else {
+		PRINTF("Warning: cannot use BSP tree of model, head node %d", head);
+		b.nodes[0].children[0] = b.nodes[0].children[1] = -1;
+		b.nodes[0].first_group = 0;
+		b.nodes[0].groups_count = 1;
+		b.nodes_count = 1;
+		b.groups_count = 1;
+	}
+
+	model->nodes_count = b.nodes_count;
+	model->groups_count = b.groups_count;
+	model->nodes = stackAlloc(persistent, sizeof(struct BSPNode) * b.nodes_count);
+	if (!model->nodes) return BSPLoadResult_ErrorMemory;
+
+	memcpy(model->nodes, b.nodes, sizeof(struct BSPNode) * b.nodes_count);
+
+	PRINTF("BSP nodes: %u -> %d, face groups: %u", lumps->nodes.n, b.nodes_count, b.groups_count);
+
+	stackFreeUpToPosition(ctx->tmp, tmp_cursor);
+	return BSPLoadResult_Success;
+}
+
+/* Decompresses PVS row of cluster: zero byte is followed by the number of zero bytes it stands for.
+ * Returns 0 if data is out of bounds */
+static int bspDecompressVisRow(const uint8_t *vis, uint32_t vis_size, uint32_t offset,
+		uint8_t *row, uint32_t row_bytes) {
+	uint32_t out = 0;
+	while (out < row_bytes) {
+		if (offset >= vis_size)
+			return 0;
+
+		const uint8_t byte = vis[offset++];
+		if (byte) {
+			row[out++] = byte;
+			continue;
+		}
+
+		if (offset >= vis_size)
+			return 0;
+		const uint32_t zeros = vis[offset++];
+		if (out + zeros > row_bytes)
+			return 0;
+		memset(row + out, 0, zeros);
+		out += zeros;
+	}
+	return 1;
+}
+
+/* Stable LSD radix sort of face indices by key, 8 bits per pass. Passes where
+ * all keys share the same digit are skipped, usually only one or two remain.
+ * Faces with equal keys keep their order in order_in, identity if it is NULL.
+ * Returns face order allocated from tmp, or NULL if out of temp memory */
+static unsigned int *bspSortFaces(struct Stack *tmp, const uint32_t *keys, const unsigned int *order_in,
+		int faces_count) {
+	unsigned int *order = stackAlloc(tmp, sizeof(unsigned int) * faces_count);
+	unsigned int *scratch = stackAlloc(tmp, sizeof(unsigned int) * faces_count);
+	if (!order || !scratch)
+		return 0;
+
+	for (int i = 0; i < faces_count; ++i)
+		order[i] = order_in ? order_in[i] : (unsigned int)i;
+
+	for (int shift = 0; shift < 32 && faces_count > 0; shift += 8) {
+		unsigned int offsets[256];
+		memset(offsets, 0, sizeof(offsets));
+		for (int i = 0; i < faces_count; ++i)
+			++offsets[(keys[i] >> shift) & 0xff];
+
+		if (offsets[(keys[0] >> shift) & 0xff] == (unsigned int)faces_count)
+			continue;
+
+		unsigned int offset = 0;
+		for (int d = 0; d < 256; ++d) {
+			const unsigned int count = offsets[d];
+			offsets[d] = offset;
+			offset += count;
+		}
+
+		for (int i = 0; i < faces_count; ++i)
+			scratch[offsets[(keys[order[i]] >> shift) & 0xff]++] = order[i];
+
+		unsigned int *const swap = order;
+		order = scratch;
+		scratch = swap;
+	}
+
+	return order;
+}
+
+/* Writes clusters of leaves that box touches to clusters, unless it is NULL.
+ * Returns how many there are, duplicates included, -1 if the tree is too deep */
+static int bspBoxClusters(const struct BSPSplitNode *nodes, const int *leaf_cluster, int node,
+		const struct AABB *box, uint32_t *clusters, int depth) {
+	if (node < 0) {
+		const int cluster = leaf_cluster[-1 - node];
+		if (cluster < 0)
+			return 0;
+		if (clusters)
+			clusters[0] = cluster;
+		return 1;
+	}
+
+	if (depth > BSP_MAX_NODE_DEPTH)
+		return -1;
+
+	const struct BSPSplitNode *const split = nodes + node;
+	const struct AVec3f center = aVec3fMulf(aVec3fAdd(box->min, box->max), .5f);
+	const struct AVec3f extent = aVec3fSub(box->max, center);
+	const float d = aVec3fDot(split->normal, center) - split->dist;
+	const float r = fabsf(split->normal.x) * extent.x + fabsf(split->normal.y) * extent.y
+		+ fabsf(split->normal.z) * extent.z;
+
+	int count = 0;
+	for (int k = 0; k < 2; ++k) {
+		if (k == 0 ? d + r < 0.f : d - r > 0.f)
+			continue;
+
+		const int child = bspBoxClusters(nodes, leaf_cluster, split->children[k], box,
+			clusters ? clusters + count : NULL, depth + 1);
+		if (child < 0)
+			return -1;
+		count += child;
+	}
+	return count;
+}
+
+/* Bounds of preloaded face, displaced vertices included */
+static struct AABB bspFaceBounds(const struct LoadModelContext *ctx, int face) {
+	const struct VBSPLumpVertex *const vertices = ctx->lumps->vertices.p;
+	const uint32_t *const corners = ctx->corners + ctx->faces.first_corner[face];
+	const struct VBSPLumpDispInfo *const dispinfo = ctx->faces.dispinfo[face];
+	const int corners_count = dispinfo ? 4 : ctx->faces.vertices[face];
+
+	struct AABB box = { aVec3ff(FLT_MAX), aVec3ff(-FLT_MAX) };
+	for (int i = 0; i < corners_count; ++i) {
+		const struct AVec3f v = aVec3fLumpVec(vertices[corners[i]]);
+		bspAABBExtend(&box, v, v);
+	}
+
+	if (dispinfo) {
+		/* every displaced vertex is offset from a point within the corners */
+		const int side = (1 << dispinfo->power) + 1;
+		const struct VBSPLumpDispVert *const dispvert = ctx->lumps->dispverts.p + dispinfo->vtx_start;
+		struct AABB offsets = { aVec3ff(0), aVec3ff(0) };
+		for (int i = 0; i < side * side; ++i) {
+			const struct AVec3f offset = aVec3fMulf(aVec3f(dispvert[i].x, dispvert[i].y, dispvert[i].z), dispvert[i].dist);
+			bspAABBExtend(&offsets, offset, offset);
+		}
+		box.min = aVec3fAdd(box.min, offsets.min);
+		box.max = aVec3fAdd(box.max, offsets.max);
+	}
+
+	return box;
+}
+
+/* Sorts clusters list and removes duplicates, returns how many are left. Lists are short */
+static unsigned int bspUniqueClusters(uint32_t *clusters, unsigned int count) {
+	for (unsigned int i = 1; i < count; ++i) {
+		const uint32_t cluster = clusters[i];
+		unsigned int j = i;
+		for (; j > 0 && clusters[j - 1] > cluster; --j)
+			clusters[j] = clusters[j - 1];
+		clusters[j] = cluster;
+	}
+
+	unsigned int unique = 0;
+	for (unsigned int i = 0; i < count; ++i)
+		if (!unique || clusters[unique - 1] != clusters[i])
+			clusters[unique++] = clusters[i];
+	return unique;
+}
+
+/* Reads cluster visibility and splits node groups further, so that all faces of a group
+ * are in the same clusters. Each group is then a range of every draw that has its faces,
+ * drawn only if the camera cluster can see any of the group's clusters.
+ * Faces are in clusters of the leaves that list them. Leaves don't list displacements,
+ * those and other unlisted faces are in clusters of all leaves their bounds touch.
+ * Maps without visibility data, or with inconsistent one, keep node groups, are loaded
+ * with clusters_count = 0 and never PVS culled */
+static enum BSPLoadResult bspLoadModelVisibility(struct LoadModelContext *ctx, struct Stack *persistent,
+		struct BSPModel *model) {
+	const struct Lumps *const lumps = ctx->lumps;
+	model->split_nodes = NULL;
+	model->split_head = -1;
+	model->leaf_cluster = NULL;
+	model->clusters_count = 0;
+	model->visibility = NULL;
+	model->visibility_size = 0;
+	model->cluster_offsets = NULL;
+	model->group_first_cluster = NULL;
+	model->group_clusters = NULL;
+	model->pvs = NULL;
+
+	if (lumps->visibility.n < sizeof(uint32_t) || !lumps->leaves.n || ctx->model->head_node < 0
+			|| (uint32_t)ctx->model->head_node >= lumps->nodes.n) {
+		PRINTF("No visibility data, %u bytes", lumps->visibility.n);
+		return BSPLoadResult_Success;
+	}
+
+	uint32_t clusters_count;
+	memcpy(&clusters_count, lumps->visibility.p, sizeof(clusters_count));
+	const uint32_t offsets_end = sizeof(uint32_t) + clusters_count * sizeof(uint32_t) * 2;
+	if (!clusters_count || clusters_count > lumps->leaves.n || offsets_end > lumps->visibility.n) {
+		PRINTF("Warning: inconsistent visibility lump with %u clusters", clusters_count);
+		return BSPLoadResult_Success;
+	}
+
+	void *const tmp_cursor = stackGetCursor(ctx->tmp);
+	const uint32_t row_bytes = (clusters_count + 7) / 8;
+	const int faces_count = ctx->faces_count;
+
+	int *const face_slot = stackAlloc(ctx->tmp, sizeof(int) * ctx->model->num_faces);
+	unsigned int *const face_first = stackAlloc(ctx->tmp, sizeof(unsigned int) * faces_count);
+	unsigned int *const face_end = stackAlloc(ctx->tmp, sizeof(unsigned int) * faces_count);
+	unsigned char *const face_in_leaf = stackAlloc(ctx->tmp, faces_count);
+	uint8_t *const row = stackAlloc(ctx->tmp, row_bytes);
+	if (!face_slot || !face_first || !face_end || !face_in_leaf || !row)
+		return BSPLoadResult_ErrorTempMemory;
+
+	for (int i = 0; i < ctx->model->num_faces; ++i)
+		face_slot[i] = -1;
+	for (int i = 0; i < faces_count; ++i)
+		face_slot[ctx->faces.vface[i] - lumps->faces.p - ctx->model->first_face] = i;
+	memset(face_end, 0, sizeof(unsigned int) * faces_count);
+	memset(face_in_leaf, 0, faces_count);
+
+	int *const leaf_cluster = stackAlloc(persistent, sizeof(int) * lumps->leaves.n);
+	struct BSPSplitNode *const split_nodes = stackAlloc(persistent, sizeof(struct BSPSplitNode) * lumps->nodes.n);
+	uint32_t *const cluster_offsets = stackAlloc(persistent, sizeof(uint32_t) * clusters_count);
+	uint8_t *const visibility = stackAlloc(persistent, lumps->visibility.n);
+	unsigned char *const pvs = stackAlloc(persistent, row_bytes);
+	if (!leaf_cluster || !split_nodes || !cluster_offsets || !visibility || !pvs)
+		return BSPLoadResult_ErrorMemory;
+
+	for (uint32_t i = 0; i < lumps->nodes.n; ++i) {
+		const struct VBSPLumpNode *const lnode = lumps->nodes.p + i;
+		struct BSPSplitNode *const node = split_nodes + i;
+		if (lnode->plane >= lumps->planes.n)
+			goto inconsistent;
+
+		const struct VBSPLumpPlane *const plane = lumps->planes.p + lnode->plane;
+		node->normal = aVec3f(plane->x, plane->y, plane->z);
+		node->dist = plane->d;
+		for (int k = 0; k < 2; ++k) {
+			const int32_t child = (int32_t)lnode->children[k];
+			if (child >= 0 ? (uint32_t)child >= lumps->nodes.n : (uint32_t)(-1 - child) >= lumps->leaves.n)
+				goto inconsistent;
+			node->children[k] = child;
+		}
+	}
+
+	/* offsets are pairs of PVS and PAS rows, lump data is not aligned for reading them in place */
+	for (uint32_t c = 0; c < clusters_count; ++c) {
+		memcpy(cluster_offsets + c, lumps->visibility.p + sizeof(uint32_t) * (1 + c * 2), sizeof(uint32_t));
+		if (!bspDecompressVisRow(lumps->visibility.p, lumps->visibility.n, cluster_offsets[c], row, row_bytes))
+			goto inconsistent;
+	}
+	memcpy(visibility, lumps->visibility.p, lumps->visibility.n);
+
+	for (uint32_t i = 0; i < lumps->leaves.n; ++i) {
+		const uint16_t cluster = lumps->leaves.p[i].cluster;
+		leaf_cluster[i] = cluster < clusters_count ? cluster : -1;
+	}
+
+	/* first pass counts clusters of every face, second one lists them after the previous face's */
+	uint32_t *face_clusters = NULL;
+	for (int pass = 0; pass < 2; ++pass) {
+		for (uint32_t i = 0; i < lumps->leaves.n; ++i) {
+			const struct VBSPLumpLeaf *const leaf = lumps->leaves.p + i;
+			if (leaf_cluster[i] < 0)
+				continue;
+
+			for (uint32_t j = leaf->first_leafface; j < (uint32_t)leaf->first_leafface + leaf->num_leaffaces; ++j) {
+				if (j >= lumps->leaffaces.n)
+					goto inconsistent;
+
+				const uint32_t face = lumps->leaffaces.p[j];
+				if (face < (uint32_t)ctx->model->first_face || face - ctx->model->first_face >= (uint32_t)ctx->model->num_faces)
+					continue;
+
+				const int slot = face_slot[face - ctx->model->first_face];
+				if (slot < 0)
+					continue;
+
+				face_in_leaf[slot] = 1;
+				if (face_clusters)
+					face_clusters[face_end[slot]] = leaf_cluster[i];
+				++face_end[slot];
+			}
+		}
+
+		for (int i = 0; i < faces_count; ++i) {
+			if (face_in_leaf[i])
+				continue;
+
+			const struct AABB box = bspFaceBounds(ctx, i);
+			const int count = bspBoxClusters(split_nodes, leaf_cluster, ctx->model->head_node, &box,
+				face_clusters ? face_clusters + face_end[i] : NULL, 0);
+			if (count < 0)
+				goto inconsistent;
+			face_end[i] += count;
+		}
+
+		if (face_clusters)
+			break;
+
+		unsigned int pairs = 0;
+		for (int i = 0; i < faces_count; ++i) {
+			face_first[i] = pairs;
+			pairs += face_end[i];
+			face_end[i] = face_first[i];
+		}
+
+		face_clusters = stackAlloc(ctx->tmp, sizeof(uint32_t) * pairs);
+		if (!face_clusters) return BSPLoadResult_ErrorTempMemory;
+	}
+
+	/* faces with the same clusters share a set */
+	unsigned int table_size = 1;
+	while (table_size < 2u * faces_count)
+		table_size <<= 1;
+
+	int *const table = stackAlloc(ctx->tmp, sizeof(int) * table_size);
+	uint32_t *const face_set = stackAlloc(ctx->tmp, sizeof(uint32_t) * faces_count);
+	if (!table || !face_set) return BSPLoadResult_ErrorTempMemory;
+	for (unsigned int i = 0; i < table_size; ++i)
+		table[i] = -1;
+
+	unsigned int sets_count = 0;
+	for (int i = 0; i < faces_count; ++i) {
+		const uint32_t *const clusters = face_clusters + face_first[i];
+		face_end[i] = face_first[i] + bspUniqueClusters(face_clusters + face_first[i], face_end[i] - face_first[i]);
+		const unsigned int count = face_end[i] - face_first[i];
+
+		uint32_t hash = 2166136261u;
+		for (unsigned int k = 0; k < count; ++k)
+			hash = (hash ^ clusters[k]) * 16777619u;
+
+		for (unsigned int slot = hash & (table_size - 1);; slot = (slot + 1) & (table_size - 1)) {
+			const int other = table[slot];
+			if (other < 0) {
+				table[slot] = i;
+				face_set[i] = sets_count++;
+				break;
+			}
+
+			if (face_end[other] - face_first[other] == count
+					&& !memcmp(face_clusters + face_first[other], clusters, sizeof(uint32_t) * count)) {
+				face_set[i] = face_set[other];
+				break;
+			}
+		}
+	}
+
+	/* new groups of each node group are next to each other, so nodes still cover group ranges */
+	const unsigned int *const by_set = bspSortFaces(ctx->tmp, face_set, NULL, faces_count);
+	const unsigned int *const order = by_set ? bspSortFaces(ctx->tmp, ctx->faces.group, by_set, faces_count) : NULL;
+	unsigned int *const group_first = stackAlloc(ctx->tmp, sizeof(unsigned int) * (model->groups_count + 1));
+	unsigned int *const face_group = stackAlloc(ctx->tmp, sizeof(unsigned int) * faces_count);
+	int *const group_face = stackAlloc(ctx->tmp, sizeof(int) * faces_count);
+	if (!order || !group_first || !face_group || !group_face) return BSPLoadResult_ErrorTempMemory;
+
+	unsigned int groups_count = 0, group_clusters_count = 0, node_group = 0;
+	for (int i = 0; i < faces_count; ++i) {
+		const int face = order[i], prev = i > 0 ? (int)order[i - 1] : -1;
+		while (node_group <= ctx->faces.group[face])
+			group_first[node_group++] = groups_count;
+
+		if (prev < 0 || ctx->faces.group[prev] != ctx->faces.group[face] || face_set[prev] != face_set[face]) {
+			group_clusters_count += face_end[face] - face_first[face];
+			group_face[groups_count++] = face;
+		}
+
+		face_group[face] = groups_count - 1;
+	}
+	while (node_group <= (unsigned int)model->groups_count)
+		group_first[node_group++] = groups_count;
+
+	unsigned int *const group_first_cluster = stackAlloc(persistent, sizeof(unsigned int) * (groups_count + 1));
+	uint32_t *const group_clusters = stackAlloc(persistent, sizeof(uint32_t) * group_clusters_count);
+	if (!group_first_cluster || !group_clusters) return BSPLoadResult_ErrorMemory;
+
+	group_clusters_count = 0;
+	for (unsigned int g = 0; g < groups_count; ++g) {
+		const int face = group_face[g];
+		const unsigned int count = face_end[face] - face_first[face];
+		group_first_cluster[g] = group_clusters_count;
+		memcpy(group_clusters + group_clusters_count, face_clusters + face_first[face], sizeof(uint32_t) * count);
+		group_clusters_count += count;
+	}
+	group_first_cluster[groups_count] = group_clusters_count;
+
+	for (int i = 0; i < model->nodes_count; ++i) {
+		struct BSPNode *const node = model->nodes + i;
+		const unsigned int first = group_first[node->first_group];
+		node->groups_count = group_first[node->first_group + node->groups_count] - first;
+		node->first_group = first;
+	}
+
+	PRINTF("Visibility: %u clusters, %u face cluster sets, face groups: %d -> %u",
+		clusters_count, sets_count, model->groups_count, groups_count);
+
+	memcpy(ctx->faces.group, face_group, sizeof(unsigned int) * faces_count);
+	model->groups_count = groups_count;
+	model->split_nodes = split_nodes;
+	model->split_head = ctx->model->head_node;
+	model->leaf_cluster = leaf_cluster;
+	model->clusters_count = clusters_count;
+	model->visibility = visibility;
+	model->visibility_size = lumps->visibility.n;
+	model->cluster_offsets = cluster_offsets;
+	model->group_first_cluster = group_first_cluster;
+	model->group_clusters = group_clusters;
+	model->pvs = pvs;
+
+	stackFreeUpToPosition(ctx->tmp, tmp_cursor);
+	return BSPLoadResult_Success;
+
+inconsistent:
+	PRINTF("Warning: inconsistent visibility data, map won't be PVS culled%s", "");
+	stackFreeUpToPosition(ctx->tmp, tmp_cursor);
+	return BSPLoadResult_Success;
+}
+
+const unsigned char *bspClusterPVS(const struct BSPModel *model, int cluster) {
+	if (cluster < 0 || cluster >= model->clusters_count)
+		return NULL;
+
+	const uint32_t row_bytes = (model->clusters_count + 7) / 8;
+	if (!bspDecompressVisRow(model->visibility, model->visibility_size, model->cluster_offsets[cluster],
+			model->pvs, row_bytes))
+		return NULL;
+
+	return model->pvs;
+}
+
+int bspFindCluster(const struct BSPModel *model, struct AVec3f pos) {
+	if (!model->clusters_count)
+		return -1;
+
+	int node = model->split_head;
+	for (int depth = 0; node >= 0; ++depth) {
+		if (depth > BSP_MAX_NODE_DEPTH)
+			return -1;
 
-	struct AtlasContext atlas_context;
-	atlas_context.temp_storage.ptr = stackGetCursor(ctx->tmp);
-	atlas_context.temp_storage.size = stackGetFree(ctx->tmp);
-	atlas_context.width = 16; /* TODO opengl caps */
-	atlas_context.height = 16;
-	atlas_context.rects = (void*)(&ctx->faces[0].width);
-	atlas_context.rects_count = ctx->faces_count;
-	atlas_context.rects_stride = sizeof(ctx->faces[0]);
-	atlas_context.pos = (void*)(&ctx->faces[0].atlas_x);
-	atlas_context.pos_stride = sizeof(ctx->faces[0]);
-	while (atlas_context.width < (unsigned)ctx->lightmap.max_width) atlas_context.width <<= 1;
-	while (atlas_context.height < (unsigned)ctx->lightmap.max_height) atlas_context.height <<= 1;
-	while (atlas_context.width * atlas_context.height < (unsigned)ctx->lightmap.pixels)
-		if (atlas_context.width < atlas_context.height) atlas_context.width <<= 1; else atlas_context.height <<= 1;
-
-	for(;;) {
-		const enum AtlasResult result = atlasCompute(&atlas_context);
+		const struct BSPSplitNode *const split = model->split_nodes + node;
+		const float d = split->normal.x * pos.x + split->normal.y * pos.y + split->normal.z * pos.z - split->dist;
+		node = split->children[d >= 0.f ? 0 : 1];
+	}
 
-		PRINTF("atlas: %u %u %d", atlas_context.width, atlas_context.height, result);
+	return model->leaf_cluster[-1 - node];
+}
 
-		if (result == Atlas_Success)
-			break;
+/* FIFO size for reporting ACMR, smaller than what triangles are ordered for,
+ * so that numbers are representative of mobile GPUs too */
+static const unsigned int c_acmr_cache_size = 16;
+
+/* Reorders triangles of each node group range of detailed draws for post-transform
+ * vertex cache, then vertices of each draw in the order triangles fetch them. After
+ * welding vertex ranges of detailed draws don't overlap, and coarse draws of planar
+ * faces cover the same index ranges, so they stay valid. New index of every vertex is written to remap.
+ * Returns 0 if out of temp memory */
+static int bspOptimizeDraws(struct Stack *tmp, const struct BSPModel *model,
+		struct BSPModelVertex *vertices, int vertices_count, BSPIndex *indices, unsigned int *remap) {
+	void *const tmp_cursor = stackGetCursor(tmp);
+	float misses_before = 0, misses_after = 0;
+	unsigned int triangles = 0;
+
+	for (int v = 0; v < vertices_count; ++v)
+		remap[v] = v;
+
+	for (int i = 0; i < model->detailed.draws_count; ++i) {
+		const struct BSPDraw *const draw = model->detailed.draws + i;
+		if (draw->count < 3)
+			continue;
 
-		if (result == Atlas_ErrorInsufficientTemp)
-			return BSPLoadResult_ErrorTempMemory;
+		BSPIndex *const draw_indices = indices + draw->start;
+		unsigned int min = ~0u, max = 0;
+		for (unsigned int j = 0; j < draw->count; ++j) {
+			const unsigned int index = draw_indices[j] + draw->vbo_offset;
+			if (index < min) min = index;
+			if (index > max) max = index;
+		}
+		const unsigned int draw_vertices = max - min + 1;
+
+		void *const draw_cursor = stackGetCursor(tmp);
+		unsigned int *const local = stackAlloc(tmp, sizeof(unsigned int) * draw->count);
+		unsigned int *const draw_remap = stackAlloc(tmp, sizeof(unsigned int) * draw_vertices);
+		struct BSPModelVertex *const copy = stackAlloc(tmp, sizeof(struct BSPModelVertex) * draw_vertices);
+		if (!local || !draw_remap || !copy)
+			goto error;
+
+		for (unsigned int j = 0; j < draw->count; ++j)
+			local[j] = draw_indices[j] + draw->vbo_offset - min;
+
+		const float before = meshoptACMR(tmp, local, draw->count, draw_vertices, c_acmr_cache_size);
+		if (before < 0)
+			goto error;
+
+		/* triangles stay within their node group range, vertices are renumbered for the whole draw */
+		for (unsigned int j = 0; j < draw->ranges_count; ++j) {
+			const struct BSPDrawRange *const range = model->ranges + draw->first_range + j;
+			if (!meshoptOptimizeVertexCache(tmp, local + (range->start - draw->start), range->count, draw_vertices))
+				goto error;
+		}
+		const float after = meshoptACMR(tmp, local, draw->count, draw_vertices, c_acmr_cache_size);
+		if (after < 0)
+			goto error;
+
+		misses_before += before * (draw->count / 3);
+		misses_after += after * (draw->count / 3);
+		triangles += draw->count / 3;
+
+		meshoptOptimizeVertexFetch(local, draw->count, draw_remap, draw_vertices);
+		memcpy(copy, vertices + min, sizeof(struct BSPModelVertex) * draw_vertices);
+		for (unsigned int v = 0; v < draw_vertices; ++v) {
+			vertices[min + draw_remap[v]] = copy[v];
+			remap[min + v] = min + draw_remap[v];
+		}
 
-		if (atlas_context.width < atlas_context.height) atlas_context.width <<= 1; else atlas_context.height <<= 1;
-		if (atlas_context.width > 2048 || atlas_context.height > 2048) /* TODO limit based on GL driver caps */
-			return BSPLoadResult_ErrorCapabilities;
+		for (unsigned int j = 0; j < draw->count; ++j)
+			draw_indices[j] = (BSPIndex)(local[j] + min - draw->vbo_offset);
+
+		stackFreeUpToPosition(tmp, draw_cursor);
 	}
 
-	/* Build an atlas texture based on calculated fragment positions */
-	const size_t atlas_size = sizeof(uint16_t) * atlas_context.width * atlas_context.height;
-	uint16_t *const pixels = stackAlloc(ctx->tmp, atlas_size);
-	if (!pixels) return BSPLoadResult_ErrorTempMemory;
-	memset(pixels, 0x0f, atlas_size); /* TODO debug pattern */
+	if (triangles)
+		PRINTF("Vertex cache ACMR (FIFO %u): %.3f -> %.3f", c_acmr_cache_size,
+			misses_before / triangles, misses_after / triangles);
 
-	for (int i = 0; i < ctx->faces_count; ++i) {
-		const struct Face *const face = ctx->faces + i;
-		ASSERT((unsigned)face->atlas_x + face->width <= atlas_context.width);
-		ASSERT((unsigned)face->atlas_y + face->height <= atlas_context.height);
-		for (int y = 0; y < face->height; ++y) {
-			for (int x = 0; x < face->width; ++x) {
-				const struct VBSPLumpLightMap *const pixel = face->samples + x + y * face->width;
-
-				const unsigned int
-					r = scaleLightmapColor(pixel->r, pixel->exponent),
-					g = scaleLightmapColor(pixel->g, pixel->exponent),
-					b = scaleLightmapColor(pixel->b, pixel->exponent);
-
-				pixels[face->atlas_x + x + (face->atlas_y + y) * atlas_context.width]
-					= ((r&0xf8) << 8) | ((g&0xfc) << 3) | (b >> 3);
-			} /* for x */
-		} /* for y */
-	} /* fot all visible faces */
-
-	RTextureUploadParams upload;
-	upload.width = atlas_context.width;
-	upload.height = atlas_context.height;
-	upload.format = RTexFormat_RGB565;
-	upload.pixels = pixels;
-	upload.mip_level = -2;
-	upload.type = RTexType_2D;
-	upload.wrap = RTexWrap_Clamp;
-	renderTextureInit(&ctx->lightmap.texture);
-	renderTextureUpload(&ctx->lightmap.texture, upload);
-	//ctx->lightmap.texture.min_filter = RTmF_Nearest;
-
-	/* pixels buffer is not needed anymore */
-	stackFreeUpToPosition(ctx->tmp, pixels);
+	return 1;
 
-	return BSPLoadResult_Success;
+error:
+	stackFreeUpToPosition(tmp, tmp_cursor);
+	return 0;
 }
 
-static inline struct AVec3f aVec3fLumpVec(struct VBSPLumpVertex v) { return aVec3f(v.x, v.y, v.z); }
+/* draw key, most significant first: lightmap page keeps draws page-coherent,
+ * displacements go after planar faces of the same page so that coarse draws
+ * can replace them with a lower resolution block, then shader and base texture.
+ * Faces with equal keys go into the same draw */
+static uint32_t bspFaceDrawKey(const struct LoadModelContext *ctx, int face) {
+	const Material *const material = ctx->faces.material[face];
+	const unsigned int atlas_page = ctx->faces.atlas_page[face];
+	const Texture *const texture = material->base_texture.texture;
+	const uint32_t texture_id = texture ? (uint32_t)texture->id + 1 : 0;
+
+	const uint32_t displaced = ctx->faces.dispinfo[face] ? 1 : 0;
+
+	ASSERT(atlas_page < (1u << 8));
+	ASSERT(material->shader < (1 << 4));
+	ASSERT(texture_id < (1u << 19));
+	return (atlas_page << 24) | (displaced << 23) | ((uint32_t)material->shader << 19) | texture_id;
+}
 
-static inline float clamp(float x, float min, float max) {
-	return x < min ? min : (x > max ? max : x);
+
+/* coarse[0] draws displacements with this many quads per side regardless of their power, each next
+ * level with half as many. Edges shared by neighbouring displacements sample the same points and don't crack */
+static const int c_disp_coarse_segments = 4;
+
+static int bspDisplacementCoarseStride(int power, int level) {
+	const int segments = 1 << power;
+	int coarse_segments = c_disp_coarse_segments >> level;
+	if (coarse_segments < 1) coarse_segments = 1;
+	return segments > coarse_segments ? segments / coarse_segments : 1;
 }
 
-#ifdef DEBUG_DISP_LIGHTMAP
-static int shouldSwapUV(struct AVec3f mapU, struct AVec3f mapV, const struct AVec3f *v) {
-	float mappedU = 0.f, mappedV = 0.f;
-	for (int i = 0; i < 4; ++i) {
-		const float U = aVec3fDot(mapU, aVec3fSub(v[(i+1)%4], v[i]));
-		if (U > mappedU) mappedU = U;
-		const float V = aVec3fDot(mapV, aVec3fSub(v[(i+1)%4], v[i]));
-		if (V > mappedV) mappedV = V;
+/* Writes every stride-th row and column of a displacement grid as a triangle list with
+ * the same winding as bspLoadDisplacement(), out may be NULL for counting only.
+ * Indices are absolute generated vertex numbers. Returns number of indices */
+static int bspDisplacementCoarseIndices(int power, int level, uint32_t first_vertex, uint32_t *out) {
+	const int segments = 1 << power, side = segments + 1;
+	const int stride = bspDisplacementCoarseStride(power, level);
+	const int coarse_segments = segments / stride;
+	if (!out)
+		return coarse_segments * coarse_segments * 6;
+
+	for (int y = 0; y < segments; y += stride) {
+		for (int x = 0; x < segments; x += stride) {
+			const uint32_t base = first_vertex + y * side + x;
+			*out++ = base;
+			*out++ = base + stride * side + stride;
+			*out++ = base + stride * side;
+			*out++ = base;
+			*out++ = base + stride;
+			*out++ = base + stride * side + stride;
+		}
 	}
 
-	const float dX1 = aVec3fLength2(aVec3fSub(v[3], v[0]));
-	const float dX2 = aVec3fLength2(aVec3fSub(v[2], v[1]));
-	const float dY1 = aVec3fLength2(aVec3fSub(v[1], v[0]));
-	const float dY2 = aVec3fLength2(aVec3fSub(v[2], v[3]));
-	const float maxDX = (dX1 > dX2) ? dX1 : dX2;
-	const float maxDY = (dY1 > dY2) ? dY1 : dY2;
-	//PRINTF("mappedU=%f mappedV=%f maxDX=%f, maxDY=%f", mappedU, mappedV, maxDX, maxDY);
-	return (mappedU > mappedV) != (maxDX > maxDY);
+	return coarse_segments * coarse_segments * 6;
 }
-#endif /* DEBUG_DISP_LIGHTMAP */
 
-static void bspLoadDisplacement(
-		const struct LoadModelContext *ctx,
-		const struct Face *face,
-		struct BSPModelVertex *out_vertices, uint16_t *out_indices, int index_shift) {
- 	const int side = (1 << face->dispinfo->power) + 1;
-	const struct VBSPLumpVertex *const vertices = ctx->lumps->vertices.p;
-	const struct VBSPLumpTexInfo * const tinfo = face->texinfo;
-	const struct VBSPLumpDispVert *const dispvert = ctx->lumps->dispverts.p + face->dispinfo->vtx_start;
-	
-	//if (face->dispstartvtx != 0) PRINTF("dispstartvtx = %d", face->dispstartvtx);
+/* How far generated displacement vertices are from the triangles of its coarse level grid */
+static float bspDisplacementCoarseError(const struct LoadVertex *vertices, int power, int level) {
+	const int segments = 1 << power, side = segments + 1;
+	const int stride = bspDisplacementCoarseStride(power, level);
+	const float div_stride = 1.f / stride;
+
+	float error = 0.f;
+	for (int y = 0; y < segments; y += stride) {
+		for (int x = 0; x < segments; x += stride) {
+			const struct AVec3f a = vertices[y * side + x].vertex;
+			const struct AVec3f b = vertices[y * side + x + stride].vertex;
+			const struct AVec3f c = vertices[(y + stride) * side + x + stride].vertex;
+			const struct AVec3f d = vertices[(y + stride) * side + x].vertex;
+
+			for (int v = 0; v <= stride; ++v) {
+				for (int u = 0; u <= stride; ++u) {
+					/* quads are split along a-c, see bspDisplacementCoarseIndices() */
+					const struct AVec3f p = u >= v
+						? aVec3fAdd(a, aVec3fAdd(aVec3fMulf(aVec3fSub(b, a), (u - v) * div_stride),
+								aVec3fMulf(aVec3fSub(c, a), v * div_stride)))
+						: aVec3fAdd(a, aVec3fAdd(aVec3fMulf(aVec3fSub(c, a), u * div_stride),
+								aVec3fMulf(aVec3fSub(d, a), (v - u) * div_stride)));
+					error = fmaxf(error, aVec3fLength(aVec3fSub(vertices[(y + v) * side + x + u].vertex, p)));
+				}
+			}
+		}
+	}
 
-	const struct AVec3f vec[4] = { /* bl, tl, tr, br */
-		aVec3fLumpVec(vertices[face->dispquadvtx[(face->dispstartvtx + 0)%4]]),
-		aVec3fLumpVec(vertices[face->dispquadvtx[(face->dispstartvtx + 1)%4]]),
-		aVec3fLumpVec(vertices[face->dispquadvtx[(face->dispstartvtx + 2)%4]]),
-		aVec3fLumpVec(vertices[face->dispquadvtx[(face->dispstartvtx + 3)%4]])};
+	return error;
+}
 
-	/*
-	const struct AVec3f ovec[4] = {
-			aVec3fAdd(vec[0], aVec3fMulf(aVec3f(dispvert[0].x, dispvert[0].y, dispvert[0].z), dispvert[0].dist)),
-			aVec3fAdd(vec[1], aVec3fMulf(aVec3f(dispvert[side*(side-1)].x, dispvert[side*(side-1)].y, dispvert[side*(side-1)].z), dispvert[side*(side-1)].dist)),
-			aVec3fAdd(vec[2], aVec3fMulf(aVec3f(dispvert[side*side-1].x, dispvert[side*side-1].y, dispvert[side*side-1].z), dispvert[side*side-1].dist)),
-			aVec3fAdd(vec[3], aVec3fMulf(aVec3f(dispvert[side-1].x, dispvert[side-1].y, dispvert[side-1].z), dispvert[side-1].dist))};
-	*/
+/* coarse draws change with lightmap page and displacement bit of the draw key */
+static int bspCoarseKeyChanged(const uint32_t *draw_key, int prev, int face) {
+	return prev < 0 || (draw_key[prev] >> 23) != (draw_key[face] >> 23);
+}
 
-	const struct AVec3f lm_map_u = aVec3f(
-		tinfo->lightmap_vecs[0][0], tinfo->lightmap_vecs[0][1], tinfo->lightmap_vecs[0][2]);
-	const float luxels_per_unit = aVec3fLength(lm_map_u);
-	float length_lm_u = luxels_per_unit * floatMax(
-			aVec3fLength(aVec3fSub(vec[3], vec[0])),
-			aVec3fLength(aVec3fSub(vec[2], vec[1])));
-	float length_lm_v = luxels_per_unit * floatMax(
-			aVec3fLength(aVec3fSub(vec[1], vec[0])),
-			aVec3fLength(aVec3fSub(vec[2], vec[3])));
+/* coarse[0] flattens base textures to their average colour, leaving lightmap luxels
+ * as the finest detail, 16 units at the default lightmap scale */
+static const float c_coarse_texture_error = 16.f;
+
+/* Simplified coarse levels: share of coarse[0] triangles to aim for, and how far
+ * in world units the surface is allowed to move to get there, on top of coarse[0] error */
+static const struct {
+	float ratio, error;
+} c_coarse_lods[BSP_COARSE_LODS - 1] = {
+	{ .5f, 8.f },
+	{ .25f, 32.f },
+};
 
-	const struct AVec4f tex_map_u = aVec4f(
-				tinfo->texture_vecs[0][0], tinfo->texture_vecs[0][1],
-				tinfo->texture_vecs[0][2], tinfo->texture_vecs[0][3]);
-	const struct AVec4f tex_map_v = aVec4f(
-				tinfo->texture_vecs[1][0], tinfo->texture_vecs[1][1],
-				tinfo->texture_vecs[1][2], tinfo->texture_vecs[1][3]);
+/* Displacement blocks of coarse draws at every level, all levels are in the index buffer already */
+struct CoarseDisplacements {
+	/* [level * coarse[0].draws_count + draw], count is 0 for draws of planar faces */
+	unsigned int *start, *count;
+	/* largest bspDisplacementCoarseError() of each level */
+	float error[BSP_COARSE_LODS];
+};
 
-#ifdef DEBUG_DISP_LIGHTMAP
-	const int swap = shouldSwapUV(
-				aVec3f(tinfo->lightmap_vecs[0][0], tinfo->lightmap_vecs[0][1], tinfo->lightmap_vecs[0][2]),
-				aVec3f(tinfo->lightmap_vecs[1][0], tinfo->lightmap_vecs[1][1], tinfo->lightmap_vecs[1][2]), vec);
-#endif /*ifdef DEBUG_DISP_LIGHTMAP*/
+/* Builds coarse[1..] by simplifying every planar draw of the previous level within its own vertex range,
+ * displacement draws use their own coarser block of the level instead.
+ * New index blocks are appended after indices_count existing ones into a new buffer allocated from tmp */
+static enum BSPLoadResult bspBuildCoarseLods(struct Stack *tmp, struct Stack *persistent, struct BSPModel *model,
+		const struct BSPModelVertex *vertices, const BSPIndex *indices, const struct CoarseDisplacements *disp,
+		BSPIndex **out_indices, int *indices_count) {
+	int coarse_indices = 0;
+	for (int i = 0; i < model->coarse[0].draws_count; ++i)
+		coarse_indices += model->coarse[0].draws[i].count;
+
+	BSPIndex *const out = stackAlloc(tmp, sizeof(BSPIndex) * (*indices_count + coarse_indices * (BSP_COARSE_LODS - 1)));
+	if (!out) return BSPLoadResult_ErrorTempMemory;
+	memcpy(out, indices, sizeof(BSPIndex) * *indices_count);
+
+	const struct AVec3f box_min = model->vertex_box.min;
+	const struct AVec3f box_scale = aVec3fMulf(aVec3fSub(model->vertex_box.max, model->vertex_box.min), 1.f / 65535.f);
+
+	unsigned int pos = *indices_count;
+	model->coarse[0].error = fmaxf(c_coarse_texture_error, disp->error[0]);
+	for (int level = 1; level < BSP_COARSE_LODS; ++level) {
+		const struct BSPDrawSet *const src = model->coarse + level - 1;
+		struct BSPDrawSet *const set = model->coarse + level;
+		set->draws_count = src->draws_count;
+		set->draws = stackAlloc(persistent, sizeof(struct BSPDraw) * set->draws_count);
+		/* a coarser grid may happen to fit a displacement better, levels still have to get worse */
+		set->error = fmaxf(fmaxf(c_coarse_texture_error + c_coarse_lods[level - 1].error, disp->error[level]), src->error);
+		if (!set->draws) return BSPLoadResult_ErrorMemory;
+
+		int triangles = 0;
+		for (int i = 0; i < set->draws_count; ++i) {
+			const struct BSPDraw *const src_draw = src->draws + i;
+			struct BSPDraw *const draw = set->draws + i;
+			*draw = *src_draw;
+
+			const unsigned int disp_index = level * set->draws_count + i;
+			if (disp->count[disp_index]) {
+				draw->start = disp->start[disp_index];
+				draw->count = disp->count[disp_index];
+				triangles += draw->count / 3;
+				continue;
+			}
 
-	const struct AVec2f atlas_scale = aVec2f(1.f / ctx->lightmap.texture.width, 1.f / ctx->lightmap.texture.height);
-	const struct AVec2f atlas_offset = aVec2f(
-			.5f + face->atlas_x /*+ tinfo->lightmap_vecs[0][3] - face->face->lightmap_min[0]*/,
-			.5f + face->atlas_y /*+ tinfo->lightmap_vecs[1][3] - face->face->lightmap_min[1]*/);
+			draw->start = pos;
+			if (!src_draw->count)
+				continue;
 
-	if (length_lm_u < 0. || length_lm_u >= face->width
-		|| length_lm_v < 0. || length_lm_v >= face->height) {
-		PRINTF("LM OOB: (%f, %f) (%d, %d)", length_lm_u, length_lm_v, face->width, face->height);
-		if (length_lm_u >= face->width) length_lm_u = (float)(face->width - 1);
-		if (length_lm_v >= face->height) length_lm_v = (float)(face->height - 1);
-	}
+			/* simplified in the smallest vertex range the draw uses */
+			unsigned int min = out[src_draw->start], max = min;
+			for (unsigned int j = src_draw->start; j < src_draw->start + src_draw->count; ++j) {
+				if (out[j] < min) min = out[j];
+				if (out[j] > max) max = out[j];
+			}
 
-	/*
-	PRINTF("%f %f %f %f",
-			tinfo->lightmap_vecs[0][3] * atlas_scale.x, face->face->lightmap_min[0] * atlas_scale.x,
-			tinfo->lightmap_vecs[1][3] * atlas_scale.y, face->face->lightmap_min[1] * atlas_scale.y);
-	*/
+			void *const tmp_cursor = stackGetCursor(tmp);
+			unsigned int *const local = stackAlloc(tmp, sizeof(unsigned int) * src_draw->count);
+			float *const positions = stackAlloc(tmp, sizeof(float) * 3 * (max - min + 1));
+			if (!local || !positions) return BSPLoadResult_ErrorTempMemory;
 
-	const float div_side = 1.f / (side - 1);
-	for (int y = 0; y < side; ++y) {
-		const float ty = (float)y * div_side;
-		const struct AVec3f vl = aVec3fMix(vec[0], vec[1], ty);
-		const struct AVec3f vr = aVec3fMix(vec[3], vec[2], ty);
-		for (int x = 0; x < side; ++x) {
-			const float tx = (float)x * div_side;
-			struct BSPModelVertex * const v = out_vertices + y * side + x;
-			const struct VBSPLumpDispVert * const dv = dispvert + y * side + x;
+			for (unsigned int j = 0; j < src_draw->count; ++j)
+				local[j] = out[src_draw->start + j] - min;
 
-			v->vertex = aVec3fMix(vl, vr, tx);
-			v->lightmap_uv = aVec2f(tx * length_lm_u, ty * length_lm_v);
-			v->tex_uv = aVec2f(
-				aVec4fDot(aVec4f3(v->vertex, 1.f), tex_map_u),
-				aVec4fDot(aVec4f3(v->vertex, 1.f), tex_map_v));
-			v->vertex = aVec3fAdd(aVec3fMix(vl, vr, tx), aVec3fMulf(aVec3f(dv->x, dv->y, dv->z), dv->dist));
+			for (unsigned int v = 0; v <= max - min; ++v) {
+				const uint16_t *q = vertices[src_draw->vbo_offset + min + v].vertex;
+				positions[v * 3 + 0] = box_min.x + box_scale.x * q[0];
+				positions[v * 3 + 1] = box_min.y + box_scale.y * q[1];
+				positions[v * 3 + 2] = box_min.z + box_scale.z * q[2];
+			}
 
-			if (v->lightmap_uv.x < 0 || v->lightmap_uv.y < 0 || v->lightmap_uv.x > face->width || v->lightmap_uv.y > face->height)
-				PRINTF("Error: DISP OOB LM F:V%d: x=%f y=%f z=%f tx=%f, ty=%f u=%f v=%f w=%d h=%d",
-						x + y * side, v->vertex.x, v->vertex.y, v->vertex.z, tx, ty, v->lightmap_uv.x, v->lightmap_uv.y, face->width, face->height);
+			const unsigned int target = (unsigned int)(model->coarse[0].draws[i].count / 3 * c_coarse_lods[level - 1].ratio) * 3;
+			draw->count = meshoptSimplify(tmp, local, src_draw->count, positions, max - min + 1, target,
+				c_coarse_lods[level - 1].error);
 
-			v->lightmap_uv = aVec2fMul(aVec2fAdd(v->lightmap_uv, atlas_offset), atlas_scale);
+			for (unsigned int j = 0; j < draw->count; ++j)
+				out[pos + j] = (BSPIndex)(local[j] + min);
+			pos += draw->count;
+			triangles += draw->count / 3;
 
-#if 0
-#ifdef DEBUG_DISP_LIGHTMAP
-			v->normal = aVec3f(face->dispstartvtx/3.f, swap, dv->dist / 100.f);
-#else
-			/* FIXME normal */
-			v->normal = aVec3ff(0.f);
-#endif
-#endif
+			stackFreeUpToPosition(tmp, tmp_cursor);
 		}
+
+		PRINTF("Coarse LOD %d: %d triangles, error %.0f", level, triangles, set->error);
 	}
 
-	for (int y = 0; y < side - 1; ++y) {
-		for (int x = 0; x < side - 1; ++x) {
-			const int base = index_shift + y * side + x;
-			*out_indices++ = base;
-			*out_indices++ = base + side + 1;
-			*out_indices++ = base + side;
-			*out_indices++ = base;
-			*out_indices++ = base + 1;
-			*out_indices++ = base + side + 1;
+	*out_indices = out;
+	*indices_count = pos;
+	return BSPLoadResult_Success;
+}
+
+static inline struct AVec3f bspVertexPosition(const struct BSPModel *model, struct AVec3f scale,
+		const struct BSPModelVertex *v) {
+	return aVec3fAdd(model->vertex_box.min, aVec3fMul(scale, aVec3f(v->vertex[0], v->vertex[1], v->vertex[2])));
+}
+
+/* Puts base textures of detailed draws to texture arrays and reorders the draws, so that those
+ * with the same lightmap page, shader and texture array are next to each other and form a batch.
+ * Only with GPU culling available, before draw clusters are built */
+static enum BSPLoadResult bspBuildDrawBatches(struct Stack *tmp, struct Stack *persistent, struct BSPModel *model) {
+	model->draw_batches = NULL;
+	model->draw_batches_count = 0;
+	model->materials_buffer.gl_name = 0;
+	model->detailed_order = NULL;
+	if (!renderSupportsGpuCulling() || !model->detailed.draws_count)
+		return BSPLoadResult_Success;
+
+	void *const tmp_cursor = stackGetCursor(tmp);
+	const int draws_count = model->detailed.draws_count;
+	uint32_t *const keys = stackAlloc(tmp, sizeof(uint32_t) * draws_count);
+	RTextureLayer *const layers = stackAlloc(tmp, sizeof(RTextureLayer) * draws_count);
+	struct BSPDraw *const draws = stackAlloc(tmp, sizeof(struct BSPDraw) * draws_count);
+	if (!keys || !layers || !draws) return BSPLoadResult_ErrorTempMemory;
+
+	for (int i = 0; i < draws_count; ++i) {
+		const struct BSPDraw *const draw = model->detailed.draws + i;
+		const struct Texture *const texture = draw->material->base_texture.texture;
+
+		/* 0 is no texture, 0xffff is not in any array */
+		unsigned int array_key = 0;
+		layers[i].array = -1;
+		layers[i].layer = 0;
+		layers[i].width = layers[i].height = 1;
+		if (texture)
+			array_key = renderTextureArrayAdd(&texture->texture, layers + i) ? (unsigned)layers[i].array + 1 : 0xffffu;
+
+		unsigned int page = 0;
+		while (page < (unsigned)bsp_global.lightmap_atlas.pages_count
+				&& draw->lightmap != &bsp_global.lightmap_atlas.pages[page].texture)
+			++page;
+
+		keys[i] = (page << 24) | ((unsigned)draw->material->shader << 16) | array_key;
+	}
+
+	const unsigned int *const order = bspSortFaces(tmp, keys, NULL, draws_count);
+	if (!order) return BSPLoadResult_ErrorTempMemory;
+
+	struct BSPDrawMaterial *const materials = stackAlloc(tmp, sizeof(struct BSPDrawMaterial) * draws_count);
+	struct BSPDrawBatch *const batches = stackAlloc(tmp, sizeof(struct BSPDrawBatch) * draws_count);
+	if (!materials || !batches) return BSPLoadResult_ErrorTempMemory;
+
+	int batches_count = 0;
+	for (int i = 0; i < draws_count; ++i) {
+		const unsigned int index = order[i];
+		draws[i] = model->detailed.draws[index];
+
+		const RTextureLayer *const layer = layers + index;
+		const MTexture *const base = &draws[i].material->base_texture;
+		struct BSPDrawMaterial *const material = materials + i;
+		material->scale = base->transform.scale;
+		material->translate = base->transform.translate;
+		material->size = aVec2f((float)layer->width, (float)layer->height);
+		material->layer = (float)layer->layer;
+		material->padding = 0.f;
+
+		if (i == 0 || keys[index] != keys[order[i - 1]]) {
+			struct BSPDrawBatch *const batch = batches + batches_count++;
+			batch->material = draws[i].material;
+			batch->lightmap = draws[i].lightmap;
+			batch->texture_array = layer->array;
+			batch->per_draw = (keys[index] & 0xffffu) == 0xffffu;
+			batch->first_draw = i;
+			batch->draws_count = 0;
+			batch->first_cluster = batch->clusters_count = 0;
 		}
+
+		++batches[batches_count - 1].draws_count;
 	}
-}
 
-static void bspLoadFace(
-		const struct LoadModelContext *ctx,
-		const struct Face *face,
-		struct BSPModelVertex *out_vertices, uint16_t *out_indices, int index_shift) {
-	const struct VBSPLumpFace *vface = face->vface;
-	const struct VBSPLumpTexInfo * const tinfo = face->texinfo;
-	struct AVec3f normal;
-	normal.x = ctx->lumps->planes.p[vface->plane].x;
-	normal.y = ctx->lumps->planes.p[vface->plane].y;
-	normal.z = ctx->lumps->planes.p[vface->plane].z;
-	if (vface->side) normal = aVec3fNeg(normal);
+	memcpy(model->detailed.draws, draws, sizeof(struct BSPDraw) * draws_count);
 
-	const struct AVec4f lm_map_u = aVec4f(
-				tinfo->lightmap_vecs[0][0], tinfo->lightmap_vecs[0][1],
-				tinfo->lightmap_vecs[0][2], tinfo->lightmap_vecs[0][3] - vface->lightmap_min[0]);
-	const struct AVec4f lm_map_v = aVec4f(
-				tinfo->lightmap_vecs[1][0], tinfo->lightmap_vecs[1][1],
-				tinfo->lightmap_vecs[1][2], tinfo->lightmap_vecs[1][3] - vface->lightmap_min[1]);
+	/* draws were in index buffer order before sorting */
+	model->detailed_order = stackAlloc(persistent, sizeof(unsigned int) * draws_count);
+	if (!model->detailed_order) return BSPLoadResult_ErrorMemory;
+	for (int i = 0; i < draws_count; ++i)
+		model->detailed_order[order[i]] = i;
 
-	const struct AVec4f tex_map_u = aVec4f(
-				tinfo->texture_vecs[0][0], tinfo->texture_vecs[0][1],
-				tinfo->texture_vecs[0][2], tinfo->texture_vecs[0][3]);
-	const struct AVec4f tex_map_v = aVec4f(
-				tinfo->texture_vecs[1][0], tinfo->texture_vecs[1][1],
-				tinfo->texture_vecs[1][2], tinfo->texture_vecs[1][3]);
+	model->draw_batches = stackAlloc(persistent, sizeof(struct BSPDrawBatch) * batches_count);
+	if (!model->draw_batches) return BSPLoadResult_ErrorMemory;
+	memcpy(model->draw_batches, batches, sizeof(struct BSPDrawBatch) * batches_count);
+	model->draw_batches_count = batches_count;
 
-	const int32_t * const surfedges = ctx->lumps->surfedges.p + vface->first_edge;
-	for (int iedge = 0; iedge < vface->num_edges; ++iedge) {
-		const uint16_t vstart = (surfedges[iedge] >= 0)
-			? ctx->lumps->edges.p[surfedges[iedge]].v[0]
-			: ctx->lumps->edges.p[-surfedges[iedge]].v[1];
+	renderBufferCreate(&model->materials_buffer, RBufferType_Storage, sizeof(struct BSPDrawMaterial) * draws_count, materials);
 
-		const struct VBSPLumpVertex * const lv = ctx->lumps->vertices.p + vstart;
-		struct BSPModelVertex * const vertex = out_vertices + iedge;
+	PRINTF("Draw batches: %d for %d draws", batches_count, draws_count);
+	stackFreeUpToPosition(tmp, tmp_cursor);
+	return BSPLoadResult_Success;
+}
 
-		vertex->vertex = aVec3f(lv->x, lv->y, lv->z);
-		//vertex->normal = normal;
-		vertex->lightmap_uv = aVec2f(
-			aVec4fDot(aVec4f3(vertex->vertex, 1.f),	lm_map_u),
-			aVec4fDot(aVec4f3(vertex->vertex, 1.f), lm_map_v));
-		vertex->tex_uv = aVec2f(
-			aVec4fDot(aVec4f3(vertex->vertex, 1.f), tex_map_u),
-			aVec4fDot(aVec4f3(vertex->vertex, 1.f), tex_map_v));
+/* small enough for culling to be precise, big enough for the commands to not cost more than triangles */
+static const unsigned int c_cluster_triangles = 64;
+
+/* Splits node group ranges of detailed draws into clusters, bounding spheres are around
+ * dequantized vertex positions. With GPU culling available uploads them, along with an
+ * indirect draw command for every cluster that the culling shader only enables or disables */
+static enum BSPLoadResult bspBuildDrawClusters(struct Stack *tmp, struct Stack *persistent, struct BSPModel *model,
+		const struct BSPModelVertex *vertices, const BSPIndex *indices) {
+	const unsigned int cluster_indices = c_cluster_triangles * 3;
+	int count = 0;
+	for (int i = 0; i < model->detailed.draws_count; ++i) {
+		const struct BSPDraw *const draw = model->detailed.draws + i;
+		for (unsigned int j = 0; j < draw->ranges_count; ++j)
+			count += (model->ranges[draw->first_range + j].count + cluster_indices - 1) / cluster_indices;
+	}
 
-		vertex->lightmap_uv.x = clamp(vertex->lightmap_uv.x, 0.f, face->width);
-		vertex->lightmap_uv.y = clamp(vertex->lightmap_uv.y, 0.f, face->height);
+	model->draw_clusters_count = count;
+	model->draw_clusters = stackAlloc(persistent, sizeof(struct BSPDrawCluster) * count);
+	if (!model->draw_clusters) return BSPLoadResult_ErrorMemory;
+
+	const struct AVec3f scale = aVec3fMulf(aVec3fSub(model->vertex_box.max, model->vertex_box.min), 1.f / 65535.f);
+	struct BSPDrawCluster *cluster = model->draw_clusters;
+	for (int i = 0; i < model->detailed.draws_count; ++i) {
+		struct BSPDraw *const draw = model->detailed.draws + i;
+		draw->first_cluster = (unsigned)(cluster - model->draw_clusters);
+		for (unsigned int j = 0; j < draw->ranges_count; ++j) {
+			const struct BSPDrawRange *const range = model->ranges + draw->first_range + j;
+			for (unsigned int start = range->start; start < range->start + range->count; start += cluster_indices) {
+				const unsigned int end = start + cluster_indices < range->start + range->count
+					? start + cluster_indices : range->start + range->count;
+
+				struct AABB box = { aVec3ff(FLT_MAX), aVec3ff(-FLT_MAX) };
+				for (unsigned int k = start; k < end; ++k) {
+					const struct AVec3f p = bspVertexPosition(model, scale, vertices + draw->vbo_offset + indices[k]);
+					bspAABBExtend(&box, p, p);
+				}
 
-		/*
-		if (vertex->lightmap_uv.x < 0 || vertex->lightmap_uv.y < 0 || vertex->lightmap_uv.x > face->width || vertex->lightmap_uv.y > face->height)
-			PRINTF("Error: OOB LM F:V%u: x=%f y=%f z=%f u=%f v=%f w=%d h=%d", iedge, lv->x, lv->y, lv->z, vertex->lightmap_uv.x, vertex->lightmap_uv.y, face->width, face->height);
-		*/
+				cluster->center = aVec3fMulf(aVec3fAdd(box.min, box.max), .5f);
+				cluster->radius = 0.f;
+				for (unsigned int k = start; k < end; ++k) {
+					const struct AVec3f p = bspVertexPosition(model, scale, vertices + draw->vbo_offset + indices[k]);
+					const float radius = aVec3fLength(aVec3fSub(p, cluster->center));
+					if (radius > cluster->radius)
+						cluster->radius = radius;
+				}
 
-		vertex->lightmap_uv.x = (vertex->lightmap_uv.x + face->atlas_x + .5f) / ctx->lightmap.texture.width;
-		vertex->lightmap_uv.y = (vertex->lightmap_uv.y + face->atlas_y + .5f) / ctx->lightmap.texture.height;
+				cluster->start = start;
+				cluster->count = end - start;
+				cluster->group = range->group;
+				cluster->padding = 0;
+				++cluster;
+			}
+		}
+		draw->clusters_count = (unsigned)(cluster - model->draw_clusters) - draw->first_cluster;
+	}
 
-		if (iedge > 1) {
-			out_indices[(iedge-2)*3+0] = index_shift + 0;
-			out_indices[(iedge-2)*3+1] = index_shift + iedge;
-			out_indices[(iedge-2)*3+2] = index_shift + iedge - 1;
+	for (int i = 0; i < model->draw_batches_count; ++i) {
+		struct BSPDrawBatch *const batch = model->draw_batches + i;
+		const struct BSPDraw *const first = model->detailed.draws + batch->first_draw;
+		const struct BSPDraw *const last = first + batch->draws_count - 1;
+		batch->first_cluster = first->first_cluster;
+		batch->clusters_count = last->first_cluster + last->clusters_count - first->first_cluster;
+	}
+
+	PRINTF("Draw clusters: %d", count);
+
+	model->clusters_buffer.gl_name = model->commands_buffer.gl_name = 0;
+	if (!renderSupportsGpuCulling())
+		return BSPLoadResult_Success;
+
+	/* glDrawElementsIndirect() command: count, instance count, first index, base vertex, base instance */
+	uint32_t *const commands = stackAlloc(tmp, sizeof(uint32_t) * 5 * count);
+	if (!commands) return BSPLoadResult_ErrorTempMemory;
+	for (int i = 0; i < model->detailed.draws_count; ++i) {
+		const struct BSPDraw *const draw = model->detailed.draws + i;
+		for (unsigned int j = draw->first_cluster; j < draw->first_cluster + draw->clusters_count; ++j) {
+			commands[j * 5 + 0] = model->draw_clusters[j].count;
+			commands[j * 5 + 1] = 1;
+			commands[j * 5 + 2] = model->draw_clusters[j].start;
+			commands[j * 5 + 3] = 0;
+			commands[j * 5 + 4] = i;
 		}
 	}
+
+	renderBufferCreate(&model->clusters_buffer, RBufferType_Storage, sizeof(struct BSPDrawCluster) * count, model->draw_clusters);
+	renderBufferCreate(&model->commands_buffer, RBufferType_Indirect, sizeof(uint32_t) * 5 * count, commands);
+	stackFreeUpToPosition(tmp, commands);
+	return BSPLoadResult_Success;
 }
 
-static int faceMaterialCompare(const void *a, const void *b) {
-	const struct Face *fa = a, *fb = b;
+/* A vertex array for every distinct vbo_offset of detailed and coarse draws, after vbo and ibo are created */
+static enum BSPLoadResult bspCreateVertexArrays(struct Stack *tmp, struct Stack *persistent, struct BSPModel *model) {
+	int max_offsets = model->detailed.draws_count;
+	for (int i = 0; i < BSP_COARSE_LODS; ++i)
+		max_offsets += model->coarse[i].draws_count;
+
+	model->vertex_arrays = NULL;
+	model->vertex_arrays_count = 0;
+	unsigned int *const offsets = stackAlloc(tmp, sizeof(unsigned int) * max_offsets);
+	if (!offsets) return BSPLoadResult_ErrorTempMemory;
+
+	/* there are only a few segments, if more than one */
+	int count = 0;
+	for (int i = -1; i < BSP_COARSE_LODS; ++i) {
+		const struct BSPDrawSet *const set = i < 0 ? &model->detailed : model->coarse + i;
+		for (int j = 0; j < set->draws_count; ++j) {
+			const unsigned int vbo_offset = set->draws[j].vbo_offset;
+			int k = 0;
+			while (k < count && offsets[k] != vbo_offset)
+				++k;
+			if (k == count)
+				offsets[count++] = vbo_offset;
+		}
+	}
 
-	if (fa->material == fb->material)
-		return 0;
+	RVertexArray *const arrays = stackAlloc(persistent, sizeof(RVertexArray) * count);
+	if (!arrays) return BSPLoadResult_ErrorMemory;
 
-	return fa->material->base_texture.texture - fb->material->base_texture.texture;
+	/* all or none, draws with offsets that have no array would find the default one bound
+	 * without the model index buffer */
+	int created = 0;
+	while (created < count) {
+		renderVertexArrayCreate(arrays + created, &model->vbo, &model->ibo, offsets[created]);
+		if (!arrays[created].gl_name)
+			break;
+		++created;
+	}
+
+	if (created == count) {
+		model->vertex_arrays = arrays;
+		model->vertex_arrays_count = count;
+	} else {
+		for (int i = 0; i < created; ++i)
+			renderVertexArrayDestroy(arrays + i);
+		stackFreeUpToPosition(persistent, arrays);
+	}
+
+	stackFreeUpToPosition(tmp, offsets);
+	return BSPLoadResult_Success;
 }
 
 static enum BSPLoadResult bspLoadModelDraws(const struct LoadModelContext *ctx, struct Stack *persistent,
 		struct BSPModel *model) {
 	void * const tmp_cursor = stackGetCursor(ctx->tmp);
 
-	struct BSPModelVertex * const vertices_buffer
-		= stackAlloc(ctx->tmp, sizeof(struct BSPModelVertex) * ctx->max_draw_vertices);
+	struct LoadVertex * const vertices_buffer
+		= stackAlloc(ctx->tmp, sizeof(struct LoadVertex) * ctx->max_draw_vertices);
 	if (!vertices_buffer) return BSPLoadResult_ErrorTempMemory;
 
-	/* each vertex after second in a vface is a new triangle */
-	uint16_t * const indices_buffer = stackAlloc(ctx->tmp, sizeof(uint16_t) * ctx->indices);
-	if (!indices_buffer) return BSPLoadResult_ErrorTempMemory;
+	uint32_t * const draw_key = ctx->faces.draw_key;
+	for (int iface = 0; iface < ctx->faces_count; ++iface)
+		draw_key[iface] = bspFaceDrawKey(ctx, iface);
+
+	/* faces of each draw go in group order, so that every group is one index range of it */
+	const unsigned int * const by_group = bspSortFaces(ctx->tmp, ctx->faces.group, NULL, ctx->faces_count);
+	const unsigned int * const order = by_group ? bspSortFaces(ctx->tmp, draw_key, by_group, ctx->faces_count) : NULL;
+	if (!order) return BSPLoadResult_ErrorTempMemory;
 
-	qsort(ctx->faces, ctx->faces_count, sizeof(*ctx->faces), faceMaterialCompare);
+	/* detailed draws that only differ from a planar one by the displacement bit of the key */
+	uint32_t *const planar_keys = stackAlloc(ctx->tmp, sizeof(uint32_t) * ctx->faces_count);
+	if (!planar_keys) return BSPLoadResult_ErrorTempMemory;
+	int planar_keys_count = 0, planar_cursor = 0, displacement_split = 0;
 
+	const unsigned int * const group = ctx->faces.group;
+	int coarse_disp_indices[BSP_COARSE_LODS] = {0}, ranges_count = 1;
 	{
 		int vbo_offset = 0, vertex_pos = 0;
 		model->detailed.draws_count = 1;
-		model->coarse.draws_count = 1;
+		model->coarse[0].draws_count = 1;
 		for (int iface = 0; iface < ctx->faces_count; ++iface) {
-			const struct Face *face = ctx->faces + iface;
+			const int face = order[iface], prev = iface > 0 ? (int)order[iface-1] : -1;
 
-			const int update_vbo_offset = (vertex_pos - vbo_offset) + face->vertices >= c_max_draw_vertices;
-			if (update_vbo_offset || (iface > 0 && faceMaterialCompare(ctx->faces+iface-1,face) != 0)) {
-				//PRINTF("%p -> %p", (void*)ctx->faces[iface-1].material->base_texture[0], (void*)face->material->base_texture[0]);
+			const int update_vbo_offset = (vertex_pos - vbo_offset) + ctx->faces.vertices[face] >= c_max_draw_vertices;
+			const int new_draw = update_vbo_offset || (prev >= 0 && draw_key[prev] != draw_key[face]);
+			if (new_draw) {
 				++model->detailed.draws_count;
 			}
 
-			if (update_vbo_offset) {
-				vbo_offset = vertex_pos;
-				++model->coarse.draws_count;
+			/* both planar and displacement keys ascend, and a page has its planar ones first */
+			if (prev < 0 || draw_key[prev] != draw_key[face]) {
+				const uint32_t key = draw_key[face] & ~(1u << 23);
+				if (!ctx->faces.dispinfo[face])
+					planar_keys[planar_keys_count++] = key;
+				else {
+					while (planar_cursor < planar_keys_count && planar_keys[planar_cursor] < key)
+						++planar_cursor;
+					if (planar_cursor < planar_keys_count && planar_keys[planar_cursor] == key)
+						++displacement_split;
+				}
 			}
 
-			vertex_pos += face->vertices;
+			if (new_draw || (prev >= 0 && group[prev] != group[face]))
+				++ranges_count;
+
+			if (update_vbo_offset)
+				vbo_offset = vertex_pos;
+
+			if (update_vbo_offset || (prev >= 0 && bspCoarseKeyChanged(draw_key, prev, face)))
+				++model->coarse[0].draws_count;
+
+			if (ctx->faces.dispinfo[face])
+				for (int level = 0; level < BSP_COARSE_LODS; ++level)
+					coarse_disp_indices[level] += bspDisplacementCoarseIndices(ctx->faces.dispinfo[face]->power, level, 0, 0);
+
+			vertex_pos += ctx->faces.vertices[face];
 		}
 	}
 
-	PRINTF("Faces: %d -> %d detailed draws", ctx->faces_count, model->detailed.draws_count);
+	PRINTF("Faces: %d -> %d detailed draws (%d split off by displacements), %d group ranges",
+		ctx->faces_count, model->detailed.draws_count, displacement_split, ranges_count);
+
+	/* each vertex after second in a vface is a new triangle, coarse displacements
+	 * get their own block of every level after all detailed indices */
+	int coarse_disp_level_start[BSP_COARSE_LODS], coarse_disp_total = 0;
+	for (int level = 0; level < BSP_COARSE_LODS; ++level) {
+		coarse_disp_level_start[level] = coarse_disp_total;
+		coarse_disp_total += coarse_disp_indices[level];
+	}
+
+	const int indices_count = ctx->indices + coarse_disp_total;
+	BSPIndex * const indices_buffer = stackAlloc(ctx->tmp, sizeof(BSPIndex) * indices_count);
+	uint32_t * const coarse_disp_vertices = stackAlloc(ctx->tmp, sizeof(uint32_t) * coarse_disp_total);
+	if (!indices_buffer || !coarse_disp_vertices) return BSPLoadResult_ErrorTempMemory;
+
+	struct CoarseDisplacements coarse_disp;
+	coarse_disp.start = stackAlloc(ctx->tmp, sizeof(unsigned int) * model->coarse[0].draws_count * BSP_COARSE_LODS);
+	coarse_disp.count = stackAlloc(ctx->tmp, sizeof(unsigned int) * model->coarse[0].draws_count * BSP_COARSE_LODS);
+	if (!coarse_disp.start || !coarse_disp.count) return BSPLoadResult_ErrorTempMemory;
+	memset(coarse_disp.count, 0, sizeof(unsigned int) * model->coarse[0].draws_count * BSP_COARSE_LODS);
+	for (int level = 0; level < BSP_COARSE_LODS; ++level)
+		coarse_disp.error[level] = 0.f;
 
 	model->detailed.draws = stackAlloc(persistent, sizeof(struct BSPDraw) * model->detailed.draws_count);
-	model->coarse.draws = stackAlloc(persistent, sizeof(struct BSPDraw) * model->coarse.draws_count);
+	model->coarse[0].draws = stackAlloc(persistent, sizeof(struct BSPDraw) * model->coarse[0].draws_count);
+	model->ranges = stackAlloc(persistent, sizeof(struct BSPDrawRange) * ranges_count);
+	model->groups_visible = stackAlloc(persistent, model->groups_count);
+	if (!model->detailed.draws || !model->coarse[0].draws || !model->ranges || !model->groups_visible)
+		return BSPLoadResult_ErrorMemory;
+	memset(model->groups_visible, 1, model->groups_count);
+
+	int *const draw_first_vertex = stackAlloc(ctx->tmp, sizeof(int) * model->detailed.draws_count);
+	struct AABB *const group_aabb = stackAlloc(ctx->tmp, sizeof(struct AABB) * model->groups_count);
+	if (!draw_first_vertex || !group_aabb) return BSPLoadResult_ErrorTempMemory;
+
+	for (int i = 0; i < model->groups_count; ++i) {
+		group_aabb[i].min = aVec3ff(FLT_MAX);
+		group_aabb[i].max = aVec3ff(-FLT_MAX);
+	}
 
 	int vertex_pos = 0;
 	int draw_indices_start = 0, indices_pos = 0;
+	int coarse_disp_pos[BSP_COARSE_LODS];
+	memcpy(coarse_disp_pos, coarse_disp_level_start, sizeof(coarse_disp_pos));
+	int tex_uv_imprecise = 0;
+	float tex_uv_worst = 0.f;
+	const ATimeUs generate_start = aAppTime();
 	int vbo_offset = 0;
 	int idraw = 0;
 	struct BSPDraw *detailed_draw = model->detailed.draws - 1,
-								 *coarse_draw = model->coarse.draws - 1;
+								 *coarse_draw = model->coarse[0].draws - 1;
+	struct BSPDrawRange *range = model->ranges - 1;
 
 	for (int iface = 0; iface < ctx->faces_count/* + 1*/; ++iface) {
-		const struct Face *face = ctx->faces + iface;
+		const int face = order[iface], prev = iface > 0 ? (int)order[iface-1] : -1;
 
-		const int update_vbo_offset = (vertex_pos - vbo_offset) + face->vertices >= c_max_draw_vertices;
+		const int update_vbo_offset = (vertex_pos - vbo_offset) + ctx->faces.vertices[face] >= c_max_draw_vertices;
 
 		if (update_vbo_offset) {
 			PRINTF("vbo_offset %d -> %d", vbo_offset, vertex_pos);
 			vbo_offset = vertex_pos;
 		}
 
-		if (update_vbo_offset || iface == 0 || faceMaterialCompare(ctx->faces+iface-1,face) != 0) {
+		const int new_draw = update_vbo_offset || prev < 0 || draw_key[prev] != draw_key[face];
+		if (new_draw) {
 			++detailed_draw;
 			detailed_draw->start = draw_indices_start;
 			detailed_draw->count = 0;
 			detailed_draw->vbo_offset = vbo_offset;
-			detailed_draw->material = face->material;
+			detailed_draw->material = ctx->faces.material[face];
+			detailed_draw->lightmap = bspLightmapPage(ctx->faces.atlas_page[face]);
+			detailed_draw->first_range = (unsigned)(range + 1 - model->ranges);
+			detailed_draw->ranges_count = 0;
+			draw_first_vertex[idraw] = vertex_pos;
 
 			++idraw;
 			ASSERT(idraw <= model->detailed.draws_count);
 		}
 
-		if (update_vbo_offset || iface == 0) {
+		if (new_draw || group[prev] != group[face]) {
+			++range;
+			ASSERT(range < model->ranges + ranges_count);
+			range->start = draw_indices_start;
+			range->count = 0;
+			range->group = group[face];
+			++detailed_draw->ranges_count;
+		}
+
+		if (update_vbo_offset || bspCoarseKeyChanged(draw_key, prev, face)) {
 			++coarse_draw;
-			coarse_draw->start = draw_indices_start;
+			coarse_draw->start = ctx->faces.dispinfo[face]
+				? (unsigned)(ctx->indices + coarse_disp_pos[0]) : (unsigned)draw_indices_start;
 			coarse_draw->count = 0;
 			coarse_draw->vbo_offset = vbo_offset;
 			coarse_draw->material = bsp_global.coarse_material;
+			coarse_draw->lightmap = bspLightmapPage(ctx->faces.atlas_page[face]);
+			coarse_draw->first_range = coarse_draw->ranges_count = 0;
+			coarse_draw->first_cluster = coarse_draw->clusters_count = 0;
 		}
 
-		if (face->dispinfo) {
+		if (ctx->faces.dispinfo[face]) {
 			bspLoadDisplacement(ctx, face, vertices_buffer + vertex_pos, indices_buffer + indices_pos, vertex_pos - vbo_offset);
 		} else {
 			bspLoadFace(ctx, face, vertices_buffer + vertex_pos, indices_buffer + indices_pos, vertex_pos - vbo_offset);
 		}
 
-		for (int i = 0; i < face->vertices; ++i) {
-			vertices_buffer[vertex_pos + i].average_color.r =
-				(uint8_t)(face->material->average_color.x * 255.f);
-			vertices_buffer[vertex_pos + i].average_color.g =
-				(uint8_t)(face->material->average_color.y * 255.f);
-			vertices_buffer[vertex_pos + i].average_color.b =
-				(uint8_t)(face->material->average_color.z * 255.f);
+		const float tex_uv_magnitude = bspFinishFaceVertices(ctx, face, vertices_buffer + vertex_pos);
+		if (tex_uv_magnitude < 0.f) {
+			++tex_uv_imprecise;
+			tex_uv_worst = fmaxf(tex_uv_worst, -tex_uv_magnitude);
+		}
+
+		struct AABB *const aabb = group_aabb + group[face];
+		for (int i = 0; i < ctx->faces.vertices[face]; ++i) {
+			const struct AVec3f v = vertices_buffer[vertex_pos + i].vertex;
+			bspAABBExtend(aabb, v, v);
 		}
 
-		vertex_pos += face->vertices;
-		indices_pos += face->indices;
+		vertex_pos += ctx->faces.vertices[face];
+		indices_pos += ctx->faces.indices[face];
 
 		detailed_draw->count += indices_pos - draw_indices_start;
-		coarse_draw->count += indices_pos - draw_indices_start;
+		range->count += indices_pos - draw_indices_start;
+		if (ctx->faces.dispinfo[face]) {
+			const int power = ctx->faces.dispinfo[face]->power;
+			const int first_vertex = vertex_pos - ctx->faces.vertices[face];
+			const unsigned int icoarse = (unsigned)(coarse_draw - model->coarse[0].draws);
+			for (int level = 0; level < BSP_COARSE_LODS; ++level) {
+				const unsigned int disp_index = level * model->coarse[0].draws_count + icoarse;
+				if (!coarse_disp.count[disp_index])
+					coarse_disp.start[disp_index] = (unsigned)(ctx->indices + coarse_disp_pos[level]);
+
+				const int count = bspDisplacementCoarseIndices(power, level,
+					first_vertex, coarse_disp_vertices + coarse_disp_pos[level]);
+				coarse_disp_pos[level] += count;
+				coarse_disp.count[disp_index] += count;
+				coarse_disp.error[level] = fmaxf(coarse_disp.error[level],
+					bspDisplacementCoarseError(vertices_buffer + first_vertex, power, level));
+			}
+			coarse_draw->count = coarse_disp.count[icoarse];
+		} else
+			coarse_draw->count += indices_pos - draw_indices_start;
 
 		//vertex_pos = 0;
 		draw_indices_start = indices_pos;
 	}
 	ASSERT(idraw == model->detailed.draws_count);
+	ASSERT(range + 1 == model->ranges + ranges_count);
+
+	/* children always come after their parent in preorder */
+	for (int i = model->nodes_count - 1; i >= 0; --i) {
+		struct BSPNode *const node = model->nodes + i;
+		node->aabb.min = aVec3ff(FLT_MAX);
+		node->aabb.max = aVec3ff(-FLT_MAX);
+		if (node->children[0] < 0 && node->children[1] < 0) {
+			/* visibility may have split its group */
+			for (unsigned int g = node->first_group; g < node->first_group + node->groups_count; ++g)
+				bspAABBExtend(&node->aabb, group_aabb[g].min, group_aabb[g].max);
+			continue;
+		}
+
+		for (int k = 0; k < 2; ++k) {
+			if (node->children[k] < 0)
+				continue;
+			bspAABBExtend(&node->aabb, model->nodes[node->children[k]].aabb.min, model->nodes[node->children[k]].aabb.max);
+		}
+	}
+
+	profileEvent("bsp vertex generation", aAppTime() - generate_start);
+	if (tex_uv_imprecise)
+		PRINTF("Warning: %d faces span too many texture repeats to pack precisely, up to %.1f from centre",
+			tex_uv_imprecise, tex_uv_worst);
+
+	struct BSPModelVertex *const packed_vertices = stackAlloc(ctx->tmp, sizeof(struct BSPModelVertex) * vertex_pos);
+	if (!packed_vertices) return BSPLoadResult_ErrorTempMemory;
+	bspPackVertices(vertices_buffer, vertex_pos, &model->vertex_box, packed_vertices);
+
+	int *const weld_remap = stackAlloc(ctx->tmp, sizeof(int) * vertex_pos);
+	if (!weld_remap) return BSPLoadResult_ErrorTempMemory;
+	const int welded_count = bspWeldVertices(ctx->tmp, model, draw_first_vertex, packed_vertices, vertex_pos,
+		indices_buffer, weld_remap);
+	if (welded_count < 0) return BSPLoadResult_ErrorTempMemory;
+	PRINTF("Welded vertices: %d -> %d, VBO %uKiB -> %uKiB", vertex_pos, welded_count,
+		(unsigned)(sizeof(struct BSPModelVertex) * vertex_pos) >> 10,
+		(unsigned)(sizeof(struct BSPModelVertex) * welded_count) >> 10);
+
+	unsigned int *const fetch_remap = stackAlloc(ctx->tmp, sizeof(unsigned int) * welded_count);
+	if (!fetch_remap || !bspOptimizeDraws(ctx->tmp, model, packed_vertices, welded_count, indices_buffer, fetch_remap))
+		return BSPLoadResult_ErrorTempMemory;
+
+	const enum BSPLoadResult batches_result = bspBuildDrawBatches(ctx->tmp, persistent, model);
+	if (batches_result != BSPLoadResult_Success) return batches_result;
+
+	const enum BSPLoadResult clusters_result = bspBuildDrawClusters(ctx->tmp, persistent, model, packed_vertices, indices_buffer);
+	if (clusters_result != BSPLoadResult_Success) return clusters_result;
+
+	/* coarse displacement blocks reference generated vertices, follow them to where welding and reordering put them */
+	int coarse_triangles = 0;
+	for (int i = 0; i < model->coarse[0].draws_count; ++i) {
+		const struct BSPDraw *const draw = model->coarse[0].draws + i;
+		coarse_triangles += draw->count / 3;
+
+		for (int level = 0; level < BSP_COARSE_LODS; ++level) {
+			const unsigned int disp_index = level * model->coarse[0].draws_count + i;
+			const unsigned int start = coarse_disp.start[disp_index], count = coarse_disp.count[disp_index];
+			for (unsigned int j = start; j < start + count; ++j)
+				indices_buffer[j] = (BSPIndex)(fetch_remap[weld_remap[coarse_disp_vertices[j - ctx->indices]]] - draw->vbo_offset);
+		}
+	}
+	PRINTF("Triangles: %d detailed, %d coarse, displacement error %.1f", ctx->indices / 3, coarse_triangles,
+		coarse_disp.error[0]);
+
+	BSPIndex *lod_indices_buffer;
+	int lod_indices_count = indices_count;
+	const enum BSPLoadResult lod_result = bspBuildCoarseLods(ctx->tmp, persistent, model, packed_vertices,
+		indices_buffer, &coarse_disp, &lod_indices_buffer, &lod_indices_count);
+	if (lod_result != BSPLoadResult_Success) return lod_result;
+
+	renderBufferCreate(&model->ibo, RBufferType_Index, sizeof(BSPIndex) * lod_indices_count, lod_indices_buffer);
+	renderBufferCreate(&model->vbo, RBufferType_Vertex, sizeof(struct BSPModelVertex) * welded_count, packed_vertices);
+
+	const enum BSPLoadResult arrays_result = bspCreateVertexArrays(ctx->tmp, persistent, model);
+	if (arrays_result != BSPLoadResult_Success) return arrays_result;
+
+	stackFreeUpToPosition(ctx->tmp, tmp_cursor);
+	return BSPLoadResult_Success;
+}
+
+/* occluders are big enough to hide something on their own, budget goes to the largest ones */
+static const float c_occluder_min_area = 64.f * 64.f;
+static const int c_occluder_max_triangles = 512;
+
+struct OccluderFace {
+	float area;
+	int face;
+};
+
+static int bspOccluderFaceCompare(const void *a, const void *b) {
+	const float aa = ((const struct OccluderFace*)a)->area, ab = ((const struct OccluderFace*)b)->area;
+	return aa > ab ? -1 : (aa < ab ? 1 : 0);
+}
+
+/* Collects triangles of the largest opaque planar faces for software occlusion culling.
+ * Displacements are left out, as well as sky and translucent or water surfaces.
+ * Triangles have the same winding as the drawn ones */
+static enum BSPLoadResult bspLoadModelOccluders(const struct LoadModelContext *ctx, struct Stack *persistent,
+		struct BSPModel *model) {
+	void *const tmp_cursor = stackGetCursor(ctx->tmp);
+	const struct VBSPLumpVertex *const lverts = ctx->lumps->vertices.p;
+
+	struct OccluderFace *const candidates = stackAlloc(ctx->tmp, sizeof(struct OccluderFace) * ctx->faces_count);
+	if (!candidates) return BSPLoadResult_ErrorTempMemory;
+
+	int candidates_count = 0;
+	for (int face = 0; face < ctx->faces_count; ++face) {
+		if (ctx->faces.dispinfo[face]
+				|| (ctx->faces.texinfo[face]->flags & (VBSP_Surface_Sky2D | VBSP_Surface_Sky
+					| VBSP_Surface_Trans | VBSP_Surface_Warp)))
+			continue;
+
+		const uint32_t *const corners = ctx->corners + ctx->faces.first_corner[face];
+		const int count = ctx->faces.vface[face]->num_edges;
+		const struct AVec3f v0 = aVec3fLumpVec(lverts[corners[0]]);
+		struct AVec3f sum = aVec3ff(0);
+		for (int i = 2; i < count; ++i)
+			sum = aVec3fAdd(sum, aVec3fCross(
+				aVec3fSub(aVec3fLumpVec(lverts[corners[i-1]]), v0),
+				aVec3fSub(aVec3fLumpVec(lverts[corners[i]]), v0)));
+
+		const float area = aVec3fLength(sum) * .5f;
+		if (area < c_occluder_min_area)
+			continue;
+
+		candidates[candidates_count].area = area;
+		candidates[candidates_count].face = face;
+		++candidates_count;
+	}
+
+	qsort(candidates, candidates_count, sizeof(*candidates), bspOccluderFaceCompare);
+
+	int triangles = 0, faces = 0;
+	for (; faces < candidates_count; ++faces) {
+		const int face_triangles = ctx->faces.vface[candidates[faces].face]->num_edges - 2;
+		if (triangles + face_triangles > c_occluder_max_triangles)
+			break;
+		triangles += face_triangles;
+	}
+
+	model->occluders_count = triangles;
+	model->occluders = stackAlloc(persistent, sizeof(float) * 9 * triangles);
+	if (triangles && !model->occluders) return BSPLoadResult_ErrorMemory;
+
+	float *out = model->occluders;
+	for (int i = 0; i < faces; ++i) {
+		const int face = candidates[i].face;
+		const uint32_t *const corners = ctx->corners + ctx->faces.first_corner[face];
+		for (int iedge = 2; iedge < ctx->faces.vface[face]->num_edges; ++iedge) {
+			const uint32_t tri[3] = { corners[0], corners[iedge], corners[iedge - 1] };
+			for (int k = 0; k < 3; ++k) {
+				*out++ = lverts[tri[k]].x;
+				*out++ = lverts[tri[k]].y;
+				*out++ = lverts[tri[k]].z;
+			}
+		}
+	}
 
-	renderBufferCreate(&model->ibo, RBufferType_Index, sizeof(uint16_t) * ctx->indices, indices_buffer);
-	renderBufferCreate(&model->vbo, RBufferType_Vertex, sizeof(struct BSPModelVertex) * vertex_pos, vertices_buffer);
+	PRINTF("Occluders: %d of %d faces, %d triangles", faces, candidates_count, triangles);
 
 	stackFreeUpToPosition(ctx->tmp, tmp_cursor);
 	return BSPLoadResult_Success;
@@ -705,8 +2784,15 @@ static enum BSPLoadResult bspLoadModel(
 	context.lumps = lumps;
 	context.model = lumps->models.p + index;
 
+	/* Step 0. Resolve materials once per texdata */
+	enum BSPLoadResult result = bspLoadModelMaterials(&context);
+	if (result != BSPLoadResult_Success) {
+		PRINTF("Error: bspLoadModelMaterials() => %s", R2S(result));
+		return result;
+	}
+
 	/* Step 1. Collect lightmaps for all faces */
-	enum BSPLoadResult result = bspLoadModelPreloadFaces(&context);
+	result = bspLoadModelPreloadFaces(&context);
 	if (result != BSPLoadResult_Success) {
 		PRINTF("Error: bspLoadModelPreloadFaces() => %s", R2S(result));
 		return result;
@@ -719,14 +2805,34 @@ static enum BSPLoadResult bspLoadModel(
 		return result;
 	}
 
-	/* Step 3. Generate draw operations data */
+	/* Step 3. Split faces into groups along BSP tree */
+	result = bspLoadModelNodes(&context, persistent, model);
+	if (result != BSPLoadResult_Success) {
+		PRINTF("Error: bspLoadModelNodes() => %s", R2S(result));
+		return result;
+	}
+
+	/* Step 4. Find which groups can be seen from each visibility cluster */
+	result = bspLoadModelVisibility(&context, persistent, model);
+	if (result != BSPLoadResult_Success) {
+		PRINTF("Error: bspLoadModelVisibility() => %s", R2S(result));
+		return result;
+	}
+
+	/* Step 5. Generate draw operations data */
 	result = bspLoadModelDraws(&context, persistent, model);
 	if (result != BSPLoadResult_Success) {
 		//aGLTextureDestroy(&context.lightmap.texture);
 		return result;
 	}
 
-	model->lightmap = context.lightmap.texture;
+	/* Step 6. Pick faces to be occluders for software occlusion culling */
+	result = bspLoadModelOccluders(&context, persistent, model);
+	if (result != BSPLoadResult_Success) {
+		PRINTF("Error: bspLoadModelOccluders() => %s", R2S(result));
+		return result;
+	}
+
 	model->aabb.min.x = context.model->min.x;
 	model->aabb.min.y = context.model->min.y;
 	model->aabb.min.z = context.model->min.z;
@@ -737,21 +2843,14 @@ static enum BSPLoadResult bspLoadModel(
 	return BSPLoadResult_Success;
 } // bspLoadModel()
 
-static const char *bsp_skybox_suffix[6] = {
-	"rt", "lf", "ft", "bk", "up", "dn" };
-
 static void bspLoadSkybox(StringView name, ICollection *coll, Stack *tmp, struct BSPModel *model) {
 	PRINTF("Loading skybox %.*s", name.length, name.str);
 
-	char *zname = alloca(name.length + 3 + 7);
-	memset(zname, 0, name.length + 3 + 7);
-	memcpy(zname, "skybox/", 7);
-	memcpy(zname + 7, name.str, name.length);
+	char *zname = alloca(name.length + 1);
+	memcpy(zname, name.str, name.length);
+	zname[name.length] = '\0';
 
-	for (int i = 0; i < 6; ++i) {
-		memcpy(zname + name.length + 7, bsp_skybox_suffix[i], 2);
-		model->skybox[i] = materialGet(zname, coll, tmp);
-	}
+	model->skybox = textureGetSkybox(zname, coll, tmp);
 }
 
 typedef struct {
@@ -976,6 +3075,8 @@ enum BSPLoadResult bspLoadWorldspawn(BSPLoadModelContext context) {
 
 	void *tmp_cursor = stackGetCursor(context.tmp);
 	struct ICollection *pakfile = NULL;
+	struct BSPLightmapAtlasMark lightmap_mark;
+	int lightmap_marked = 0;
 
 	struct VBSPHeader vbsp_header;
 	size_t bytes = file->read(file, 0, sizeof vbsp_header, &vbsp_header);
@@ -1024,6 +3125,13 @@ enum BSPLoadResult bspLoadWorldspawn(BSPLoadModelContext context) {
 			pakfile->next = context.collection;
 	}
 
+	/* maps that fail to load don't keep their regions of shared lightmap pages */
+	lightmap_marked = bspLightmapAtlasMark(context.tmp, &lightmap_mark);
+	if (!lightmap_marked) {
+		result = BSPLoadResult_ErrorTempMemory;
+		goto exit;
+	}
+
 	result = bspLoadModel(pakfile ? pakfile : context.collection, context.model, context.persistent, context.tmp, &lumps, 0);
 	if (result != BSPLoadResult_Success) {
 		PRINTF("Error: bspLoadModel() => %s", R2S(result));
@@ -1035,6 +3143,9 @@ enum BSPLoadResult bspLoadWorldspawn(BSPLoadModelContext context) {
 		PRINTF("Error: bspReadEntities() => %s", R2S(result));
 
 exit:
+	if (lightmap_marked && result != BSPLoadResult_Success)
+		bspLightmapAtlasRollback(&lightmap_mark);
+
 	if (pakfile)
 		pakfile->close(pakfile);
 
@@ -1046,6 +3157,18 @@ exit:
 void bspInit() {
 	bsp_global.coarse_material = materialGet("opensource/coarse", NULL, NULL);
 
+	bsp_global.lightmap_atlas.pages_count = 0;
+	bsp_global.lightmap_atlas.textures_count = 0;
+	bsp_global.lightmap_page_side = c_max_lightmap_page_side;
+	while (bsp_global.lightmap_page_side > (unsigned)renderGetMaxTextureSize())
+		bsp_global.lightmap_page_side >>= 1;
+	PRINTF("Lightmap atlas page size: %u", bsp_global.lightmap_page_side);
+
+	bsp_global.lightmap_format = renderSupportsTextureFormat(c_lightmap_compressed_format)
+		? c_lightmap_compressed_format : RTexFormat_RGB565;
+	if (bsp_global.lightmap_format == RTexFormat_RGB565)
+		PRINT("Compressed lightmaps are not supported, falling back to RGB565");
+
 	const int scaling_factor = 4096;
 	for (int i = 0; i < 256; ++i) {
 		const int exp = i - 128;
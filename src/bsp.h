@@ -6,18 +6,90 @@
 
 struct AABB { struct AVec3f min, max; };
 
+#ifdef ATTO_PLATFORM_RPI
+/* GLES2 has no half float attributes, tex_uv is fixed point in 1/BSP_TEX_UV_FIXED_SCALE repeats */
+#define BSP_TEX_UV_FIXED_SCALE 1024
+#endif
+
+#ifdef ATTO_PLATFORM_RPI
+/* GLES2 only has 16 bit indices, so models are split into segments
+ * of up to 65536 vertices, each draw refers to one via vbo_offset */
+typedef uint16_t BSPIndex;
+#else
+/* whole model is one contiguous vertex range */
+typedef uint32_t BSPIndex;
+#endif
+
+/* 16 bytes GPU vertex */
 struct BSPModelVertex {
-	struct AVec3f vertex;
-	//struct AVec3f normal;
-	struct AVec2f lightmap_uv;
-	struct AVec2f tex_uv;
-	struct { uint8_t r, g, b; } average_color;
+	/* xyz: position within BSPModel::vertex_box in 1/65535ths of its size,
+	 * w: material average color, RGB565 */
+	uint16_t vertex[4];
+	/* normalized lightmap atlas page coordinates */
+	uint16_t lightmap_uv[2];
+	/* texture repeats, re-centred for each face; half floats or fixed point */
+	uint16_t tex_uv[2];
 };
 
 struct BSPDraw {
 	const Material *material;
+	const RTexture *lightmap;
 	unsigned int start, count;
 	unsigned int vbo_offset;
+	/* detailed draws only: BSPModel::ranges that make up this draw, in index order */
+	unsigned int first_range, ranges_count;
+	/* detailed draws only: BSPModel::draw_clusters of this draw */
+	unsigned int first_cluster, clusters_count;
+};
+
+/* Up to a few dozen triangles of one node group range with their bounding sphere,
+ * culled on GPU. Laid out as the culling shader reads it */
+struct BSPDrawCluster {
+	struct AVec3f center;
+	float radius;
+	unsigned int start, count;
+	unsigned int group;
+	unsigned int padding;
+};
+
+/* Base texture parameters of a detailed draw, read by multi draw shaders */
+struct BSPDrawMaterial {
+	struct AVec2f scale, translate;
+	/* of the texture array */
+	struct AVec2f size;
+	float layer;
+	float padding;
+};
+
+/* Detailed draws with the same lightmap, shader and texture array, submitted
+ * with one indirect multi draw. Their clusters are next to each other */
+struct BSPDrawBatch {
+	/* of the first draw, all share the shader */
+	const Material *material;
+	const RTexture *lightmap;
+	/* -1 if draws have no base texture, they sample a white layer then */
+	int texture_array;
+	/* some base textures could not be put to texture arrays, draws are submitted one by one */
+	int per_draw;
+	unsigned int first_draw, draws_count;
+	unsigned int first_cluster, clusters_count;
+};
+
+/* part of a detailed draw with faces of one group */
+struct BSPDrawRange {
+	unsigned int start, count;
+	unsigned int group;
+};
+
+/* BSP tree cut into subtrees of about a hundred faces at most. Faces of each such subtree
+ * are split into groups by visibility clusters they are in, groups of a subtree are next
+ * to each other. Nodes are in preorder, bounds are those of the faces within */
+struct BSPNode {
+	struct AABB aabb;
+	/* -1 if there is no child, node without children is groups of one subtree */
+	int children[2];
+	/* groups of the whole subtree */
+	unsigned int first_group, groups_count;
 };
 
 #define BSP_LANDMARK_NAME_LENGTH 64
@@ -31,27 +103,78 @@ typedef struct BSPLandmark {
 struct BSPDrawSet {
 	int draws_count;
 	struct BSPDraw *draws;
+	/* how far in world units surface may be from the detailed one */
+	float error;
 };
 
-typedef enum {
-	BSPSkyboxDir_RT,
-	BSPSkyboxDir_LF,
-	BSPSkyboxDir_FT,
-	BSPSkyboxDir_BK,
-	BSPSkyboxDir_UP,
-	BSPSkyboxDir_DN,
-	BSPSkyboxDir_COUNT
-} BSPSkyboxDir;
+/* coarse[0] is drawn instead of the detailed set once its error projects to about a pixel,
+ * each next level is a simplified version of the previous one with the same draws and vertex ranges.
+ * Displacements are resampled on a grid half as dense at each level instead */
+#define BSP_COARSE_LODS 3
+
+/* BSP tree as it is in the file, for finding the leaf a point is in.
+ * Negative children are leaves -1 - child */
+struct BSPSplitNode {
+	struct AVec3f normal;
+	float dist;
+	int children[2];
+};
 
 struct BSPModel {
 	struct AABB aabb;
-	RTexture lightmap;
+	/* box vertex positions are quantized to */
+	struct AABB vertex_box;
 	RBuffer vbo, ibo;
+	/* one per vbo segment draws use, none if vertex array objects are not supported */
+	RVertexArray *vertex_arrays;
+	int vertex_arrays_count;
 
-	const Material *skybox[BSPSkyboxDir_COUNT];
+	/* cube map shared by all maps with the same sky name, can be NULL */
+	const struct Texture *skybox;
 
 	struct BSPDrawSet detailed;
-	struct BSPDrawSet coarse;
+	struct BSPDrawSet coarse[BSP_COARSE_LODS];
+
+	struct BSPNode *nodes;
+	int nodes_count;
+	int groups_count;
+	struct BSPDrawRange *ranges;
+	/* per group, written by renderer every frame */
+	unsigned char *groups_visible;
+
+	struct BSPDrawCluster *draw_clusters;
+	int draw_clusters_count;
+	/* only if renderSupportsGpuCulling(): draw_clusters and an indirect draw command
+	 * for each of them, gl_name is 0 otherwise */
+	RBuffer clusters_buffer, commands_buffer;
+	/* only if renderSupportsGpuCulling(): base instance of every command is the index
+	 * of its draw, both to BSPDrawMaterial in materials_buffer and to detailed draws */
+	struct BSPDrawBatch *draw_batches;
+	int draw_batches_count;
+	RBuffer materials_buffer;
+	/* detailed draws in index buffer order, for merging neighbouring ranges.
+	 * NULL if batches didn't reorder them */
+	unsigned int *detailed_order;
+
+	struct BSPSplitNode *split_nodes;
+	int split_head;
+	int *leaf_cluster; /* -1 for leaves out of any cluster */
+	/* 0 if map has no visibility data */
+	int clusters_count;
+	/* copy of the visibility lump, compressed PVS row of each cluster is at its offset */
+	uint8_t *visibility;
+	uint32_t visibility_size;
+	uint32_t *cluster_offsets;
+	/* clusters faces of each group are in, those of group g start at group_first_cluster[g]
+	 * and end at group_first_cluster[g + 1]. Groups in no cluster are never PVS culled */
+	unsigned int *group_first_cluster;
+	uint32_t *group_clusters;
+	/* PVS row of the camera cluster, written by renderer every frame */
+	unsigned char *pvs;
+
+	/* largest opaque faces, 9 floats of xyz per triangle, for software occlusion culling */
+	float *occluders;
+	int occluders_count;
 
 	struct BSPLandmark landmarks[BSP_MAX_LANDMARKS];
 	int landmarks_count;
@@ -84,6 +207,13 @@ typedef enum BSPLoadResult {
 	BSPLoadResult_ErrorCapabilities
 } BSPLoadResult;
 
+/* cluster of the leaf pos is in, -1 if unknown */
+int bspFindCluster(const struct BSPModel *model, struct AVec3f pos);
+
+/* bitset of clusters potentially visible from cluster, decompressed to model->pvs.
+ * NULL if cluster is unknown */
+const unsigned char *bspClusterPVS(const struct BSPModel *model, int cluster);
+
 /* should be called AFTER renderInit() */
 void bspInit();
 
@@ -0,0 +1,180 @@
+#include "bvh.h"
+#include "bsp.h"
+#include "camera.h"
+#include "mempools.h"
+
+/* larger leaves aren't worth splitting, testing a box is as cheap as testing a node */
+#define BVH_LEAF_ITEMS 2
+
+int bvhInit(struct BVH *bvh, struct Stack *persistent, int capacity) {
+	bvh->nodes = stackAlloc(persistent, sizeof(struct BVHNode) * (capacity * 2));
+	bvh->items = stackAlloc(persistent, sizeof(int) * capacity);
+	bvh->centers = stackAlloc(persistent, sizeof(struct AVec3f) * capacity);
+	bvh->nodes_count = bvh->items_count = 0;
+	bvh->capacity = capacity;
+	return bvh->nodes && bvh->items && bvh->centers;
+}
+
+static float bvhAxis(struct AVec3f v, int axis) {
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+/* Partitions items so that the one at mid is where it would be if sorted by center on axis */
+static void bvhSelect(struct BVH *bvh, int first, int last, int mid, int axis) {
+	int *const items = bvh->items;
+	while (last > first) {
+		const float pivot = bvhAxis(bvh->centers[items[(first + last) / 2]], axis);
+		int i = first, j = last;
+		while (i <= j) {
+			while (bvhAxis(bvh->centers[items[i]], axis) < pivot) ++i;
+			while (bvhAxis(bvh->centers[items[j]], axis) > pivot) --j;
+			if (i <= j) {
+				const int tmp = items[i];
+				items[i++] = items[j];
+				items[j--] = tmp;
+			}
+		}
+
+		if (mid <= j)
+			last = j;
+		else if (mid >= i)
+			first = i;
+		else
+			break;
+	}
+}
+
+static int bvhBuildNode(struct BVH *bvh, const struct AABB *boxes, int first, int count) {
+	const int index = bvh->nodes_count++;
+	struct BVHNode *const node = bvh->nodes + index;
+	node->first = first;
+	node->count = count;
+	node->children[0] = node->children[1] = -1;
+
+	struct AVec3f cmin = bvh->centers[bvh->items[first]], cmax = cmin;
+	node->min = boxes[bvh->items[first]].min;
+	node->max = boxes[bvh->items[first]].max;
+	for (int i = first + 1; i < first + count; ++i) {
+		const struct AABB *const box = boxes + bvh->items[i];
+		const struct AVec3f c = bvh->centers[bvh->items[i]];
+		if (box->min.x < node->min.x) node->min.x = box->min.x;
+		if (box->min.y < node->min.y) node->min.y = box->min.y;
+		if (box->min.z < node->min.z) node->min.z = box->min.z;
+		if (box->max.x > node->max.x) node->max.x = box->max.x;
+		if (box->max.y > node->max.y) node->max.y = box->max.y;
+		if (box->max.z > node->max.z) node->max.z = box->max.z;
+		if (c.x < cmin.x) cmin.x = c.x;
+		if (c.y < cmin.y) cmin.y = c.y;
+		if (c.z < cmin.z) cmin.z = c.z;
+		if (c.x > cmax.x) cmax.x = c.x;
+		if (c.y > cmax.y) cmax.y = c.y;
+		if (c.z > cmax.z) cmax.z = c.z;
+	}
+
+	if (count <= BVH_LEAF_ITEMS)
+		return index;
+
+	/* median split along the longest extent of box centers */
+	const struct AVec3f extent = aVec3fSub(cmax, cmin);
+	const int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+	const int half = count / 2;
+	bvhSelect(bvh, first, first + count - 1, first + half, axis);
+
+	const int left = bvhBuildNode(bvh, boxes, first, half);
+	const int right = bvhBuildNode(bvh, boxes, first + half, count - half);
+	bvh->nodes[index].children[0] = left;
+	bvh->nodes[index].children[1] = right;
+	return index;
+}
+
+void bvhBuild(struct BVH *bvh, const struct AABB *boxes, int count) {
+	ASSERT(count <= bvh->capacity);
+	bvh->items_count = count;
+	bvh->nodes_count = 0;
+	if (!count)
+		return;
+
+	for (int i = 0; i < count; ++i) {
+		bvh->items[i] = i;
+		bvh->centers[i] = aVec3fMulf(aVec3fAdd(boxes[i].min, boxes[i].max), .5f);
+	}
+
+	bvhBuildNode(bvh, boxes, 0, count);
+}
+
+static int bvhCullNode(const struct BVH *bvh, const struct AABB *boxes, int index,
+		const struct CameraFrustum *frustum, unsigned int plane_mask, int *out) {
+	const struct BVHNode *const node = bvh->nodes + index;
+	const enum CameraCull cull = cameraCullAABB(frustum, node->min, node->max, &plane_mask);
+	if (cull == CameraCull_Outside)
+		return 0;
+
+	if (cull == CameraCull_Intersects && node->children[0] >= 0) {
+		const int written = bvhCullNode(bvh, boxes, node->children[0], frustum, plane_mask, out);
+		return written + bvhCullNode(bvh, boxes, node->children[1], frustum, plane_mask, out + written);
+	}
+
+	/* items of a node that is only partly inside are tested against the planes it crosses */
+	int written = 0;
+	for (int i = 0; i < node->count; ++i) {
+		const int item = bvh->items[node->first + i];
+		unsigned int item_mask = plane_mask;
+		if (cull == CameraCull_Inside
+				|| cameraCullAABB(frustum, boxes[item].min, boxes[item].max, &item_mask) != CameraCull_Outside)
+			out[written++] = item;
+	}
+	return written;
+}
+
+int bvhCullFrustum(const struct BVH *bvh, const struct AABB *boxes, const struct CameraFrustum *frustum, int *out) {
+	if (!bvh->nodes_count)
+		return 0;
+	return bvhCullNode(bvh, boxes, 0, frustum, (1u << 6) - 1, out);
+}
+
+float bvhBoxDistance(struct AVec3f min, struct AVec3f max, struct AVec3f p) {
+	float d = min.x - p.x;
+	if (p.x - max.x > d) d = p.x - max.x;
+	if (min.y - p.y > d) d = min.y - p.y;
+	if (p.y - max.y > d) d = p.y - max.y;
+	if (min.z - p.z > d) d = min.z - p.z;
+	if (p.z - max.z > d) d = p.z - max.z;
+	return d;
+}
+
+/* node distance never exceeds distance to anything inside, so subtrees further than the best so far are skipped */
+static void bvhClosestNode(const struct BVH *bvh, const struct AABB *boxes, int index, struct AVec3f point,
+		int *best, float *best_distance) {
+	const struct BVHNode *const node = bvh->nodes + index;
+	if (node->children[0] < 0) {
+		for (int i = 0; i < node->count; ++i) {
+			const int item = bvh->items[node->first + i];
+			const float d = bvhBoxDistance(boxes[item].min, boxes[item].max, point);
+			if (*best < 0 || d < *best_distance) {
+				*best = item;
+				*best_distance = d;
+			}
+		}
+		return;
+	}
+
+	const struct BVHNode *const a = bvh->nodes + node->children[0], *const b = bvh->nodes + node->children[1];
+	const float da = bvhBoxDistance(a->min, a->max, point), db = bvhBoxDistance(b->min, b->max, point);
+	const int first = da <= db ? 0 : 1;
+	const float first_distance = first ? db : da, second_distance = first ? da : db;
+
+	if (*best < 0 || first_distance < *best_distance)
+		bvhClosestNode(bvh, boxes, node->children[first], point, best, best_distance);
+	if (*best < 0 || second_distance < *best_distance)
+		bvhClosestNode(bvh, boxes, node->children[1 - first], point, best, best_distance);
+}
+
+int bvhClosest(const struct BVH *bvh, const struct AABB *boxes, struct AVec3f point, float *out_distance) {
+	int best = -1;
+	float best_distance = 0.f;
+	if (bvh->nodes_count)
+		bvhClosestNode(bvh, boxes, 0, point, &best, &best_distance);
+	if (out_distance)
+		*out_distance = best_distance;
+	return best;
+}
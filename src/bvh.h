@@ -0,0 +1,42 @@
+#pragma once
+#include "atto/math.h"
+
+struct AABB;
+struct CameraFrustum;
+struct Stack;
+
+/* Items of every subtree are contiguous in BVH::items */
+struct BVHNode {
+	struct AVec3f min, max;
+	/* -1 for leaves */
+	int children[2];
+	int first, count;
+};
+
+/* Bounding volume hierarchy over a set of boxes that are referred to by index.
+ * Cheap enough to be rebuilt from scratch whenever any box changes */
+struct BVH {
+	struct BVHNode *nodes;
+	int nodes_count;
+	int *items;
+	int items_count;
+	int capacity;
+	struct AVec3f *centers;
+};
+
+/* Returns 0 if out of memory */
+int bvhInit(struct BVH *bvh, struct Stack *persistent, int capacity);
+
+/* boxes[0 .. count) */
+void bvhBuild(struct BVH *bvh, const struct AABB *boxes, int count);
+
+/* Writes indices of boxes that intersect frustum to out, returns their number.
+ * boxes are the ones the BVH was built from */
+int bvhCullFrustum(const struct BVH *bvh, const struct AABB *boxes, const struct CameraFrustum *frustum, int *out);
+
+/* largest of per axis distances from point p to box, negative inside */
+float bvhBoxDistance(struct AVec3f min, struct AVec3f max, struct AVec3f p);
+
+/* Box closest to point, distance being the largest of per axis distances, negative inside.
+ * Returns -1 if there are no boxes */
+int bvhClosest(const struct BVH *bvh, const struct AABB *boxes, struct AVec3f point, float *out_distance);
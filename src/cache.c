@@ -31,7 +31,9 @@ const struct Material *cacheGetMaterial(const char *name) {
 }
 
 void cachePutMaterial(const char *name, const struct Material *mat /* copied */) {
-	aHashInsert(&g.materials, name, mat);
+	struct Material copy = *mat;
+	copy.id = (int)g.materials.stat.items;
+	aHashInsert(&g.materials, name, &copy);
 }
 
 const struct Texture *cacheGetTexture(const char *name) {
@@ -39,5 +41,7 @@ const struct Texture *cacheGetTexture(const char *name) {
 }
 
 void cachePutTexture(const char *name, const struct Texture *tex /* copied */) {
-	aHashInsert(&g.textures, name, tex);
+	struct Texture copy = *tex;
+	copy.id = (int)g.textures.stat.items;
+	aHashInsert(&g.textures, name, &copy);
 }
@@ -7,6 +7,8 @@ void cacheInit(struct Stack* pool);
 struct Material;
 struct Texture;
 
+/* stored copies get dense ids in insertion order, which unlike pointers
+ * is the same from run to run and can be used in sort keys */
 const struct Material *cacheGetMaterial(const char *name);
 void cachePutMaterial(const char *name, const struct Material *mat /* copied */);
 
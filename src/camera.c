@@ -43,3 +43,50 @@ void cameraRotatePitch(struct Camera *cam, float pitch) {
 	const struct AMat3f rot = aMat3fRotateAxis(cam->axes.X, pitch);
 	cam->dir = aVec3fMulMat(rot, cam->dir);
 }
+
+void cameraFrustum(const struct Camera *cam, struct AVec3f translation, struct CameraFrustum *out) {
+	const struct AMat4f *m = &cam->view_projection;
+	const struct AVec4f
+		x = aVec4f(m->X.x, m->Y.x, m->Z.x, m->W.x),
+		y = aVec4f(m->X.y, m->Y.y, m->Z.y, m->W.y),
+		z = aVec4f(m->X.z, m->Y.z, m->Z.z, m->W.z),
+		w = aVec4f(m->X.w, m->Y.w, m->Z.w, m->W.w);
+
+	/* -w <= x, y, z <= w */
+	out->planes[0] = aVec4f(w.x + x.x, w.y + x.y, w.z + x.z, w.w + x.w);
+	out->planes[1] = aVec4f(w.x - x.x, w.y - x.y, w.z - x.z, w.w - x.w);
+	out->planes[2] = aVec4f(w.x + y.x, w.y + y.y, w.z + y.z, w.w + y.w);
+	out->planes[3] = aVec4f(w.x - y.x, w.y - y.y, w.z - y.z, w.w - y.w);
+	out->planes[4] = aVec4f(w.x + z.x, w.y + z.y, w.z + z.z, w.w + z.w);
+	out->planes[5] = aVec4f(w.x - z.x, w.y - z.y, w.z - z.z, w.w - z.w);
+
+	for (int i = 0; i < 6; ++i) {
+		struct AVec4f *p = out->planes + i;
+		p->w += p->x * translation.x + p->y * translation.y + p->z * translation.z;
+	}
+}
+
+enum CameraCull cameraCullAABB(const struct CameraFrustum *frustum, struct AVec3f min, struct AVec3f max,
+		unsigned int *plane_mask) {
+	for (int i = 0; i < 6; ++i) {
+		if (!(*plane_mask & (1u << i)))
+			continue;
+
+		const struct AVec4f p = frustum->planes[i];
+
+		/* box corner furthest along plane normal */
+		const float furthest = p.x * (p.x > 0.f ? max.x : min.x)
+			+ p.y * (p.y > 0.f ? max.y : min.y)
+			+ p.z * (p.z > 0.f ? max.z : min.z) + p.w;
+		if (furthest < 0.f)
+			return CameraCull_Outside;
+
+		const float nearest = p.x * (p.x > 0.f ? min.x : max.x)
+			+ p.y * (p.y > 0.f ? min.y : max.y)
+			+ p.z * (p.z > 0.f ? min.z : max.z) + p.w;
+		if (nearest >= 0.f)
+			*plane_mask &= ~(1u << i);
+	}
+
+	return *plane_mask ? CameraCull_Intersects : CameraCull_Inside;
+}
@@ -9,7 +9,24 @@ struct Camera {
 	float z_near, z_far;
 };
 
+/* clip space planes in world space, point p is inside when dot(plane, (p, 1)) >= 0 for all of them */
+struct CameraFrustum {
+	struct AVec4f planes[6];
+};
+
+enum CameraCull {
+	CameraCull_Outside,
+	CameraCull_Intersects,
+	CameraCull_Inside
+};
+
 void cameraRecompute(struct Camera *cam);
+/* boxes tested against out are then in space that is translated by translation */
+void cameraFrustum(const struct Camera *cam, struct AVec3f translation, struct CameraFrustum *out);
+/* plane_mask has a bit for every plane the box still has to be tested against,
+ * planes the box is completely inside of are cleared, so children of the box can skip them */
+enum CameraCull cameraCullAABB(const struct CameraFrustum *frustum, struct AVec3f min, struct AVec3f max,
+		unsigned int *plane_mask);
 void cameraProjection(struct Camera *cam, float znear, float zfar, float horizfov, float aspect);
 void cameraLookAt(struct Camera *cam, struct AVec3f pos, struct AVec3f at, struct AVec3f up);
 void cameraMove(struct Camera *cam, struct AVec3f v);
@@ -59,3 +59,82 @@ void dxt5Unpack(struct DXTUnpackContext ctx) {
 	ctx.packed = ((char*)ctx.packed) + 8;
 	dxtUnpack(ctx, 16);
 }
+
+static void dxtColorUnpack(uint16_t c, int *rgb) {
+	rgb[0] = ((c >> 11) & 0x1f) * 255 / 31;
+	rgb[1] = ((c >> 5) & 0x3f) * 255 / 63;
+	rgb[2] = (c & 0x1f) * 255 / 31;
+}
+
+static uint16_t dxtColorPack(const int *rgb) {
+	return (uint16_t)((((rgb[0] * 31 + 127) / 255) << 11) | (((rgb[1] * 63 + 127) / 255) << 5) | ((rgb[2] * 31 + 127) / 255));
+}
+
+void dxt1PackBlock(const uint16_t *in4x4, uint8_t *out) {
+	int pixels[16][3];
+	int min[3] = { 255, 255, 255 }, max[3] = { 0, 0, 0 }, mean[3] = { 0, 0, 0 };
+	for (int i = 0; i < 16; ++i) {
+		dxtColorUnpack(in4x4[i], pixels[i]);
+		for (int c = 0; c < 3; ++c) {
+			if (pixels[i][c] < min[c]) min[c] = pixels[i][c];
+			if (pixels[i][c] > max[c]) max[c] = pixels[i][c];
+			mean[c] += pixels[i][c];
+		}
+	}
+
+	/* endpoints are bounding box corners, pick the diagonal that follows
+	 * how green and blue vary together with red */
+	int cov_rg = 0, cov_rb = 0;
+	for (int i = 0; i < 16; ++i) {
+		const int dr = pixels[i][0] * 16 - mean[0];
+		cov_rg += dr * (pixels[i][1] * 16 - mean[1]) / 16;
+		cov_rb += dr * (pixels[i][2] * 16 - mean[2]) / 16;
+	}
+
+	int e0[3] = { max[0], max[1], max[2] }, e1[3] = { min[0], min[1], min[2] };
+	if (cov_rg < 0) { e0[1] = min[1]; e1[1] = max[1]; }
+	if (cov_rb < 0) { e0[2] = min[2]; e1[2] = max[2]; }
+
+	uint16_t c[4];
+	c[0] = dxtColorPack(e0);
+	c[1] = dxtColorPack(e1);
+	if (c[0] < c[1]) {
+		const uint16_t t = c[0];
+		c[0] = c[1];
+		c[1] = t;
+	}
+
+	memcpy(out, c, 2);
+	memcpy(out + 2, c + 1, 2);
+
+	if (c[0] == c[1]) {
+		/* solid block, all indices point to c0 */
+		memset(out + 4, 0, 4);
+		return;
+	}
+
+	c[2] = dxtColorSum(2, c[0], 1, c[1], 1, 3);
+	c[3] = dxtColorSum(1, c[0], 2, c[1], 1, 3);
+
+	int palette[4][3];
+	for (int i = 0; i < 4; ++i)
+		dxtColorUnpack(c[i], palette[i]);
+
+	for (int r = 0; r < 4; ++r) {
+		uint8_t bitmap = 0;
+		for (int x = 0; x < 4; ++x) {
+			const int *p = pixels[r * 4 + x];
+			int best = 0, best_error = 0x7fffffff;
+			for (int i = 0; i < 4; ++i) {
+				const int dr = p[0] - palette[i][0], dg = p[1] - palette[i][1], db = p[2] - palette[i][2];
+				const int error = dr * dr + dg * dg + db * db;
+				if (error < best_error) {
+					best_error = error;
+					best = i;
+				}
+			}
+			bitmap |= best << (x * 2);
+		}
+		out[4 + r] = bitmap;
+	}
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 struct DXTUnpackContext {
 	int width, height;
 	const void *packed;
@@ -8,3 +10,6 @@ struct DXTUnpackContext {
 
 void dxt1Unpack(struct DXTUnpackContext ctx);
 void dxt5Unpack(struct DXTUnpackContext ctx);
+
+/* in4x4 is row-major RGB565, out is one 8 byte DXT1 block */
+void dxt1PackBlock(const uint16_t *in4x4, uint8_t *out);
@@ -23,6 +23,8 @@ typedef struct {
 } MTexture;
 
 typedef struct Material {
+	/* dense, assigned by cache in interning order */
+	int id;
 	MShader shader;
 	struct AVec3f average_color;
 	MTexture base_texture;
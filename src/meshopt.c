@@ -0,0 +1,674 @@
+#include "meshopt.h"
+#include "mempools.h"
+#include <math.h>
+#include <stdlib.h> /* qsort */
+#include <string.h> /* memset, memcmp */
+
+float meshoptACMR(struct Stack *tmp, const unsigned int *indices, unsigned int indices_count,
+		unsigned int vertices_count, unsigned int cache_size) {
+	const unsigned int triangles_count = indices_count / 3;
+	if (!triangles_count)
+		return 0;
+
+	unsigned int *const timestamp = stackAlloc(tmp, sizeof(unsigned int) * vertices_count);
+	if (!timestamp)
+		return -1.f;
+
+	for (unsigned int i = 0; i < vertices_count; ++i)
+		timestamp[i] = 0;
+
+	/* vertex is still in FIFO cache if fewer than cache_size misses happened since it was inserted */
+	unsigned int time = cache_size + 1, misses = 0;
+	for (unsigned int i = 0; i < triangles_count * 3; ++i) {
+		const unsigned int v = indices[i];
+		if (time - timestamp[v] > cache_size) {
+			timestamp[v] = time++;
+			++misses;
+		}
+	}
+
+	stackFreeUpToPosition(tmp, timestamp);
+	return (float)misses / triangles_count;
+}
+
+#define MESHOPT_VALENCE_TABLE_SIZE 32
+
+struct MeshoptScoreTables {
+	float cache[MESHOPT_CACHE_SIZE];
+	float valence[MESHOPT_VALENCE_TABLE_SIZE];
+};
+
+static void meshoptInitScoreTables(struct MeshoptScoreTables *tables) {
+	/* all three vertices of the last triangle score the same, so that
+	 * the next triangle doesn't have to continue a strip in a particular direction */
+	for (int i = 0; i < MESHOPT_CACHE_SIZE; ++i)
+		tables->cache[i] = i < 3 ? .75f : powf(1.f - (float)(i - 3) / (MESHOPT_CACHE_SIZE - 3), 1.5f);
+
+	/* vertices with few triangles left are boosted to get rid of lone triangles early */
+	tables->valence[0] = 0;
+	for (int i = 1; i < MESHOPT_VALENCE_TABLE_SIZE; ++i)
+		tables->valence[i] = 2.f / sqrtf((float)i);
+}
+
+static float meshoptVertexScore(const struct MeshoptScoreTables *tables, int cache_position,
+		unsigned int live_triangles) {
+	if (!live_triangles)
+		return -1.f;
+
+	const float valence = live_triangles < MESHOPT_VALENCE_TABLE_SIZE
+		? tables->valence[live_triangles] : 2.f / sqrtf((float)live_triangles);
+
+	return (cache_position >= 0 ? tables->cache[cache_position] : 0.f) + valence;
+}
+
+int meshoptOptimizeVertexCache(struct Stack *tmp, unsigned int *indices, unsigned int indices_count,
+		unsigned int vertices_count) {
+	const unsigned int triangles_count = indices_count / 3;
+	if (triangles_count < 2)
+		return 1;
+
+	void *const tmp_cursor = stackGetCursor(tmp);
+	unsigned int *const live = stackAlloc(tmp, sizeof(unsigned int) * vertices_count);
+	unsigned int *const adjacency_offset = stackAlloc(tmp, sizeof(unsigned int) * vertices_count);
+	unsigned int *const adjacency = stackAlloc(tmp, sizeof(unsigned int) * triangles_count * 3);
+	int *const cache_position = stackAlloc(tmp, sizeof(int) * vertices_count);
+	float *const vertex_score = stackAlloc(tmp, sizeof(float) * vertices_count);
+	float *const triangle_score = stackAlloc(tmp, sizeof(float) * triangles_count);
+	unsigned int *const output = stackAlloc(tmp, sizeof(unsigned int) * triangles_count * 3);
+	unsigned char *const emitted = stackAlloc(tmp, triangles_count);
+	if (!live || !adjacency_offset || !adjacency || !cache_position
+			|| !vertex_score || !triangle_score || !output || !emitted) {
+		stackFreeUpToPosition(tmp, tmp_cursor);
+		return 0;
+	}
+
+	/* vertex -> triangles adjacency, live[] ends up being valence */
+	for (unsigned int i = 0; i < vertices_count; ++i)
+		live[i] = 0;
+	for (unsigned int i = 0; i < triangles_count * 3; ++i)
+		++live[indices[i]];
+
+	unsigned int offset = 0;
+	for (unsigned int i = 0; i < vertices_count; ++i) {
+		adjacency_offset[i] = offset;
+		offset += live[i];
+		live[i] = 0;
+	}
+
+	for (unsigned int i = 0; i < triangles_count * 3; ++i) {
+		const unsigned int v = indices[i];
+		adjacency[adjacency_offset[v] + live[v]++] = i / 3;
+	}
+
+	struct MeshoptScoreTables tables;
+	meshoptInitScoreTables(&tables);
+
+	for (unsigned int i = 0; i < vertices_count; ++i) {
+		cache_position[i] = -1;
+		vertex_score[i] = meshoptVertexScore(&tables, -1, live[i]);
+	}
+
+	for (unsigned int i = 0; i < triangles_count; ++i) {
+		const unsigned int *tri = indices + i * 3;
+		triangle_score[i] = vertex_score[tri[0]] + vertex_score[tri[1]] + vertex_score[tri[2]];
+		emitted[i] = 0;
+	}
+
+	unsigned int cache[MESHOPT_CACHE_SIZE + 3], new_cache[MESHOPT_CACHE_SIZE + 3];
+	unsigned int cache_count = 0, scan_cursor = 0;
+	int best_triangle = -1;
+
+	for (unsigned int iout = 0; iout < triangles_count; ++iout) {
+		if (best_triangle < 0) {
+			/* nothing left around cached vertices, continue from the next triangle in input order */
+			while (emitted[scan_cursor])
+				++scan_cursor;
+			best_triangle = scan_cursor;
+		}
+
+		const unsigned int *const tri = indices + best_triangle * 3;
+		output[iout * 3 + 0] = tri[0];
+		output[iout * 3 + 1] = tri[1];
+		output[iout * 3 + 2] = tri[2];
+		emitted[best_triangle] = 1;
+
+		unsigned int new_count = 0;
+		for (int k = 0; k < 3; ++k) {
+			const unsigned int v = tri[k];
+			unsigned int *const list = adjacency + adjacency_offset[v];
+			for (unsigned int j = 0; j < live[v]; ++j)
+				if (list[j] == (unsigned int)best_triangle) {
+					list[j] = list[--live[v]];
+					break;
+				}
+
+			/* degenerate triangles have repeated vertices */
+			if ((new_count < 1 || new_cache[0] != v) && (new_count < 2 || new_cache[1] != v))
+				new_cache[new_count++] = v;
+		}
+
+		/* emitted triangle goes to the front of LRU cache */
+		for (unsigned int i = 0; i < cache_count; ++i) {
+			const unsigned int v = cache[i];
+			if (v != tri[0] && v != tri[1] && v != tri[2])
+				new_cache[new_count++] = v;
+		}
+
+		/* rescore everything that is in cache or has just been pushed out of it */
+		for (unsigned int i = 0; i < new_count; ++i) {
+			const unsigned int v = new_cache[i];
+			cache_position[v] = i < MESHOPT_CACHE_SIZE ? (int)i : -1;
+			const float score = meshoptVertexScore(&tables, cache_position[v], live[v]);
+			const float delta = score - vertex_score[v];
+			vertex_score[v] = score;
+
+			const unsigned int *const list = adjacency + adjacency_offset[v];
+			for (unsigned int j = 0; j < live[v]; ++j)
+				triangle_score[list[j]] += delta;
+		}
+
+		cache_count = new_count < MESHOPT_CACHE_SIZE ? new_count : MESHOPT_CACHE_SIZE;
+
+		/* only triangles touching cached vertices are considered, this is what keeps it linear */
+		best_triangle = -1;
+		float best_score = -1.f;
+		for (unsigned int i = 0; i < cache_count; ++i) {
+			const unsigned int v = new_cache[i];
+			cache[i] = v;
+
+			const unsigned int *const list = adjacency + adjacency_offset[v];
+			for (unsigned int j = 0; j < live[v]; ++j)
+				if (triangle_score[list[j]] > best_score) {
+					best_score = triangle_score[list[j]];
+					best_triangle = list[j];
+				}
+		}
+	}
+
+	for (unsigned int i = 0; i < triangles_count * 3; ++i)
+		indices[i] = output[i];
+
+	stackFreeUpToPosition(tmp, tmp_cursor);
+	return 1;
+}
+
+unsigned int meshoptOptimizeVertexFetch(unsigned int *indices, unsigned int indices_count,
+		unsigned int *remap, unsigned int vertices_count) {
+	const unsigned int unused = ~0u;
+	for (unsigned int i = 0; i < vertices_count; ++i)
+		remap[i] = unused;
+
+	unsigned int next = 0;
+	for (unsigned int i = 0; i < indices_count; ++i) {
+		const unsigned int v = indices[i];
+		if (remap[v] == unused)
+			remap[v] = next++;
+		indices[i] = remap[v];
+	}
+
+	const unsigned int referenced = next;
+	for (unsigned int i = 0; i < vertices_count; ++i)
+		if (remap[i] == unused)
+			remap[i] = next++;
+
+	return referenced;
+}
+
+enum MeshoptVertexKind {
+	MeshoptVertex_Manifold,
+	MeshoptVertex_Border,
+	MeshoptVertex_Seam,
+	MeshoptVertex_Locked
+};
+
+#define MESHOPT_NONE (~0u)
+#define MESHOPT_MANY (~0u - 1)
+
+/* how much more than surface planes border and seam edge planes weigh, keeps them straight */
+#define MESHOPT_BORDER_WEIGHT 10.f
+
+struct MeshoptQuadric {
+	float a2, b2, c2, ab, ac, bc, ad, bd, cd, d2, w;
+};
+
+struct MeshoptCollapse {
+	unsigned int from, to;
+	float error;
+};
+
+struct MeshoptSimplifier {
+	unsigned int *indices;
+	unsigned int indices_count;
+	unsigned int vertices_count;
+	/* normalized to unit box */
+	float *positions;
+	/* first vertex with the same position, and a ring of all such wedges */
+	unsigned int *canon;
+	unsigned int *wedge;
+	struct MeshoptQuadric *quadrics; /* per canon */
+
+	/* rebuilt every pass: vertex -> triangles, classification */
+	unsigned int *adjacency_offset;
+	unsigned int *adjacency_count;
+	unsigned int *adjacency;
+	unsigned char *kind;
+	unsigned int *open_out, *open_in;
+};
+
+static void meshoptQuadricAddPlane(struct MeshoptQuadric *q, float a, float b, float c, float d, float w) {
+	q->a2 += w * a * a; q->b2 += w * b * b; q->c2 += w * c * c;
+	q->ab += w * a * b; q->ac += w * a * c; q->bc += w * b * c;
+	q->ad += w * a * d; q->bd += w * b * d; q->cd += w * c * d;
+	q->d2 += w * d * d;
+	q->w += w;
+}
+
+static void meshoptQuadricAdd(struct MeshoptQuadric *q, const struct MeshoptQuadric *r) {
+	q->a2 += r->a2; q->b2 += r->b2; q->c2 += r->c2;
+	q->ab += r->ab; q->ac += r->ac; q->bc += r->bc;
+	q->ad += r->ad; q->bd += r->bd; q->cd += r->cd;
+	q->d2 += r->d2;
+	q->w += r->w;
+}
+
+/* weighted mean squared distance to accumulated planes */
+static float meshoptQuadricError(const struct MeshoptQuadric *q, const float *p) {
+	const float x = p[0], y = p[1], z = p[2];
+	const float e = q->a2 * x * x + q->b2 * y * y + q->c2 * z * z
+		+ 2.f * (q->ab * x * y + q->ac * x * z + q->bc * y * z)
+		+ 2.f * (q->ad * x + q->bd * y + q->cd * z) + q->d2;
+	return fabsf(e) / (q->w > 0.f ? q->w : 1.f);
+}
+
+static void meshoptCross(const float *a, const float *b, const float *c, float *n) {
+	const float u[3] = { b[0] - a[0], b[1] - a[1], b[2] - a[2] };
+	const float v[3] = { c[0] - a[0], c[1] - a[1], c[2] - a[2] };
+	n[0] = u[1] * v[2] - u[2] * v[1];
+	n[1] = u[2] * v[0] - u[0] * v[2];
+	n[2] = u[0] * v[1] - u[1] * v[0];
+}
+
+static int meshoptCorner(const unsigned int *tri, unsigned int v) {
+	return tri[0] == v ? 0 : (tri[1] == v ? 1 : 2);
+}
+
+/* is there a half-edge a->b */
+static int meshoptHasEdge(const struct MeshoptSimplifier *s, unsigned int a, unsigned int b) {
+	const unsigned int *list = s->adjacency + s->adjacency_offset[a];
+	for (unsigned int i = 0; i < s->adjacency_count[a]; ++i) {
+		const unsigned int *tri = s->indices + list[i] * 3;
+		if (tri[(meshoptCorner(tri, a) + 1) % 3] == b)
+			return 1;
+	}
+	return 0;
+}
+
+/* is there a half-edge from any wedge of a to any wedge of b */
+static int meshoptHasPositionalEdge(const struct MeshoptSimplifier *s, unsigned int a, unsigned int b) {
+	unsigned int w = a;
+	do {
+		const unsigned int *list = s->adjacency + s->adjacency_offset[w];
+		for (unsigned int i = 0; i < s->adjacency_count[w]; ++i) {
+			const unsigned int *tri = s->indices + list[i] * 3;
+			if (s->canon[tri[(meshoptCorner(tri, w) + 1) % 3]] == s->canon[b])
+				return 1;
+		}
+		w = s->wedge[w];
+	} while (w != a);
+	return 0;
+}
+
+static int meshoptBuildAdjacency(struct MeshoptSimplifier *s, struct Stack *tmp) {
+	const unsigned int vertices_count = s->vertices_count;
+	s->adjacency_offset = stackAlloc(tmp, sizeof(unsigned int) * vertices_count);
+	s->adjacency_count = stackAlloc(tmp, sizeof(unsigned int) * vertices_count);
+	s->adjacency = stackAlloc(tmp, sizeof(unsigned int) * s->indices_count);
+	s->kind = stackAlloc(tmp, vertices_count);
+	s->open_out = stackAlloc(tmp, sizeof(unsigned int) * vertices_count);
+	s->open_in = stackAlloc(tmp, sizeof(unsigned int) * vertices_count);
+	if (!s->adjacency_offset || !s->adjacency_count || !s->adjacency || !s->kind || !s->open_out || !s->open_in)
+		return 0;
+
+	for (unsigned int i = 0; i < vertices_count; ++i)
+		s->adjacency_count[i] = 0;
+	for (unsigned int i = 0; i < s->indices_count; ++i)
+		++s->adjacency_count[s->indices[i]];
+
+	unsigned int offset = 0;
+	for (unsigned int i = 0; i < vertices_count; ++i) {
+		s->adjacency_offset[i] = offset;
+		offset += s->adjacency_count[i];
+		s->adjacency_count[i] = 0;
+	}
+
+	for (unsigned int i = 0; i < s->indices_count; ++i) {
+		const unsigned int v = s->indices[i];
+		s->adjacency[s->adjacency_offset[v] + s->adjacency_count[v]++] = i / 3;
+	}
+
+	return 1;
+}
+
+static void meshoptClassifyVertices(struct MeshoptSimplifier *s) {
+	for (unsigned int v = 0; v < s->vertices_count; ++v) {
+		s->open_out[v] = s->open_in[v] = MESHOPT_NONE;
+
+		const unsigned int *list = s->adjacency + s->adjacency_offset[v];
+		for (unsigned int i = 0; i < s->adjacency_count[v]; ++i) {
+			const unsigned int *tri = s->indices + list[i] * 3;
+			const int k = meshoptCorner(tri, v);
+			const unsigned int next = tri[(k + 1) % 3], prev = tri[(k + 2) % 3];
+			if (!meshoptHasEdge(s, next, v))
+				s->open_out[v] = s->open_out[v] == MESHOPT_NONE ? next : MESHOPT_MANY;
+			if (!meshoptHasEdge(s, v, prev))
+				s->open_in[v] = s->open_in[v] == MESHOPT_NONE ? prev : MESHOPT_MANY;
+		}
+	}
+
+	for (unsigned int v = 0; v < s->vertices_count; ++v) {
+		s->kind[v] = MeshoptVertex_Locked;
+		if (!s->adjacency_count[v])
+			continue;
+
+		unsigned int wedges = 0, other = v;
+		for (unsigned int w = s->wedge[v]; w != v && wedges < 2; w = s->wedge[w])
+			if (s->adjacency_count[w]) {
+				other = w;
+				++wedges;
+			}
+
+		const unsigned int out = s->open_out[v], in = s->open_in[v];
+		const int single = out < MESHOPT_MANY && in < MESHOPT_MANY;
+		if (wedges == 0) {
+			if (out == MESHOPT_NONE && in == MESHOPT_NONE)
+				s->kind[v] = MeshoptVertex_Manifold;
+			else if (single && !meshoptHasPositionalEdge(s, out, v) && !meshoptHasPositionalEdge(s, v, in))
+				s->kind[v] = MeshoptVertex_Border;
+		} else if (wedges == 1) {
+			/* the other side of a seam runs in the opposite direction */
+			const unsigned int other_out = s->open_out[other], other_in = s->open_in[other];
+			if (single && other_out < MESHOPT_MANY && other_in < MESHOPT_MANY
+					&& s->canon[out] == s->canon[other_in] && s->canon[in] == s->canon[other_out])
+				s->kind[v] = MeshoptVertex_Seam;
+		}
+	}
+}
+
+static void meshoptInitQuadrics(struct MeshoptSimplifier *s) {
+	for (unsigned int i = 0; i < s->vertices_count; ++i)
+		memset(s->quadrics + i, 0, sizeof(*s->quadrics));
+
+	for (unsigned int t = 0; t < s->indices_count / 3; ++t) {
+		const unsigned int *tri = s->indices + t * 3;
+		const float *p[3] = { s->positions + tri[0] * 3, s->positions + tri[1] * 3, s->positions + tri[2] * 3 };
+		float n[3];
+		meshoptCross(p[0], p[1], p[2], n);
+		const float length = sqrtf(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+		if (length <= 0.f)
+			continue;
+
+		n[0] /= length; n[1] /= length; n[2] /= length;
+		const float d = -(n[0] * p[0][0] + n[1] * p[0][1] + n[2] * p[0][2]);
+		for (int k = 0; k < 3; ++k)
+			meshoptQuadricAddPlane(s->quadrics + s->canon[tri[k]], n[0], n[1], n[2], d, length * .5f);
+
+		/* borders and seams get a plane through the edge, perpendicular to the triangle */
+		for (int k = 0; k < 3; ++k) {
+			const unsigned int a = tri[k], b = tri[(k + 1) % 3];
+			if (meshoptHasEdge(s, b, a))
+				continue;
+
+			const float *pa = p[k], *pb = p[(k + 1) % 3];
+			const float e[3] = { pb[0] - pa[0], pb[1] - pa[1], pb[2] - pa[2] };
+			float en[3] = { e[1] * n[2] - e[2] * n[1], e[2] * n[0] - e[0] * n[2], e[0] * n[1] - e[1] * n[0] };
+			const float en_length = sqrtf(en[0] * en[0] + en[1] * en[1] + en[2] * en[2]);
+			if (en_length <= 0.f)
+				continue;
+
+			en[0] /= en_length; en[1] /= en_length; en[2] /= en_length;
+			const float ed = -(en[0] * pa[0] + en[1] * pa[1] + en[2] * pa[2]);
+			const float w = (e[0] * e[0] + e[1] * e[1] + e[2] * e[2]) * MESHOPT_BORDER_WEIGHT;
+			meshoptQuadricAddPlane(s->quadrics + s->canon[a], en[0], en[1], en[2], ed, w);
+			meshoptQuadricAddPlane(s->quadrics + s->canon[b], en[0], en[1], en[2], ed, w);
+		}
+	}
+}
+
+static int meshoptCanCollapse(const struct MeshoptSimplifier *s, unsigned int from, unsigned int to) {
+	switch (s->kind[from]) {
+		case MeshoptVertex_Manifold:
+			return 1;
+		case MeshoptVertex_Border:
+			return (to == s->open_out[from] || to == s->open_in[from])
+				&& (s->kind[to] == MeshoptVertex_Border || s->kind[to] == MeshoptVertex_Locked);
+		case MeshoptVertex_Seam:
+			return (to == s->open_out[from] || to == s->open_in[from])
+				&& (s->kind[to] == MeshoptVertex_Seam || s->kind[to] == MeshoptVertex_Locked);
+		default:
+			return 0;
+	}
+}
+
+/* would moving from onto to turn any surviving triangle around */
+static int meshoptCollapseFlips(const struct MeshoptSimplifier *s, unsigned int from, unsigned int to) {
+	const float *pt = s->positions + to * 3;
+	const unsigned int *list = s->adjacency + s->adjacency_offset[from];
+	for (unsigned int i = 0; i < s->adjacency_count[from]; ++i) {
+		const unsigned int *tri = s->indices + list[i] * 3;
+		const int k = meshoptCorner(tri, from);
+		const unsigned int b = tri[(k + 1) % 3], c = tri[(k + 2) % 3];
+		if (s->canon[b] == s->canon[to] || s->canon[c] == s->canon[to])
+			continue; /* collapses away */
+
+		const float *pb = s->positions + b * 3, *pc = s->positions + c * 3;
+		float n0[3], n1[3];
+		meshoptCross(s->positions + from * 3, pb, pc, n0);
+		meshoptCross(pt, pb, pc, n1);
+		const float dot = n0[0] * n1[0] + n0[1] * n1[1] + n0[2] * n1[2];
+		const float len2 = (n0[0] * n0[0] + n0[1] * n0[1] + n0[2] * n0[2]) * (n1[0] * n1[0] + n1[1] * n1[1] + n1[2] * n1[2]);
+		if (dot <= 0.f || dot * dot < .0625f * len2)
+			return 1;
+	}
+	return 0;
+}
+
+static int meshoptCollapseCompare(const void *a, const void *b) {
+	const float ea = ((const struct MeshoptCollapse*)a)->error, eb = ((const struct MeshoptCollapse*)b)->error;
+	return ea < eb ? -1 : (ea > eb ? 1 : 0);
+}
+
+static void meshoptTouchAround(const struct MeshoptSimplifier *s, unsigned int v, unsigned char *touched) {
+	const unsigned int *list = s->adjacency + s->adjacency_offset[v];
+	for (unsigned int i = 0; i < s->adjacency_count[v]; ++i) {
+		const unsigned int *tri = s->indices + list[i] * 3;
+		touched[s->canon[tri[0]]] = touched[s->canon[tri[1]]] = touched[s->canon[tri[2]]] = 1;
+	}
+}
+
+/* one round of non-overlapping collapses, cheapest first. Returns number of collapses, -1 if out of memory */
+static int meshoptSimplifyPass(struct MeshoptSimplifier *s, struct Stack *tmp,
+		unsigned int target_indices_count, float max_error) {
+	if (!meshoptBuildAdjacency(s, tmp))
+		return -1;
+	meshoptClassifyVertices(s);
+
+	const unsigned int triangles_count = s->indices_count / 3;
+	struct MeshoptCollapse *const collapses = stackAlloc(tmp, sizeof(*collapses) * triangles_count * 6);
+	unsigned int *const remap = stackAlloc(tmp, sizeof(unsigned int) * s->vertices_count);
+	unsigned char *const touched = stackAlloc(tmp, s->vertices_count);
+	if (!collapses || !remap || !touched)
+		return -1;
+
+	unsigned int collapses_count = 0;
+	for (unsigned int t = 0; t < triangles_count; ++t) {
+		const unsigned int *tri = s->indices + t * 3;
+		for (int k = 0; k < 3; ++k) {
+			const unsigned int a = tri[k], b = tri[(k + 1) % 3];
+			for (int dir = 0; dir < 2; ++dir) {
+				const unsigned int from = dir ? b : a, to = dir ? a : b;
+				if (!meshoptCanCollapse(s, from, to))
+					continue;
+
+				struct MeshoptQuadric q = s->quadrics[s->canon[from]];
+				meshoptQuadricAdd(&q, s->quadrics + s->canon[to]);
+				collapses[collapses_count].from = from;
+				collapses[collapses_count].to = to;
+				collapses[collapses_count].error = meshoptQuadricError(&q, s->positions + to * 3);
+				++collapses_count;
+			}
+		}
+	}
+
+	qsort(collapses, collapses_count, sizeof(*collapses), meshoptCollapseCompare);
+
+	for (unsigned int i = 0; i < s->vertices_count; ++i) {
+		remap[i] = i;
+		touched[i] = 0;
+	}
+
+	const unsigned int goal = (s->indices_count - target_indices_count) / 3;
+	const float max_error2 = max_error * max_error;
+	unsigned int removed = 0;
+	int applied = 0;
+	for (unsigned int i = 0; i < collapses_count && removed < goal; ++i) {
+		const struct MeshoptCollapse *c = collapses + i;
+		if (c->error > max_error2)
+			break;
+
+		if (touched[s->canon[c->from]] || touched[s->canon[c->to]])
+			continue;
+
+		/* seams collapse on both sides, the other wedge runs along the same edge backwards */
+		unsigned int other_from = MESHOPT_NONE, other_to = MESHOPT_NONE;
+		if (s->kind[c->from] == MeshoptVertex_Seam) {
+			for (unsigned int w = s->wedge[c->from]; w != c->from; w = s->wedge[w])
+				if (s->adjacency_count[w])
+					other_from = w;
+			other_to = c->to == s->open_out[c->from] ? s->open_in[other_from] : s->open_out[other_from];
+			if (other_to >= MESHOPT_MANY || s->canon[other_to] != s->canon[c->to])
+				continue;
+		}
+
+		if (meshoptCollapseFlips(s, c->from, c->to)
+				|| (other_from != MESHOPT_NONE && meshoptCollapseFlips(s, other_from, other_to)))
+			continue;
+
+		remap[c->from] = c->to;
+		meshoptTouchAround(s, c->from, touched);
+		if (other_from != MESHOPT_NONE) {
+			remap[other_from] = other_to;
+			meshoptTouchAround(s, other_from, touched);
+		}
+
+		meshoptQuadricAdd(s->quadrics + s->canon[c->to], s->quadrics + s->canon[c->from]);
+		removed += s->kind[c->from] == MeshoptVertex_Border ? 1 : 2;
+		++applied;
+	}
+
+	unsigned int write = 0;
+	for (unsigned int t = 0; t < triangles_count; ++t) {
+		const unsigned int a = remap[s->indices[t * 3 + 0]], b = remap[s->indices[t * 3 + 1]], c = remap[s->indices[t * 3 + 2]];
+		if (s->canon[a] == s->canon[b] || s->canon[b] == s->canon[c] || s->canon[c] == s->canon[a])
+			continue;
+		s->indices[write++] = a;
+		s->indices[write++] = b;
+		s->indices[write++] = c;
+	}
+	s->indices_count = write;
+
+	return applied;
+}
+
+unsigned int meshoptSimplify(struct Stack *tmp, unsigned int *indices, unsigned int indices_count,
+		const float *positions, unsigned int vertices_count,
+		unsigned int target_indices_count, float target_error) {
+	if (indices_count <= target_indices_count || indices_count < 3)
+		return indices_count;
+
+	void *const tmp_cursor = stackGetCursor(tmp);
+	unsigned int *const original = stackAlloc(tmp, sizeof(unsigned int) * indices_count);
+
+	struct MeshoptSimplifier s;
+	s.indices = indices;
+	s.indices_count = indices_count;
+	s.vertices_count = vertices_count;
+	s.positions = stackAlloc(tmp, sizeof(float) * 3 * vertices_count);
+	s.canon = stackAlloc(tmp, sizeof(unsigned int) * vertices_count);
+	s.wedge = stackAlloc(tmp, sizeof(unsigned int) * vertices_count);
+	s.quadrics = stackAlloc(tmp, sizeof(struct MeshoptQuadric) * vertices_count);
+	unsigned int table_size = 1;
+	while (table_size < vertices_count * 2)
+		table_size *= 2;
+	unsigned int *const table = stackAlloc(tmp, sizeof(unsigned int) * table_size);
+	if (!original || !s.positions || !s.canon || !s.wedge || !s.quadrics || !table) {
+		stackFreeUpToPosition(tmp, tmp_cursor);
+		return indices_count;
+	}
+
+	for (unsigned int i = 0; i < indices_count; ++i)
+		original[i] = indices[i];
+
+	/* normalize to unit box, so that quadrics stay well within float precision */
+	float min[3] = { positions[0], positions[1], positions[2] }, extent = 0.f;
+	for (unsigned int i = 0; i < vertices_count; ++i)
+		for (int k = 0; k < 3; ++k)
+			if (positions[i * 3 + k] < min[k]) min[k] = positions[i * 3 + k];
+	for (unsigned int i = 0; i < vertices_count; ++i)
+		for (int k = 0; k < 3; ++k)
+			if (positions[i * 3 + k] - min[k] > extent) extent = positions[i * 3 + k] - min[k];
+	const float scale = extent > 0.f ? 1.f / extent : 1.f;
+	for (unsigned int i = 0; i < vertices_count; ++i)
+		for (int k = 0; k < 3; ++k)
+			s.positions[i * 3 + k] = (positions[i * 3 + k] - min[k]) * scale;
+
+	/* bitwise equal positions are wedges of the same point */
+	for (unsigned int i = 0; i < table_size; ++i)
+		table[i] = MESHOPT_NONE;
+	for (unsigned int v = 0; v < vertices_count; ++v) {
+		unsigned int hash = 2166136261u;
+		const unsigned char *bytes = (const unsigned char*)(positions + v * 3);
+		for (unsigned int i = 0; i < sizeof(float) * 3; ++i)
+			hash = (hash ^ bytes[i]) * 16777619u;
+
+		unsigned int slot = hash & (table_size - 1);
+		for (; table[slot] != MESHOPT_NONE; slot = (slot + 1) & (table_size - 1))
+			if (memcmp(positions + table[slot] * 3, positions + v * 3, sizeof(float) * 3) == 0)
+				break;
+
+		if (table[slot] == MESHOPT_NONE) {
+			table[slot] = v;
+			s.canon[v] = v;
+			s.wedge[v] = v;
+		} else {
+			const unsigned int c = table[slot];
+			s.canon[v] = c;
+			s.wedge[v] = s.wedge[c];
+			s.wedge[c] = v;
+		}
+	}
+	stackFreeUpToPosition(tmp, table);
+
+	void *const pass_cursor = stackGetCursor(tmp);
+	if (!meshoptBuildAdjacency(&s, tmp))
+		goto out_of_memory;
+	meshoptInitQuadrics(&s);
+	stackFreeUpToPosition(tmp, pass_cursor);
+
+	while (s.indices_count > target_indices_count) {
+		const int applied = meshoptSimplifyPass(&s, tmp, target_indices_count, target_error * scale);
+		stackFreeUpToPosition(tmp, pass_cursor);
+		if (applied < 0)
+			goto out_of_memory;
+		if (applied == 0)
+			break;
+	}
+
+	stackFreeUpToPosition(tmp, tmp_cursor);
+	return s.indices_count;
+
+out_of_memory:
+	for (unsigned int i = 0; i < indices_count; ++i)
+		indices[i] = original[i];
+	stackFreeUpToPosition(tmp, tmp_cursor);
+	return indices_count;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+struct Stack;
+
+/* vertex cache size the triangle order is tuned for */
+#define MESHOPT_CACHE_SIZE 32
+
+/* average cache miss ratio, i.e. vertex shader invocations per triangle,
+ * simulated with a FIFO cache of cache_size entries. 0.5 is ideal for
+ * large regular grids, 3 means no reuse at all.
+ * Returns negative value if out of temp memory */
+float meshoptACMR(struct Stack *tmp, const unsigned int *indices, unsigned int indices_count,
+		unsigned int vertices_count, unsigned int cache_size);
+
+/* reorders triangles in place for post-transform vertex cache locality
+ * (Forsyth, "Linear-speed vertex cache optimisation"), order of vertices
+ * within triangles is preserved.
+ * Returns 0 if out of temp memory, indices are left untouched then */
+int meshoptOptimizeVertexCache(struct Stack *tmp, unsigned int *indices, unsigned int indices_count,
+		unsigned int vertices_count);
+
+/* renumbers vertices in order of first use, so that vertex fetch walks
+ * memory linearly. Indices are rewritten in place, remap receives new index
+ * for every old vertex, unreferenced vertices go to the end.
+ * Returns number of referenced vertices */
+unsigned int meshoptOptimizeVertexFetch(unsigned int *indices, unsigned int indices_count,
+		unsigned int *remap, unsigned int vertices_count);
+
+/* Quadric edge collapse of a triangle list in place, vertices are never moved,
+ * so every simplified level can share the same vertex buffer.
+ * Vertices at the same position are wedges of one point: seams between two wedges
+ * (e.g. lightmap uv seams) and open borders only collapse along themselves,
+ * points with more wedges are locked. Collapses stop at target_indices_count or when
+ * the cheapest one would move the surface by more than target_error position units.
+ * positions are xyz floats. Returns new index count, indices are left untouched
+ * if out of temp memory */
+unsigned int meshoptSimplify(struct Stack *tmp, unsigned int *indices, unsigned int indices_count,
+		const float *positions, unsigned int vertices_count,
+		unsigned int target_indices_count, float target_error);
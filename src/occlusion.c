@@ -0,0 +1,437 @@
+#include "occlusion.h"
+#include "camera.h"
+#include "mempools.h"
+#include "profiler.h"
+#include "common.h"
+
+#include "atto/app.h"
+#include "atto/platform.h"
+
+#include <stdint.h> /* intptr_t */
+#include <stdlib.h> /* atexit */
+#include <string.h> /* memset */
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define OCCLUSION_SSE
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define OCCLUSION_NEON
+#include <arm_neon.h>
+#endif
+
+/* rows are split into as many bands, all but the first one are rasterized by worker threads */
+#ifdef ATTO_PLATFORM_POSIX
+#define OCCLUSION_THREADS
+#include <pthread.h>
+#define OCCLUSION_BANDS 4
+#else
+#define OCCLUSION_BANDS 1
+#endif
+
+/* triangles are clipped to this many times the screen size, so that edge functions stay precise */
+#define OCCLUSION_GUARD_BAND 2.f
+
+/* Set up for rasterization: pixel x, y (x0.5 for centers) is covered when a*x + b*y + c >= 0
+ * for all three edges. Pixels are sampled at centers, so that triangles of one face leave no
+ * cracks between them, boxes are tested with a pixel of margin for that. Depth is moved back by
+ * its largest change over a pixel, so that it is nowhere nearer than the triangle is */
+struct OcclusionTriangle {
+	float a[3], b[3], c[3];
+	/* 1/w at pixel x, y is z + zx * x + zy * y */
+	float z, zx, zy;
+	/* pixel rect, xmin is aligned to 4 */
+	int xmin, xmax, ymin, ymax;
+};
+
+static struct {
+	/* 1/w of the nearest occluder in each pixel, the largest one, 0 when there is none */
+	float *depth;
+	struct OcclusionTriangle *triangles;
+	int triangles_count;
+	int dropped;
+	/* the limit is only reported the first time it is reached */
+	int dropped_reported;
+	/* depth is up to date with the camera */
+	int ready;
+
+	struct AMat4f view_projection;
+	float z_near;
+	ATimeUs setup_time;
+
+#ifdef OCCLUSION_THREADS
+	/* worker i rasterizes band i + 1, bands without a worker are left to the caller */
+	pthread_t threads[OCCLUSION_BANDS - 1];
+	int threads_count;
+	pthread_mutex_t lock;
+	pthread_cond_t start, done;
+	/* incremented for every frame to be rasterized */
+	unsigned int generation;
+	int pending;
+	int quit;
+#endif
+} occ;
+
+static void occlusionRasterizeSpan(const struct OcclusionTriangle *t, float *row, float py) {
+	const float ab[3] = { t->b[0] * py + t->c[0], t->b[1] * py + t->c[1], t->b[2] * py + t->c[2] };
+	const float zb = t->zy * py + t->z;
+	int x = t->xmin;
+#if defined(OCCLUSION_SSE)
+	const __m128 lanes = _mm_set_ps(3.5f, 2.5f, 1.5f, .5f);
+	const __m128 a0 = _mm_set1_ps(t->a[0]), a1 = _mm_set1_ps(t->a[1]), a2 = _mm_set1_ps(t->a[2]);
+	const __m128 b0 = _mm_set1_ps(ab[0]), b1 = _mm_set1_ps(ab[1]), b2 = _mm_set1_ps(ab[2]);
+	const __m128 zx = _mm_set1_ps(t->zx), zb4 = _mm_set1_ps(zb), zero = _mm_setzero_ps();
+	for (; x < t->xmax; x += 4) {
+		const __m128 px = _mm_add_ps(_mm_set1_ps((float)x), lanes);
+		const __m128 inside = _mm_and_ps(
+			_mm_and_ps(
+				_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a0, px), b0), zero),
+				_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a1, px), b1), zero)),
+			_mm_cmpge_ps(_mm_add_ps(_mm_mul_ps(a2, px), b2), zero));
+		const __m128 depth = _mm_loadu_ps(row + x);
+		const __m128 z = _mm_max_ps(depth, _mm_add_ps(_mm_mul_ps(zx, px), zb4));
+		_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, z), _mm_andnot_ps(inside, depth)));
+	}
+#elif defined(OCCLUSION_NEON)
+	const float lanes_init[4] = { .5f, 1.5f, 2.5f, 3.5f };
+	const float32x4_t lanes = vld1q_f32(lanes_init);
+	const float32x4_t a0 = vdupq_n_f32(t->a[0]), a1 = vdupq_n_f32(t->a[1]), a2 = vdupq_n_f32(t->a[2]);
+	const float32x4_t b0 = vdupq_n_f32(ab[0]), b1 = vdupq_n_f32(ab[1]), b2 = vdupq_n_f32(ab[2]);
+	const float32x4_t zx = vdupq_n_f32(t->zx), zb4 = vdupq_n_f32(zb), zero = vdupq_n_f32(0.f);
+	for (; x < t->xmax; x += 4) {
+		const float32x4_t px = vaddq_f32(vdupq_n_f32((float)x), lanes);
+		const uint32x4_t inside = vandq_u32(
+			vandq_u32(
+				vcgeq_f32(vmlaq_f32(b0, a0, px), zero),
+				vcgeq_f32(vmlaq_f32(b1, a1, px), zero)),
+			vcgeq_f32(vmlaq_f32(b2, a2, px), zero));
+		const float32x4_t depth = vld1q_f32(row + x);
+		const float32x4_t z = vmaxq_f32(depth, vmlaq_f32(zb4, zx, px));
+		vst1q_f32(row + x, vbslq_f32(inside, z, depth));
+	}
+#endif
+	for (; x < t->xmax; ++x) {
+		const float px = x + .5f;
+		if (t->a[0] * px + ab[0] < 0.f || t->a[1] * px + ab[1] < 0.f || t->a[2] * px + ab[2] < 0.f)
+			continue;
+		const float z = t->zx * px + zb;
+		if (z > row[x])
+			row[x] = z;
+	}
+}
+
+static void occlusionRasterizeBand(int band) {
+	const int y0 = band * OCCLUSION_HEIGHT / OCCLUSION_BANDS, y1 = (band + 1) * OCCLUSION_HEIGHT / OCCLUSION_BANDS;
+	memset(occ.depth + y0 * OCCLUSION_WIDTH, 0, sizeof(float) * OCCLUSION_WIDTH * (y1 - y0));
+
+	for (int i = 0; i < occ.triangles_count; ++i) {
+		const struct OcclusionTriangle *const t = occ.triangles + i;
+		const int ymin = t->ymin > y0 ? t->ymin : y0, ymax = t->ymax < y1 ? t->ymax : y1;
+		for (int y = ymin; y < ymax; ++y)
+			occlusionRasterizeSpan(t, occ.depth + y * OCCLUSION_WIDTH, y + .5f);
+	}
+}
+
+#ifdef OCCLUSION_THREADS
+static void *occlusionWorker(void *arg) {
+	const int band = (int)(intptr_t)arg;
+	unsigned int generation = 0;
+	for (;;) {
+		pthread_mutex_lock(&occ.lock);
+		while (occ.generation == generation && !occ.quit)
+			pthread_cond_wait(&occ.start, &occ.lock);
+		generation = occ.generation;
+		const int quit = occ.quit;
+		pthread_mutex_unlock(&occ.lock);
+
+		if (quit)
+			break;
+
+		occlusionRasterizeBand(band);
+
+		pthread_mutex_lock(&occ.lock);
+		if (--occ.pending == 0)
+			pthread_cond_signal(&occ.done);
+		pthread_mutex_unlock(&occ.lock);
+	}
+	return NULL;
+}
+
+static void occlusionStopWorkers() {
+	pthread_mutex_lock(&occ.lock);
+	occ.quit = 1;
+	pthread_cond_broadcast(&occ.start);
+	pthread_mutex_unlock(&occ.lock);
+
+	for (int i = 0; i < occ.threads_count; ++i)
+		pthread_join(occ.threads[i], NULL);
+	occ.threads_count = 0;
+}
+#endif
+
+int occlusionInit(struct Stack *persistent) {
+	occ.depth = stackAlloc(persistent, sizeof(float) * OCCLUSION_WIDTH * OCCLUSION_HEIGHT);
+	occ.triangles = stackAlloc(persistent, sizeof(struct OcclusionTriangle) * OCCLUSION_MAX_TRIANGLES);
+	if (!occ.depth || !occ.triangles)
+		return 0;
+
+	occ.triangles_count = 0;
+	occ.ready = 0;
+	occ.dropped_reported = 0;
+
+#ifdef OCCLUSION_THREADS
+	pthread_mutex_init(&occ.lock, NULL);
+	pthread_cond_init(&occ.start, NULL);
+	pthread_cond_init(&occ.done, NULL);
+	occ.generation = 0;
+	occ.pending = 0;
+	occ.quit = 0;
+	occ.threads_count = 0;
+	for (int i = 0; i < OCCLUSION_BANDS - 1; ++i) {
+		if (pthread_create(occ.threads + i, NULL, occlusionWorker, (void*)(intptr_t)(i + 1)) != 0) {
+			/* all bands are rasterized on the calling thread then */
+			PRINTF("Cannot start occlusion worker %d, rasterizing on one thread", i);
+			occlusionStopWorkers();
+			break;
+		}
+		++occ.threads_count;
+	}
+
+	/* workers wait on the lock, they are stopped before it goes away with the process */
+	if (occ.threads_count)
+		atexit(occlusionStopWorkers);
+#endif
+
+	return 1;
+}
+
+void occlusionBegin(const struct Camera *camera) {
+	occ.view_projection = camera->view_projection;
+	occ.z_near = camera->z_near;
+	occ.triangles_count = 0;
+	occ.dropped = 0;
+	occ.ready = 0;
+	occ.setup_time = 0;
+}
+
+/* clip space vertex, z is not needed */
+struct OcclusionVertex {
+	float x, y, w;
+};
+
+static struct OcclusionVertex occlusionTransform(struct AVec3f p) {
+	const struct AMat4f *const m = &occ.view_projection;
+	struct OcclusionVertex v;
+	v.x = m->X.x * p.x + m->Y.x * p.y + m->Z.x * p.z + m->W.x;
+	v.y = m->X.y * p.x + m->Y.y * p.y + m->Z.y * p.z + m->W.y;
+	v.w = m->X.w * p.x + m->Y.w * p.y + m->Z.w * p.z + m->W.w;
+	return v;
+}
+
+/* Clips polygon by plane px * x + py * y + pw * w + pc >= 0, returns new vertex count */
+static int occlusionClip(const struct OcclusionVertex *in, int count, struct OcclusionVertex *out,
+		float px, float py, float pw, float pc) {
+	int out_count = 0;
+	for (int i = 0; i < count; ++i) {
+		const struct OcclusionVertex *const a = in + i, *const b = in + (i + 1) % count;
+		const float da = px * a->x + py * a->y + pw * a->w + pc;
+		const float db = px * b->x + py * b->y + pw * b->w + pc;
+		if (da >= 0.f)
+			out[out_count++] = *a;
+		if ((da >= 0.f) != (db >= 0.f)) {
+			const float t = da / (da - db);
+			out[out_count].x = a->x + (b->x - a->x) * t;
+			out[out_count].y = a->y + (b->y - a->y) * t;
+			out[out_count].w = a->w + (b->w - a->w) * t;
+			++out_count;
+		}
+	}
+	return out_count;
+}
+
+/* most triangles need no clipping at all */
+static int occlusionInsideGuardBand(const struct OcclusionVertex *v) {
+	for (int i = 0; i < 3; ++i) {
+		const float gw = v[i].w * OCCLUSION_GUARD_BAND;
+		if (v[i].w < occ.z_near || v[i].x > gw || v[i].x < -gw || v[i].y > gw || v[i].y < -gw)
+			return 0;
+	}
+	return 1;
+}
+
+static void occlusionSetupTriangle(const float *x, const float *y, const float *z) {
+	const float area = (x[1] - x[0]) * (y[2] - y[0]) - (x[2] - x[0]) * (y[1] - y[0]);
+	/* back faces and degenerate ones */
+	if (area <= 0.f)
+		return;
+
+	float xmin = x[0], xmax = x[0], ymin = y[0], ymax = y[0];
+	for (int i = 1; i < 3; ++i) {
+		if (x[i] < xmin) xmin = x[i];
+		if (x[i] > xmax) xmax = x[i];
+		if (y[i] < ymin) ymin = y[i];
+		if (y[i] > ymax) ymax = y[i];
+	}
+
+	int ixmin = (int)xmin, ixmax = (int)xmax + 1, iymin = (int)ymin, iymax = (int)ymax + 1;
+	if (ixmin < 0) ixmin = 0;
+	if (iymin < 0) iymin = 0;
+	if (ixmax > OCCLUSION_WIDTH) ixmax = OCCLUSION_WIDTH;
+	if (iymax > OCCLUSION_HEIGHT) iymax = OCCLUSION_HEIGHT;
+	if (ixmin >= ixmax || iymin >= iymax)
+		return;
+
+	if (occ.triangles_count == OCCLUSION_MAX_TRIANGLES) {
+		++occ.dropped;
+		return;
+	}
+
+	struct OcclusionTriangle *const t = occ.triangles + occ.triangles_count++;
+	for (int i = 0; i < 3; ++i) {
+		const int j = (i + 1) % 3;
+		t->a[i] = y[i] - y[j];
+		t->b[i] = x[j] - x[i];
+		t->c[i] = (y[j] - y[i]) * x[i] - (x[j] - x[i]) * y[i];
+	}
+
+	t->zx = ((z[1] - z[0]) * (y[2] - y[0]) - (z[2] - z[0]) * (y[1] - y[0])) / area;
+	t->zy = ((z[2] - z[0]) * (x[1] - x[0]) - (z[1] - z[0]) * (x[2] - x[0])) / area;
+	t->z = z[0] - t->zx * x[0] - t->zy * y[0] - .5f * (fabsf(t->zx) + fabsf(t->zy));
+
+	t->xmin = ixmin & ~3;
+	t->xmax = ixmax;
+	t->ymin = iymin;
+	t->ymax = iymax;
+}
+
+void occlusionAddTriangles(const float *triangles, int count, struct AVec3f translation) {
+	const ATimeUs start = aAppTime();
+	const float g = OCCLUSION_GUARD_BAND;
+
+	for (int i = 0; i < count; ++i, triangles += 9) {
+		/* each plane adds at most one vertex */
+		struct OcclusionVertex poly[2][8];
+		for (int k = 0; k < 3; ++k)
+			poly[0][k] = occlusionTransform(aVec3fAdd(aVec3f(triangles[k*3], triangles[k*3+1], triangles[k*3+2]), translation));
+
+		int n = 3;
+		const struct OcclusionVertex *clipped = poly[0];
+		if (!occlusionInsideGuardBand(poly[0])) {
+			n = occlusionClip(poly[0], n, poly[1], 0.f, 0.f, 1.f, -occ.z_near);
+			n = occlusionClip(poly[1], n, poly[0], -1.f, 0.f, g, 0.f);
+			n = occlusionClip(poly[0], n, poly[1], 1.f, 0.f, g, 0.f);
+			n = occlusionClip(poly[1], n, poly[0], 0.f, -1.f, g, 0.f);
+			n = occlusionClip(poly[0], n, poly[1], 0.f, 1.f, g, 0.f);
+			clipped = poly[1];
+		}
+		if (n < 3)
+			continue;
+
+		float x[8], y[8], z[8];
+		for (int k = 0; k < n; ++k) {
+			z[k] = 1.f / clipped[k].w;
+			x[k] = (clipped[k].x * z[k] * .5f + .5f) * OCCLUSION_WIDTH;
+			y[k] = (clipped[k].y * z[k] * .5f + .5f) * OCCLUSION_HEIGHT;
+		}
+
+		for (int k = 2; k < n; ++k) {
+			const float tx[3] = { x[0], x[k-1], x[k] }, ty[3] = { y[0], y[k-1], y[k] }, tz[3] = { z[0], z[k-1], z[k] };
+			occlusionSetupTriangle(tx, ty, tz);
+		}
+	}
+
+	occ.setup_time += aAppTime() - start;
+}
+
+void occlusionRasterize() {
+	const ATimeUs start = aAppTime();
+
+	int first_band = 1;
+#ifdef OCCLUSION_THREADS
+	if (occ.threads_count) {
+		pthread_mutex_lock(&occ.lock);
+		occ.pending = occ.threads_count;
+		++occ.generation;
+		pthread_cond_broadcast(&occ.start);
+		pthread_mutex_unlock(&occ.lock);
+		first_band += occ.threads_count;
+	}
+#endif
+
+	occlusionRasterizeBand(0);
+	for (int band = first_band; band < OCCLUSION_BANDS; ++band)
+		occlusionRasterizeBand(band);
+
+#ifdef OCCLUSION_THREADS
+	if (occ.threads_count) {
+		pthread_mutex_lock(&occ.lock);
+		while (occ.pending)
+			pthread_cond_wait(&occ.done, &occ.lock);
+		pthread_mutex_unlock(&occ.lock);
+	}
+#endif
+
+	occ.ready = 1;
+	if (occ.dropped && !occ.dropped_reported) {
+		PRINTF("Occlusion triangle limit reached, %d dropped, further frames over it are not reported", occ.dropped);
+		occ.dropped_reported = 1;
+	}
+
+	profileEvent("occlusion setup", occ.setup_time);
+	profileEvent("occlusion raster", aAppTime() - start);
+}
+
+int occlusionVisible(struct AVec3f min, struct AVec3f max) {
+	if (!occ.ready)
+		return 1;
+
+	float xmin = 0.f, xmax = 0.f, ymin = 0.f, ymax = 0.f, zmax = 0.f;
+	for (int i = 0; i < 8; ++i) {
+		const struct OcclusionVertex v = occlusionTransform(aVec3f(
+			(i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z));
+
+		/* box crosses the near plane */
+		if (v.w < occ.z_near)
+			return 1;
+
+		const float z = 1.f / v.w;
+		const float x = (v.x * z * .5f + .5f) * OCCLUSION_WIDTH, y = (v.y * z * .5f + .5f) * OCCLUSION_HEIGHT;
+		if (i == 0 || x < xmin) xmin = x;
+		if (i == 0 || x > xmax) xmax = x;
+		if (i == 0 || y < ymin) ymin = y;
+		if (i == 0 || y > ymax) ymax = y;
+		if (z > zmax) zmax = z;
+	}
+
+	/* out of screen boxes are for frustum culling to deal with */
+	if (xmax < 0.f || ymax < 0.f || xmin >= OCCLUSION_WIDTH || ymin >= OCCLUSION_HEIGHT)
+		return 1;
+
+	/* occluders cover pixels their edges merely cross the center of */
+	const int ixmin = xmin > 1.f ? ((int)xmin - 1) & ~3 : 0, iymin = ymin > 1.f ? (int)ymin - 1 : 0;
+	const int ixmax = xmax < OCCLUSION_WIDTH - 2 ? (int)xmax + 2 : OCCLUSION_WIDTH;
+	const int iymax = ymax < OCCLUSION_HEIGHT - 2 ? (int)ymax + 2 : OCCLUSION_HEIGHT;
+
+	for (int y = iymin; y < iymax; ++y) {
+		const float *const row = occ.depth + y * OCCLUSION_WIDTH;
+		int x = ixmin;
+#if defined(OCCLUSION_SSE)
+		const __m128 z4 = _mm_set1_ps(zmax);
+		for (; x + 4 <= ixmax; x += 4)
+			if (_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(row + x), z4)))
+				return 1;
+#elif defined(OCCLUSION_NEON)
+		const float32x4_t z4 = vdupq_n_f32(zmax);
+		for (; x + 4 <= ixmax; x += 4) {
+			const uint32x4_t le = vcleq_f32(vld1q_f32(row + x), z4);
+			const uint32x2_t any = vorr_u32(vget_low_u32(le), vget_high_u32(le));
+			if (vget_lane_u32(vpmax_u32(any, any), 0))
+				return 1;
+		}
+#endif
+		for (; x < ixmax; ++x)
+			if (row[x] <= zmax)
+				return 1;
+	}
+
+	return 0;
+}
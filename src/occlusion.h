@@ -0,0 +1,29 @@
+#pragma once
+#include "atto/math.h"
+
+struct Camera;
+struct Stack;
+
+/* Software occlusion culling: a small depth buffer is rasterized on CPU every frame
+ * from a conservative set of occluders, then boxes are tested against it.
+ * Works the same on any GL version, doesn't wait for the GPU */
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+/* occluder triangles per frame, the rest are dropped */
+#define OCCLUSION_MAX_TRIANGLES 8192
+
+/* Starts worker threads, returns 0 if out of memory */
+int occlusionInit(struct Stack *persistent);
+
+/* Starts a new frame seen from camera, nothing is occluded until occlusionRasterize() */
+void occlusionBegin(const struct Camera *camera);
+
+/* count triangles of 9 floats each, in space translated by translation.
+ * Only the front faces occlude, those that are counter clockwise on screen */
+void occlusionAddTriangles(const float *triangles, int count, struct AVec3f translation);
+
+/* Fills the depth buffer with everything added since occlusionBegin() */
+void occlusionRasterize();
+
+/* Returns 0 if the box is completely behind the occluders */
+int occlusionVisible(struct AVec3f min, struct AVec3f max);
@@ -5,6 +5,7 @@
 #include "common.h"
 #include "profiler.h"
 #include "camera.h"
+#include "occlusion.h"
 
 #include "atto/app.h"
 #include "atto/platform.h"
@@ -18,6 +19,7 @@
 #endif /* ifdef ATTO_PLATFORM_X11 */
 
 #ifdef ATTO_PLATFORM_RPI
+#include <EGL/egl.h>
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 #define ATTO_GL_ES
@@ -35,6 +37,30 @@
 #define ATTO_GL_DESKTOP
 #endif
 
+/* compute shader culling and indirect draws need GL 4.3 headers, availability is checked at runtime */
+#if defined(ATTO_GL_DESKTOP) && defined(GL_VERSION_4_3)
+#define RENDER_GPU_CULLING
+#endif
+
+/* vertex array objects are core since GL 3.0, on GLES2 they are an extension, both checked at runtime */
+#ifdef ATTO_GL_ES
+#ifdef GL_OES_vertex_array_object
+#define RENDER_VERTEX_ARRAYS
+static PFNGLGENVERTEXARRAYSOESPROC render_GenVertexArrays;
+static PFNGLBINDVERTEXARRAYOESPROC render_BindVertexArray;
+static PFNGLDELETEVERTEXARRAYSOESPROC render_DeleteVertexArrays;
+#endif
+#elif defined(GL_VERSION_3_0)
+#define RENDER_VERTEX_ARRAYS
+#define render_GenVertexArrays glGenVertexArrays
+#define render_BindVertexArray glBindVertexArray
+#define render_DeleteVertexArrays glDeleteVertexArrays
+#endif
+
+#ifndef GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#endif
+
 #define RENDER_ERRORCHECK
 //#define RENDER_GL_TRACE
 
@@ -111,6 +137,7 @@ static void a__GlPrintError(const char *message, int error) {
 	WGL__FUNCLIST_DO(PFNGLBINDBUFFERPROC, BindBuffer) \
 	WGL__FUNCLIST_DO(PFNGLBUFFERDATAPROC, BufferData) \
 	WGL__FUNCLIST_DO(PFNGLGETATTRIBLOCATIONPROC, GetAttribLocation) \
+	WGL__FUNCLIST_DO(PFNGLBINDATTRIBLOCATIONPROC, BindAttribLocation) \
 	WGL__FUNCLIST_DO(PFNGLACTIVETEXTUREPROC, ActiveTexture) \
 	WGL__FUNCLIST_DO(PFNGLCREATESHADERPROC, CreateShader) \
 	WGL__FUNCLIST_DO(PFNGLSHADERSOURCEPROC, ShaderSource) \
@@ -128,6 +155,7 @@ static void a__GlPrintError(const char *message, int error) {
 	WGL__FUNCLIST_DO(PFNGLGETUNIFORMLOCATIONPROC, GetUniformLocation) \
 	WGL__FUNCLIST_DO(PFNGLUNIFORM1FPROC, Uniform1f) \
 	WGL__FUNCLIST_DO(PFNGLUNIFORM2FPROC, Uniform2f) \
+	WGL__FUNCLIST_DO(PFNGLUNIFORM3FPROC, Uniform3f) \
 	WGL__FUNCLIST_DO(PFNGLUNIFORM1IPROC, Uniform1i) \
 	WGL__FUNCLIST_DO(PFNGLUNIFORMMATRIX4FVPROC, UniformMatrix4fv) \
 	WGL__FUNCLIST_DO(PFNGLENABLEVERTEXATTRIBARRAYPROC, EnableVertexAttribArray) \
@@ -135,9 +163,42 @@ static void a__GlPrintError(const char *message, int error) {
 	WGL__FUNCLIST_DO(PFNGLVERTEXATTRIBPOINTERPROC, VertexAttribPointer) \
 	WGL__FUNCLIST_DO(PFNGLGENERATEMIPMAPPROC, GenerateMipmap) \
 	WGL__FUNCLIST_DO(PFNGLCOMPRESSEDTEXIMAGE2DPROC, CompressedTexImage2D) \
+	WGL__FUNCLIST_DO(PFNGLCOMPRESSEDTEXSUBIMAGE2DPROC, CompressedTexSubImage2D) \
+	WGL__FUNCLIST_DO(PFNGLGENQUERIESPROC, GenQueries) \
+	WGL__FUNCLIST_DO(PFNGLBEGINQUERYPROC, BeginQuery) \
+	WGL__FUNCLIST_DO(PFNGLENDQUERYPROC, EndQuery) \
+	WGL__FUNCLIST_DO(PFNGLGETQUERYOBJECTUIVPROC, GetQueryObjectuiv) \
+
+/* GL 4.3, not required */
+#define WGL__FUNCLIST_GPU_CULLING \
+	WGL__FUNCLIST_DO(PFNGLDISPATCHCOMPUTEPROC, DispatchCompute) \
+	WGL__FUNCLIST_DO(PFNGLMEMORYBARRIERPROC, MemoryBarrier) \
+	WGL__FUNCLIST_DO(PFNGLBINDBUFFERBASEPROC, BindBufferBase) \
+	WGL__FUNCLIST_DO(PFNGLBUFFERSUBDATAPROC, BufferSubData) \
+	WGL__FUNCLIST_DO(PFNGLUNIFORM4FVPROC, Uniform4fv) \
+	WGL__FUNCLIST_DO(PFNGLUNIFORM1UIPROC, Uniform1ui) \
+	WGL__FUNCLIST_DO(PFNGLMULTIDRAWELEMENTSINDIRECTPROC, MultiDrawElementsIndirect) \
+	WGL__FUNCLIST_DO(PFNGLTEXSTORAGE3DPROC, TexStorage3D) \
+	WGL__FUNCLIST_DO(PFNGLCOPYTEXSUBIMAGE3DPROC, CopyTexSubImage3D) \
+	WGL__FUNCLIST_DO(PFNGLTEXSUBIMAGE3DPROC, TexSubImage3D) \
+	WGL__FUNCLIST_DO(PFNGLGENFRAMEBUFFERSPROC, GenFramebuffers) \
+	WGL__FUNCLIST_DO(PFNGLBINDFRAMEBUFFERPROC, BindFramebuffer) \
+	WGL__FUNCLIST_DO(PFNGLFRAMEBUFFERTEXTURE2DPROC, FramebufferTexture2D) \
+	WGL__FUNCLIST_DO(PFNGLVERTEXATTRIBIPOINTERPROC, VertexAttribIPointer) \
+	WGL__FUNCLIST_DO(PFNGLVERTEXATTRIBDIVISORPROC, VertexAttribDivisor) \
+
+/* GL 3.0, not required */
+#define WGL__FUNCLIST_VERTEX_ARRAYS \
+	WGL__FUNCLIST_DO(PFNGLGENVERTEXARRAYSPROC, GenVertexArrays) \
+	WGL__FUNCLIST_DO(PFNGLBINDVERTEXARRAYPROC, BindVertexArray) \
+	WGL__FUNCLIST_DO(PFNGLDELETEVERTEXARRAYSPROC, DeleteVertexArrays) \
 
 #define WGL__FUNCLIST_DO(T,N) T gl##N = 0;
 WGL__FUNCLIST
+WGL__FUNCLIST_VERTEX_ARRAYS
+#ifdef RENDER_GPU_CULLING
+WGL__FUNCLIST_GPU_CULLING
+#endif
 #undef WGL__FUNCLIST_DO
 #endif /* ifdef _WIN32 */
 
@@ -155,6 +216,277 @@ static void renderPrintMemUsage() {
 		(stats.buffers_size + stats.textures_size) >> 20);
 }
 
+/* Shadow copy of GL state that is set often. Setters skip calls that would not change it,
+ * everything that changes this state has to go through them */
+#define RENDER_STATE_TEXTURE_UNITS 2
+/* textures whose wrap mode is known */
+#define RENDER_STATE_MAX_TEXTURES 4096
+
+enum {
+	RStateTexture_2D,
+	RStateTexture_CubeMap,
+	RStateTexture_2DArray,
+	RStateTexture_COUNT
+};
+
+enum {
+	RStateBuffer_Array,
+	/* of the default vertex array only, the others keep their own */
+	RStateBuffer_Index,
+	RStateBuffer_Storage,
+	RStateBuffer_Indirect,
+	RStateBuffer_COUNT
+};
+
+enum {
+	RStateCap_DepthTest,
+	RStateCap_CullFace,
+	RStateCap_Blend,
+	RStateCap_PolygonOffsetFill,
+	RStateCap_StencilTest,
+	RStateCap_COUNT
+};
+
+static struct {
+	GLuint program;
+	int active_unit;
+	GLuint textures[RENDER_STATE_TEXTURE_UNITS][RStateTexture_COUNT];
+	GLuint buffers[RStateBuffer_COUNT];
+	int caps[RStateCap_COUNT];
+	GLenum depth_func;
+	int depth_mask, color_mask;
+	GLuint stencil_mask;
+	GLenum blend_src, blend_dst, blend_equation;
+	float blend_color[4];
+	float polygon_offset[2];
+	GLenum stencil_func;
+	GLint stencil_ref;
+	GLuint stencil_func_mask;
+	GLenum stencil_op[3];
+
+	/* open addressing by gl_name, which is never 0 */
+	struct {
+		GLuint name;
+		GLint wrap;
+	} wraps[RENDER_STATE_MAX_TEXTURES];
+	int wraps_count;
+
+	/* calls made and skipped since renderBegin(), and in the whole previous frame */
+	int issued, skipped;
+	int last_issued, last_skipped;
+} state;
+
+/* GL defaults */
+static void renderStateInit() {
+	memset(&state, 0, sizeof(state));
+	state.depth_func = GL_LESS;
+	state.depth_mask = state.color_mask = 1;
+	state.stencil_mask = ~0u;
+	state.blend_src = GL_ONE;
+	state.blend_dst = GL_ZERO;
+	state.blend_equation = GL_FUNC_ADD;
+	state.stencil_func = GL_ALWAYS;
+	state.stencil_func_mask = ~0u;
+	state.stencil_op[0] = state.stencil_op[1] = state.stencil_op[2] = GL_KEEP;
+}
+
+/* Returns 1 if the call is to be made */
+static int renderStateChange(int changed) {
+	if (changed)
+		++state.issued;
+	else
+		++state.skipped;
+	return changed;
+}
+
+/* Calls that are not tracked, so only counted as made */
+#define RENDER_STATE_CALL(f) do { GL_CALL(f); ++state.issued; } while (0)
+
+static void renderStateProgram(GLuint program) {
+	if (!renderStateChange(state.program != program))
+		return;
+	GL_CALL(glUseProgram(program));
+	state.program = program;
+}
+
+static void renderStateActiveTexture(int unit) {
+	if (!renderStateChange(state.active_unit != unit))
+		return;
+	GL_CALL(glActiveTexture(GL_TEXTURE0 + unit));
+	state.active_unit = unit;
+}
+
+static int renderStateTextureIndex(GLenum target) {
+	switch (target) {
+		case GL_TEXTURE_CUBE_MAP: return RStateTexture_CubeMap;
+#ifdef RENDER_GPU_CULLING
+		case GL_TEXTURE_2D_ARRAY: return RStateTexture_2DArray;
+#endif
+		default: return RStateTexture_2D;
+	}
+}
+
+static void renderStateTexture(int unit, GLenum target, GLuint name) {
+	GLuint *const bound = state.textures[unit] + renderStateTextureIndex(target);
+	if (!renderStateChange(*bound != name))
+		return;
+	renderStateActiveTexture(unit);
+	GL_CALL(glBindTexture(target, name));
+	*bound = name;
+}
+
+/* Sets wrap mode of name, which has to be bound to target of unit */
+static void renderStateTextureWrap(int unit, GLenum target, GLuint name, GLint wrap) {
+	unsigned int slot = name * 2654435761u % RENDER_STATE_MAX_TEXTURES;
+	while (state.wraps[slot].name && state.wraps[slot].name != name)
+		slot = (slot + 1) % RENDER_STATE_MAX_TEXTURES;
+
+	if (!renderStateChange(state.wraps[slot].name != name || state.wraps[slot].wrap != wrap))
+		return;
+
+	renderStateActiveTexture(unit);
+	GL_CALL(glTexParameteri(target, GL_TEXTURE_WRAP_S, wrap));
+	GL_CALL(glTexParameteri(target, GL_TEXTURE_WRAP_T, wrap));
+
+	/* when full, unknown textures are always set */
+	if (state.wraps[slot].name != name && state.wraps_count * 2 >= RENDER_STATE_MAX_TEXTURES)
+		return;
+	if (state.wraps[slot].name != name)
+		++state.wraps_count;
+	state.wraps[slot].name = name;
+	state.wraps[slot].wrap = wrap;
+}
+
+static int renderStateBufferIndex(GLenum target) {
+	switch (target) {
+		case GL_ELEMENT_ARRAY_BUFFER: return RStateBuffer_Index;
+#ifdef RENDER_GPU_CULLING
+		case GL_SHADER_STORAGE_BUFFER: return RStateBuffer_Storage;
+		case GL_DRAW_INDIRECT_BUFFER: return RStateBuffer_Indirect;
+#endif
+		default: return RStateBuffer_Array;
+	}
+}
+
+static void renderStateBuffer(GLenum target, GLuint name) {
+	GLuint *const bound = state.buffers + renderStateBufferIndex(target);
+	if (!renderStateChange(*bound != name))
+		return;
+	GL_CALL(glBindBuffer(target, name));
+	*bound = name;
+}
+
+#ifdef RENDER_GPU_CULLING
+/* Indexed binding also replaces the generic one */
+static void renderStateBufferBase(GLenum target, GLuint index, GLuint name) {
+	GL_CALL(glBindBufferBase(target, index, name));
+	++state.issued;
+	state.buffers[renderStateBufferIndex(target)] = name;
+}
+#endif
+
+static void renderStateEnable(GLenum cap, int enable) {
+	int index;
+	switch (cap) {
+		case GL_DEPTH_TEST: index = RStateCap_DepthTest; break;
+		case GL_CULL_FACE: index = RStateCap_CullFace; break;
+		case GL_BLEND: index = RStateCap_Blend; break;
+		case GL_POLYGON_OFFSET_FILL: index = RStateCap_PolygonOffsetFill; break;
+		case GL_STENCIL_TEST: index = RStateCap_StencilTest; break;
+		default: ATTO_ASSERT(!"Untracked capability"); return;
+	}
+
+	enable = !!enable;
+	if (!renderStateChange(state.caps[index] != enable))
+		return;
+	if (enable)
+		GL_CALL(glEnable(cap));
+	else
+		GL_CALL(glDisable(cap));
+	state.caps[index] = enable;
+}
+
+static void renderStateDepthFunc(GLenum func) {
+	if (!renderStateChange(state.depth_func != func))
+		return;
+	GL_CALL(glDepthFunc(func));
+	state.depth_func = func;
+}
+
+static void renderStateDepthMask(int enable) {
+	enable = !!enable;
+	if (!renderStateChange(state.depth_mask != enable))
+		return;
+	GL_CALL(glDepthMask(enable ? GL_TRUE : GL_FALSE));
+	state.depth_mask = enable;
+}
+
+/* all of RGBA or nothing */
+static void renderStateColorMask(int enable) {
+	enable = !!enable;
+	if (!renderStateChange(state.color_mask != enable))
+		return;
+	const GLboolean mask = enable ? GL_TRUE : GL_FALSE;
+	GL_CALL(glColorMask(mask, mask, mask, mask));
+	state.color_mask = enable;
+}
+
+static void renderStateStencilMask(GLuint mask) {
+	if (!renderStateChange(state.stencil_mask != mask))
+		return;
+	GL_CALL(glStencilMask(mask));
+	state.stencil_mask = mask;
+}
+
+static void renderStateBlendFunc(GLenum src, GLenum dst) {
+	if (!renderStateChange(state.blend_src != src || state.blend_dst != dst))
+		return;
+	GL_CALL(glBlendFunc(src, dst));
+	state.blend_src = src;
+	state.blend_dst = dst;
+}
+
+static void renderStateBlendEquation(GLenum equation) {
+	if (!renderStateChange(state.blend_equation != equation))
+		return;
+	GL_CALL(glBlendEquation(equation));
+	state.blend_equation = equation;
+}
+
+static void renderStateBlendColor(float red, float green, float blue, float alpha) {
+	const float color[4] = {red, green, blue, alpha};
+	if (!renderStateChange(memcmp(state.blend_color, color, sizeof(color)) != 0))
+		return;
+	GL_CALL(glBlendColor(red, green, blue, alpha));
+	memcpy(state.blend_color, color, sizeof(color));
+}
+
+static void renderStatePolygonOffset(float factor, float units) {
+	if (!renderStateChange(state.polygon_offset[0] != factor || state.polygon_offset[1] != units))
+		return;
+	GL_CALL(glPolygonOffset(factor, units));
+	state.polygon_offset[0] = factor;
+	state.polygon_offset[1] = units;
+}
+
+static void renderStateStencilFunc(GLenum func, GLint ref, GLuint mask) {
+	if (!renderStateChange(state.stencil_func != func || state.stencil_ref != ref || state.stencil_func_mask != mask))
+		return;
+	GL_CALL(glStencilFunc(func, ref, mask));
+	state.stencil_func = func;
+	state.stencil_ref = ref;
+	state.stencil_func_mask = mask;
+}
+
+static void renderStateStencilOp(GLenum sfail, GLenum dpfail, GLenum dppass) {
+	if (!renderStateChange(state.stencil_op[0] != sfail || state.stencil_op[1] != dpfail || state.stencil_op[2] != dppass))
+		return;
+	GL_CALL(glStencilOp(sfail, dpfail, dppass));
+	state.stencil_op[0] = sfail;
+	state.stencil_op[1] = dpfail;
+	state.stencil_op[2] = dppass;
+}
+
 static GLint render_ShaderCreate(GLenum type, const char *sources[]) {
 	int n;
 	GLuint shader = glCreateShader(type);
@@ -181,13 +513,28 @@ static GLint render_ShaderCreate(GLenum type, const char *sources[]) {
 	return shader;
 }
 
+/* compressed formats are stored in 4x4 blocks, even for mips smaller than a block */
+static int renderTextureImageSize(RTexFormat format, int width, int height) {
+	switch (format) {
+		case RTexFormat_RGB565:
+			return width * height * 2;
+#ifdef ATTO_PLATFORM_RPI
+		case RTexFormat_Compressed_ETC1:
+#else
+		case RTexFormat_Compressed_DXT1:
+#endif
+			return ((width + 3) / 4) * ((height + 3) / 4) * 8;
+	}
+	return 0;
+}
+
 void renderTextureUpload(RTexture *texture, RTextureUploadParams params) {
-	int pixel_bits = 0;
-	GLenum internal, format, type;
+	GLenum internal, format = GL_RGB, type = GL_UNSIGNED_SHORT_5_6_5;
 
 	if (texture->gl_name == -1) {
 		GL_CALL(glGenTextures(1, (GLuint*)&texture->gl_name));
 		texture->type_flags = 0;
+		texture->size = 0;
 		++stats.textures_count;
 	}
 
@@ -195,7 +542,7 @@ void renderTextureUpload(RTexture *texture, RTextureUploadParams params) {
 	const GLint wrap = (params.type == RTexType_2D && params.wrap == RTexWrap_Repeat)
 		? GL_REPEAT : GL_CLAMP_TO_EDGE;
 
-	GL_CALL(glBindTexture(binding, texture->gl_name));
+	renderStateTexture(state.active_unit, binding, texture->gl_name);
 
 	GLenum upload_binding = binding;
 	switch (params.type) {
@@ -211,21 +558,24 @@ void renderTextureUpload(RTexture *texture, RTextureUploadParams params) {
 	int compressed = 0;
 	switch (params.format) {
 		case RTexFormat_RGB565:
-			pixel_bits = 16;
 			internal = format = GL_RGB; type = GL_UNSIGNED_SHORT_5_6_5;
 			break;
 #ifdef ATTO_PLATFORM_RPI
 		case RTexFormat_Compressed_ETC1:
-			pixel_bits = 4;
 			internal = GL_ETC1_RGB8_OES;
 			compressed = 1;
 			break;
+#else
+		case RTexFormat_Compressed_DXT1:
+			internal = GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+			compressed = 1;
+			break;
 #endif
 		default:
 			ATTO_ASSERT(!"Impossible texture format");
 	}
 
-	const int image_size = params.width * params.height * pixel_bits / 8;
+	const int image_size = renderTextureImageSize(params.format, params.width, params.height);
 
 	if (!compressed) {
 		GL_CALL(glTexImage2D(upload_binding, params.mip_level < 0 ? 0 : params.mip_level, internal, params.width, params.height, 0,
@@ -236,16 +586,22 @@ void renderTextureUpload(RTexture *texture, RTextureUploadParams params) {
 	}
 
 	stats.textures_size += image_size;
+	texture->size += image_size;
 	renderPrintMemUsage();
 
 	if (params.mip_level == -1)
 		GL_CALL(glGenerateMipmap(binding));
 
+#ifdef ATTO_GL_DESKTOP
+	/* explicitly uploaded chains may stop short of 1x1 */
+	if (params.mip_level >= 0)
+		GL_CALL(glTexParameteri(binding, GL_TEXTURE_MAX_LEVEL, params.mip_level));
+#endif
+
 	GL_CALL(glTexParameteri(binding, GL_TEXTURE_MIN_FILTER, params.mip_level >= -1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR));
 	GL_CALL(glTexParameteri(binding, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
 
-	GL_CALL(glTexParameteri(binding, GL_TEXTURE_WRAP_S, wrap));
-	GL_CALL(glTexParameteri(binding, GL_TEXTURE_WRAP_T, wrap));
+	renderStateTextureWrap(state.active_unit, binding, texture->gl_name, wrap);
 
 	if (params.mip_level < 1) {
 		texture->width = params.width;
@@ -256,16 +612,80 @@ void renderTextureUpload(RTexture *texture, RTextureUploadParams params) {
 	texture->type_flags |= params.type;
 }
 
+void renderTextureDestroy(RTexture *texture) {
+	if (texture->gl_name == -1)
+		return;
+
+	const GLuint name = texture->gl_name;
+	for (int unit = 0; unit < RENDER_STATE_TEXTURE_UNITS; ++unit)
+		for (int i = 0; i < RStateTexture_COUNT; ++i)
+			if (state.textures[unit][i] == name)
+				state.textures[unit][i] = 0;
+
+	/* GL may give the name out again. Its slot stays to keep probing intact,
+	 * with a wrap no texture has, so the next one with that name gets it set */
+	unsigned int slot = name * 2654435761u % RENDER_STATE_MAX_TEXTURES;
+	while (state.wraps[slot].name && state.wraps[slot].name != name)
+		slot = (slot + 1) % RENDER_STATE_MAX_TEXTURES;
+	if (state.wraps[slot].name == name)
+		state.wraps[slot].wrap = 0;
+
+	GL_CALL(glDeleteTextures(1, &name));
+	--stats.textures_count;
+	stats.textures_size -= texture->size;
+
+	texture->gl_name = -1;
+	texture->type_flags = 0;
+	texture->size = 0;
+}
+
+void renderTextureUploadRegion(RTexture *texture, int x, int y, RTextureUploadParams params) {
+	const int level = params.mip_level < 0 ? 0 : params.mip_level;
+	ATTO_ASSERT(texture->gl_name != -1);
+	ATTO_ASSERT(params.type == RTexType_2D);
+	ATTO_ASSERT(params.format == texture->format);
+	ATTO_ASSERT(x + params.width <= (texture->width >> level) && y + params.height <= (texture->height >> level));
+
+	renderStateTexture(state.active_unit, GL_TEXTURE_2D, texture->gl_name);
+	switch (params.format) {
+		case RTexFormat_RGB565:
+			GL_CALL(glTexSubImage2D(GL_TEXTURE_2D, level, x, y, params.width, params.height,
+						GL_RGB, GL_UNSIGNED_SHORT_5_6_5, params.pixels));
+			break;
+#ifndef ATTO_PLATFORM_RPI
+		case RTexFormat_Compressed_DXT1:
+			ATTO_ASSERT(x % 4 == 0 && y % 4 == 0);
+			GL_CALL(glCompressedTexSubImage2D(GL_TEXTURE_2D, level, x, y, params.width, params.height,
+						GL_COMPRESSED_RGB_S3TC_DXT1_EXT, renderTextureImageSize(params.format, params.width, params.height),
+						params.pixels));
+			break;
+#else
+		default:
+			/* OES_compressed_ETC1_RGB8_texture doesn't allow partial updates */
+			ATTO_ASSERT(!"Unsupported texture region format");
+#endif
+	}
+}
+
+static void renderBindVertexArray(unsigned int name);
+
 void renderBufferCreate(RBuffer *buffer, RBufferType type, int size, const void *data) {
+	/* index buffer binding is a part of vertex array state */
+	renderBindVertexArray(0);
+
 	switch (type) {
 	case RBufferType_Vertex: buffer->type = GL_ARRAY_BUFFER; break;
 	case RBufferType_Index: buffer->type = GL_ELEMENT_ARRAY_BUFFER; break;
+#ifdef RENDER_GPU_CULLING
+	case RBufferType_Storage: buffer->type = GL_SHADER_STORAGE_BUFFER; break;
+	case RBufferType_Indirect: buffer->type = GL_DRAW_INDIRECT_BUFFER; break;
+#endif
 	default: ASSERT(!"Invalid buffer type");
 	}
 	GL_CALL(glGenBuffers(1, (GLuint*)&buffer->gl_name));
 	++stats.buffers_count;
 
-	GL_CALL(glBindBuffer(buffer->type, (GLuint)buffer->gl_name));
+	renderStateBuffer(buffer->type, (GLuint)buffer->gl_name);
 	GL_CALL(glBufferData(buffer->type, size, data, GL_STATIC_DRAW));
 	stats.buffers_size += size;
 	renderPrintMemUsage();
@@ -284,11 +704,29 @@ typedef struct {
 	const char *name;
 } RUniform;
 
+#ifdef BSP_TEX_UV_FIXED_SCALE
+#define RENDER_TEX_UV_TYPE GL_SHORT
+#define RENDER_SHADER_TEX_UV_SCALE "(1. / " RENDER__GL_STR(BSP_TEX_UV_FIXED_SCALE) ".)"
+#else
+#ifndef GL_HALF_FLOAT
+#define GL_HALF_FLOAT 0x140B
+#endif
+#define RENDER_TEX_UV_TYPE GL_HALF_FLOAT
+#define RENDER_SHADER_TEX_UV_SCALE "1."
+#endif
+
+#ifdef ATTO_PLATFORM_RPI
+#define RENDER_INDEX_TYPE GL_UNSIGNED_SHORT
+#else
+#define RENDER_INDEX_TYPE GL_UNSIGNED_INT
+#endif
+
+/* a_vertex is not normalized: xyz dequantization is a part of model matrix,
+ * and w is RGB565 color that is unpacked in shaders */
 #define RENDER_LIST_ATTRIBS \
-	RENDER_DECLARE_ATTRIB(vertex, 3, GL_FLOAT, GL_FALSE) \
-	RENDER_DECLARE_ATTRIB(lightmap_uv, 2, GL_FLOAT, GL_FALSE) \
-	RENDER_DECLARE_ATTRIB(tex_uv, 2, GL_FLOAT, GL_FALSE) \
-	RENDER_DECLARE_ATTRIB(average_color, 3, GL_UNSIGNED_BYTE, GL_TRUE) \
+	RENDER_DECLARE_ATTRIB(vertex, 4, GL_UNSIGNED_SHORT, GL_FALSE) \
+	RENDER_DECLARE_ATTRIB(lightmap_uv, 2, GL_UNSIGNED_SHORT, GL_TRUE) \
+	RENDER_DECLARE_ATTRIB(tex_uv, 2, RENDER_TEX_UV_TYPE, GL_FALSE) \
 
 //	RENDER_DECLARE_ATTRIB(normal, 3, GL_FLOAT)
 
@@ -315,6 +753,7 @@ RENDER_LIST_ATTRIBS
 	RENDER_DECLARE_UNIFORM(tex0_size) \
 	RENDER_DECLARE_UNIFORM(tex0_scale) \
 	RENDER_DECLARE_UNIFORM(tex0_translate) \
+	RENDER_DECLARE_UNIFORM(color) \
 
 static const RUniform uniforms[] = {
 #define RENDER_DECLARE_UNIFORM(n) {"u_" # n},
@@ -338,17 +777,24 @@ typedef struct RProgram {
 	int uniform_locations[RUniformKind_COUNT];
 } RProgram;
 
+/* prepended to all shaders */
+static const char *render_shader_header =
+	"#define TEX_UV_SCALE " RENDER_SHADER_TEX_UV_SCALE "\n"
+	"vec3 unpackColor565(float c) {\n"
+		"return vec3(floor(c / 2048.) / 31., floor(mod(c, 2048.) / 32.) / 63., mod(c, 32.) / 31.);\n"
+	"}\n";
+
 static RProgram programs[MShader_COUNT] = {
 	/* MShader_Unknown */
 	{-1, {
 			/* common */
 			"varying vec3 v_pos;\n",
 			/* vertex */
-			"attribute vec3 a_vertex;\n"
+			"attribute vec4 a_vertex;\n"
 			"uniform mat4 u_mvp;\n"
 			"void main() {\n"
-				"v_pos = a_vertex;\n"
-				"gl_Position = u_mvp * vec4(a_vertex, 1.);\n"
+				"v_pos = a_vertex.xyz;\n"
+				"gl_Position = u_mvp * vec4(a_vertex.xyz, 1.);\n"
 			"}\n",
 			/* fragment */
 			"void main() {\n"
@@ -363,13 +809,13 @@ static RProgram programs[MShader_COUNT] = {
 			"varying vec2 v_lightmap_uv;\n"
 			"varying vec3 v_color;\n",
 			/*vertex*/
-			"attribute vec3 a_vertex, a_average_color;\n"
+			"attribute vec4 a_vertex;\n"
 			"attribute vec2 a_lightmap_uv;\n"
 			"uniform mat4 u_mvp;\n"
 			"void main() {\n"
 				"v_lightmap_uv = a_lightmap_uv;\n"
-				"v_color = a_average_color;\n"
-				"gl_Position = u_mvp * vec4(a_vertex, 1.);\n"
+				"v_color = unpackColor565(a_vertex.w);\n"
+				"gl_Position = u_mvp * vec4(a_vertex.xyz, 1.);\n"
 			"}\n",
 			/*fragment*/
 			"uniform sampler2D u_lightmap;\n"
@@ -384,19 +830,19 @@ static RProgram programs[MShader_COUNT] = {
 			/*common*/
 			"varying vec2 v_lightmap_uv, v_tex_uv;\n",
 			/*vertex*/
-			"attribute vec3 a_vertex;\n"
+			"attribute vec4 a_vertex;\n"
 			"attribute vec2 a_lightmap_uv, a_tex_uv;\n"
 			"uniform mat4 u_mvp;\n"
 			"void main() {\n"
 				"v_lightmap_uv = a_lightmap_uv;\n"
-				"v_tex_uv = a_tex_uv;\n"
-				"gl_Position = u_mvp * vec4(a_vertex, 1.);\n"
+				"v_tex_uv = a_tex_uv * TEX_UV_SCALE;\n"
+				"gl_Position = u_mvp * vec4(a_vertex.xyz, 1.);\n"
 			"}\n",
 			/*fragment*/
 			"uniform sampler2D u_lightmap, u_tex0;\n"
 			"uniform vec2 u_lightmap_size, u_tex0_size;\n"
 			"void main() {\n"
-				"vec4 albedo = texture2D(u_tex0, v_tex_uv/u_tex0_size);\n"
+				"vec4 albedo = texture2D(u_tex0, v_tex_uv);\n"
 				"vec3 lm = texture2D(u_lightmap, v_lightmap_uv).xyz;\n"
 				"vec3 color = albedo.xyz * lm;\n"
 				"gl_FragColor = vec4(color, 1.);\n"
@@ -408,14 +854,13 @@ static RProgram programs[MShader_COUNT] = {
 	{-1, { /* common */
 		"varying vec2 v_uv;\n",
 		/* vertex */
-		"attribute vec3 a_vertex;\n"
+		"attribute vec4 a_vertex;\n"
 		"attribute vec2 a_tex_uv;\n"
 		"uniform mat4 u_mvp;\n"
-		"uniform float u_far;\n"
 		"uniform vec2 u_tex0_scale, u_tex0_translate;\n"
 		"void main() {\n"
-			"v_uv = a_tex_uv * u_tex0_scale + u_tex0_translate;\n"
-			"gl_Position = u_mvp * vec4(u_far * .5 * a_vertex, 1.);\n"
+			"v_uv = a_tex_uv * TEX_UV_SCALE * u_tex0_scale + u_tex0_translate;\n"
+			"gl_Position = u_mvp * vec4(a_vertex.xyz, 1.);\n"
 		"}\n",
 		/* fragment */
 		"uniform sampler2D u_tex0;\n"
@@ -427,54 +872,246 @@ static RProgram programs[MShader_COUNT] = {
 		}, {-1}, {-1}},
 };
 
-static struct BSPModelVertex box[] = {
-	{{ 1.f, -1.f, -1.f}, {0.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
-	{{ 1.f,  1.f, -1.f}, {0.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
-	{{ 1.f,  1.f,  1.f}, {0.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
-	{{ 1.f,  1.f,  1.f}, {0.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
-	{{ 1.f, -1.f,  1.f}, {0.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
-	{{ 1.f, -1.f, -1.f}, {0.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
-
-	{{-1.f, -1.f,  1.f}, {1.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
-	{{-1.f,  1.f,  1.f}, {1.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
-	{{-1.f,  1.f, -1.f}, {1.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
-	{{-1.f,  1.f, -1.f}, {1.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
-	{{-1.f, -1.f, -1.f}, {1.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
-	{{-1.f, -1.f,  1.f}, {1.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
-
-	{{ 1.f, -1.f, -1.f}, {2.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
-	{{ 1.f, -1.f,  1.f}, {2.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
-	{{-1.f, -1.f,  1.f}, {2.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
-	{{-1.f, -1.f,  1.f}, {2.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
-	{{-1.f, -1.f, -1.f}, {2.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
-	{{ 1.f, -1.f, -1.f}, {2.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
-
-	{{ 1.f,  1.f,  1.f}, {3.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
-	{{ 1.f,  1.f, -1.f}, {3.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
-	{{-1.f,  1.f, -1.f}, {3.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
-	{{-1.f,  1.f, -1.f}, {3.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
-	{{-1.f,  1.f,  1.f}, {3.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
-	{{ 1.f,  1.f,  1.f}, {3.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
-
-	{{ 1.f, -1.f,  1.f}, {4.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
-	{{ 1.f,  1.f,  1.f}, {4.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
-	{{-1.f,  1.f,  1.f}, {4.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
-	{{-1.f,  1.f,  1.f}, {4.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
-	{{-1.f, -1.f,  1.f}, {4.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
-	{{ 1.f, -1.f,  1.f}, {4.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
-
-	{{-1.f, -1.f, -1.f}, {5.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
-	{{-1.f,  1.f, -1.f}, {5.f, 0.f}, {1.f, 1.f}, {0, 0, 0}},
-	{{ 1.f,  1.f, -1.f}, {5.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
-	{{ 1.f,  1.f, -1.f}, {5.f, 0.f}, {0.f, 1.f}, {0, 0, 0}},
-	{{ 1.f, -1.f, -1.f}, {5.f, 0.f}, {0.f, 0.f}, {0, 0, 0}},
-	{{-1.f, -1.f, -1.f}, {5.f, 0.f}, {1.f, 0.f}, {0, 0, 0}},
+/* drawn after opaque geometry at far plane depth, so only visible sky pixels are shaded */
+static RProgram skybox_program = {-1, {
+		/* common */
+		"varying vec3 v_dir;\n",
+		/* vertex */
+		"attribute vec3 a_vertex;\n"
+		"uniform mat4 u_mvp;\n"
+		"void main() {\n"
+			/* world is z-up, cube maps are y-up */
+			"v_dir = a_vertex.xzy;\n"
+			"gl_Position = (u_mvp * vec4(a_vertex, 1.)).xyww;\n"
+		"}\n",
+		/* fragment */
+		"uniform samplerCube u_tex0;\n"
+		"void main() {\n"
+			"gl_FragColor = textureCube(u_tex0, v_dir);\n"
+		"}\n",
+	}, {-1}, {-1}};
+
+#ifdef ATTO_GL_DESKTOP
+/* unit box drawn for occlusion queries, depth test only */
+static RProgram occlusion_program = {-1, {
+		/* common */
+		"",
+		/* vertex */
+		"attribute vec3 a_vertex;\n"
+		"uniform mat4 u_mvp;\n"
+		"void main() {\n"
+			"gl_Position = u_mvp * vec4(a_vertex, 1.);\n"
+		"}\n",
+		/* fragment */
+		"void main() {\n"
+			"gl_FragColor = vec4(1.);\n"
+		"}\n",
+	}, {-1}, {-1}};
+#endif
+
+/* writes depth only, same vertex transform as material programs */
+static RProgram depth_program = {-1, {
+		/* common */
+		"",
+		/* vertex */
+		"attribute vec4 a_vertex;\n"
+		"uniform mat4 u_mvp;\n"
+		"void main() {\n"
+			"gl_Position = u_mvp * vec4(a_vertex.xyz, 1.);\n"
+		"}\n",
+		/* fragment */
+		"void main() {\n"
+			"gl_FragColor = vec4(1.);\n"
+		"}\n",
+	}, {-1}, {-1}};
+
+/* flat colored full screen quads out of the z faces of the box */
+static RProgram overdraw_program = {-1, {
+		/* common */
+		"",
+		/* vertex */
+		"attribute vec3 a_vertex;\n"
+		"void main() {\n"
+			"gl_Position = vec4(a_vertex.xy, 0., 1.);\n"
+		"}\n",
+		/* fragment */
+		"uniform vec3 u_color;\n"
+		"void main() {\n"
+			"gl_FragColor = vec4(u_color, 1.);\n"
+		"}\n",
+	}, {-1}, {-1}};
+
+#ifdef RENDER_GPU_CULLING
+/* Enables indirect draw command of each cluster that is within frustum and,
+ * if there are visibility data, in a group seen from the camera cluster */
+static const char *render_cull_shader =
+	"#version 430\n"
+	"layout(local_size_x = 64) in;\n"
+	"struct Cluster { vec4 sphere; uint start, count, group, padding; };\n"
+	"layout(std430, binding = 0) readonly buffer Clusters { Cluster clusters[]; };\n"
+	"layout(std430, binding = 1) buffer Commands { uint commands[]; };\n"
+	"layout(std430, binding = 2) readonly buffer Groups { uint groups_visible[]; };\n"
+	"uniform vec4 u_planes[6];\n"
+	"uniform uint u_count;\n"
+	"void main() {\n"
+		"uint i = gl_GlobalInvocationID.x;\n"
+		"if (i >= u_count) return;\n"
+		"vec4 s = clusters[i].sphere;\n"
+		"bool visible = true;\n"
+		/* planes are not normalized */
+		"for (int p = 0; p < 6; ++p)\n"
+			"visible = visible && dot(u_planes[p].xyz, s.xyz) + u_planes[p].w >= -s.w * length(u_planes[p].xyz);\n"
+		"uint g = clusters[i].group;\n"
+		"visible = visible && ((groups_visible[g >> 5] >> (g & 31u)) & 1u) != 0u;\n"
+		"commands[i * 5u + 1u] = visible ? 1u : 0u;\n"
+	"}\n";
+
+/* index of BSPDrawMaterial, from base instance of the indirect command */
+#define RENDER_MULTI_DRAW_MATERIALS \
+	"in uint a_draw;\n" \
+	"struct DrawMaterial { vec2 scale, translate, size; float layer, padding; };\n" \
+	"layout(std430, binding = 3) readonly buffer Materials { DrawMaterial materials[]; };\n"
+
+/* Versions of shaders that sample base textures, with them from texture arrays and material
+ * parameters from a storage buffer. Others have no per material parameters and are used as is */
+static RProgram multi_draw_programs[MShader_COUNT] = {
+	/* MShader_Unknown */
+	{-1, {NULL, NULL, NULL}, {-1}, {-1}},
+	/* MShader_LightmappedOnly */
+	{-1, {NULL, NULL, NULL}, {-1}, {-1}},
+	/* MShader_LightmappedGeneric */
+	{-1, {
+			/*common*/
+			"varying vec2 v_lightmap_uv, v_tex_uv;\n"
+			"varying float v_layer;\n",
+			/*vertex*/
+			"attribute vec4 a_vertex;\n"
+			"attribute vec2 a_lightmap_uv, a_tex_uv;\n"
+			RENDER_MULTI_DRAW_MATERIALS
+			"uniform mat4 u_mvp;\n"
+			"void main() {\n"
+				"v_lightmap_uv = a_lightmap_uv;\n"
+				"v_tex_uv = a_tex_uv * TEX_UV_SCALE;\n"
+				"v_layer = materials[a_draw].layer;\n"
+				"gl_Position = u_mvp * vec4(a_vertex.xyz, 1.);\n"
+			"}\n",
+			/*fragment*/
+			"uniform sampler2D u_lightmap;\n"
+			"uniform sampler2DArray u_tex0;\n"
+			"void main() {\n"
+				"vec4 albedo = texture(u_tex0, vec3(v_tex_uv, v_layer));\n"
+				"vec3 lm = texture(u_lightmap, v_lightmap_uv).xyz;\n"
+				"gl_FragColor = vec4(albedo.xyz * lm, 1.);\n"
+			"}\n",
+			},
+		{ -1 }, { -1 }
+	},
+	/* MShader_UnlitGeneric */
+	{-1, { /* common */
+		"varying vec2 v_uv, v_texel;\n"
+		"varying float v_layer;\n",
+		/* vertex */
+		"attribute vec4 a_vertex;\n"
+		"attribute vec2 a_tex_uv;\n"
+		RENDER_MULTI_DRAW_MATERIALS
+		"uniform mat4 u_mvp;\n"
+		"void main() {\n"
+			"DrawMaterial m = materials[a_draw];\n"
+			"v_texel = vec2(1.) / m.size;\n"
+			"v_uv = a_tex_uv * TEX_UV_SCALE * m.scale + m.translate + .5 * v_texel;\n"
+			"v_layer = m.layer;\n"
+			"gl_Position = u_mvp * vec4(a_vertex.xyz, 1.);\n"
+		"}\n",
+		/* fragment */
+		"uniform sampler2DArray u_tex0;\n"
+		"void main() {\n"
+			/* texture arrays repeat, these textures are clamped to edge */
+			"vec2 uv = clamp(v_uv, .5 * v_texel, vec2(1.) - .5 * v_texel);\n"
+			"gl_FragColor = texture(u_tex0, vec3(uv, v_layer));\n"
+		"}\n",
+		}, {-1}, {-1}},
+};
+#endif
+
+static const float box[] = {
+	 1.f, -1.f, -1.f,
+	 1.f,  1.f, -1.f,
+	 1.f,  1.f,  1.f,
+	 1.f,  1.f,  1.f,
+	 1.f, -1.f,  1.f,
+	 1.f, -1.f, -1.f,
+
+	-1.f, -1.f,  1.f,
+	-1.f,  1.f,  1.f,
+	-1.f,  1.f, -1.f,
+	-1.f,  1.f, -1.f,
+	-1.f, -1.f, -1.f,
+	-1.f, -1.f,  1.f,
+
+	 1.f, -1.f, -1.f,
+	 1.f, -1.f,  1.f,
+	-1.f, -1.f,  1.f,
+	-1.f, -1.f,  1.f,
+	-1.f, -1.f, -1.f,
+	 1.f, -1.f, -1.f,
+
+	 1.f,  1.f,  1.f,
+	 1.f,  1.f, -1.f,
+	-1.f,  1.f, -1.f,
+	-1.f,  1.f, -1.f,
+	-1.f,  1.f,  1.f,
+	 1.f,  1.f,  1.f,
+
+	 1.f, -1.f,  1.f,
+	 1.f,  1.f,  1.f,
+	-1.f,  1.f,  1.f,
+	-1.f,  1.f,  1.f,
+	-1.f, -1.f,  1.f,
+	 1.f, -1.f,  1.f,
+
+	-1.f, -1.f, -1.f,
+	-1.f,  1.f, -1.f,
+	 1.f,  1.f, -1.f,
+	 1.f,  1.f, -1.f,
+	 1.f, -1.f, -1.f,
+	-1.f, -1.f, -1.f,
 };
 
 static RBuffer box_buffer;
 
+#define RENDER_MAX_COARSE_DRAWS 2048
+/* linked with render_ProgramInitVersion() */
+#define RENDER_MAX_PROGRAMS 16
+#define RENDER_MAX_OCCLUSION_QUERIES 1024
+/* stencil counts shown as distinct colors, and counted exactly for the average */
+#define RENDER_OVERDRAW_LEVELS 8
+/* base textures copied to texture arrays, one array per size and mip count */
+#define RENDER_MAX_TEXTURE_ARRAYS 64
+#define RENDER_TEXTURE_ARRAY_LAYERS 32
+#define RENDER_MAX_ARRAY_TEXTURES 4096
+/* draws of one model that can be told apart by base instance */
+#define RENDER_MAX_MULTI_DRAWS 65536
+/* attributes have the same locations in all programs, a_draw is after RENDER_LIST_ATTRIBS */
+#define RENDER_ATTRIB_DRAW RAttribKind_COUNT
+
+struct RCoarseDraw {
+	const struct BSPModel *model;
+	const struct BSPDraw *draw;
+	struct AMat4f mvp;
+	float distance;
+};
+
 static struct {
 	const RTexture *current_tex0;
+	const RTexture *current_lightmap;
+
+	/* coarse draws of all distant maps, flushed grouped by lightmap page.
+	 * Every map has its own buffers and transform, so each draw stays a separate
+	 * glDrawElements; grouping only saves lightmap binds and program switches */
+	struct {
+		struct RCoarseDraw draws[RENDER_MAX_COARSE_DRAWS];
+		int count;
+	} coarse;
 
 	const RProgram *current_program;
 	struct {
@@ -482,59 +1119,251 @@ static struct {
 		float far;
 	} uniforms;
 
+	/* values last uploaded to each program, found by program name */
+	struct RUniformValues {
+		GLuint program;
+		int set[RUniformKind_COUNT];
+		float values[RUniformKind_COUNT][16];
+	} uniform_values[RENDER_MAX_PROGRAMS];
+	int uniform_values_count;
+	struct RUniformValues *current_uniform_values;
+
+	/* viewport size in pixels, height is for projected size of coarse level errors */
+	int viewport_width, viewport_height;
+
+	struct {
+		int supported, enabled;
+		GLuint program;
+		GLint planes_location, count_location;
+		/* groups seen from the camera cluster of the current map */
+		RBuffer groups_buffer;
+	} gpu_culling;
+
+	struct {
+		int supported, enabled;
+		/* base instance numbers for a_draw */
+		RBuffer draw_ids;
+		int draw_locations[MShader_COUNT];
+		GLuint copy_framebuffer;
+		/* single white layer for draws without a base texture */
+		GLuint white_array;
+		struct {
+			GLuint gl_name;
+			int width, height, levels;
+			int layers_count;
+		} arrays[RENDER_MAX_TEXTURE_ARRAYS];
+		int arrays_count;
+		/* open addressing by gl_name, which is never 0 */
+		struct {
+			int gl_name;
+			RTextureLayer layer;
+		} textures[RENDER_MAX_ARRAY_TEXTURES];
+		int textures_count;
+	} multi_draw;
+
+	struct {
+		int supported;
+		/* 0 is the default one, where attributes are set up call by call */
+		unsigned int bound;
+	} vertex_arrays;
+
+	/* CPU time spent submitting shading of detailed draws this frame */
+	ATimeUs submit_time;
+	/* submitted this frame and in the last one */
+	int triangles, last_triangles;
+	/* incremented by renderBegin() */
+	unsigned int frame;
+
+	/* GL_EXT_texture_compression_s3tc or _dxt1, GLES2 always has ETC1 */
+	int dxt1_supported;
+
+	int depth_prepass;
+	struct {
+		int enabled;
+		/* shaded fragments per pixel of the last frame it was measured in */
+		float average;
+		unsigned int queries[RENDER_OVERDRAW_LEVELS];
+	} overdraw;
+
+	/* issued at the end of frame, after everything is drawn */
 	struct {
-		float distance;
-		const struct BSPModel *model;
-	} closest_map;
+		struct {
+			ROcclusion *query;
+			struct AMat4f mvp;
+		} boxes[RENDER_MAX_OCCLUSION_QUERIES];
+		int count;
+	} occlusion;
 } r;
 
+static void renderBindVertexArray(unsigned int name) {
+#ifdef RENDER_VERTEX_ARRAYS
+	if (!r.vertex_arrays.supported || !renderStateChange(r.vertex_arrays.bound != name))
+		return;
+
+	GL_CALL(render_BindVertexArray(name));
+	r.vertex_arrays.bound = name;
+#else
+	(void)name;
+#endif
+}
+
+void renderVertexArrayCreate(RVertexArray *array, const RBuffer *vbo, const RBuffer *ibo, unsigned int vbo_offset) {
+	array->gl_name = 0;
+	array->vbo_offset = vbo_offset;
+#ifdef RENDER_VERTEX_ARRAYS
+	if (!r.vertex_arrays.supported)
+		return;
+
+	GLuint name;
+	GL_CALL(render_GenVertexArrays(1, &name));
+	renderBindVertexArray(name);
+
+	GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ibo->gl_name));
+	renderStateBuffer(GL_ARRAY_BUFFER, vbo->gl_name);
+	for (int i = 0; i < RAttribKind_COUNT; ++i) {
+		const RAttrib *a = attribs + i;
+		RENDER_STATE_CALL(glEnableVertexAttribArray(i));
+		RENDER_STATE_CALL(glVertexAttribPointer(i, a->components, a->type, a->normalize, a->stride, (const char*)a->ptr + vbo_offset * sizeof(struct BSPModelVertex)));
+	}
+
+#ifdef RENDER_GPU_CULLING
+	/* other programs do not read it */
+	if (r.multi_draw.supported) {
+		RENDER_STATE_CALL(glEnableVertexAttribArray(RENDER_ATTRIB_DRAW));
+		renderStateBuffer(GL_ARRAY_BUFFER, r.multi_draw.draw_ids.gl_name);
+		RENDER_STATE_CALL(glVertexAttribIPointer(RENDER_ATTRIB_DRAW, 1, GL_UNSIGNED_INT, 0, 0));
+		RENDER_STATE_CALL(glVertexAttribDivisor(RENDER_ATTRIB_DRAW, 1));
+	}
+#endif
+
+	renderBindVertexArray(0);
+	array->gl_name = name;
+#else
+	(void)vbo; (void)ibo;
+#endif
+}
+
+void renderVertexArrayDestroy(RVertexArray *array) {
+#ifdef RENDER_VERTEX_ARRAYS
+	if (!array->gl_name)
+		return;
+
+	if (r.vertex_arrays.bound == array->gl_name)
+		renderBindVertexArray(0);
+	GL_CALL(render_DeleteVertexArrays(1, &array->gl_name));
+#endif
+	array->gl_name = 0;
+}
+
 static void renderApplyAttribs(const RAttrib *attribs, const RBuffer *buffer, unsigned int vbo_offset) {
 	for(int i = 0; i < RAttribKind_COUNT; ++i) {
 		const RAttrib *a = attribs + i;
 		const int loc = r.current_program->attrib_locations[i];
 		if (loc < 0) continue;
-		GL_CALL(glEnableVertexAttribArray(loc));
-		GL_CALL(glBindBuffer(GL_ARRAY_BUFFER, buffer->gl_name));
-		GL_CALL(glVertexAttribPointer(loc, a->components, a->type, a->normalize, a->stride, (const char*)a->ptr + vbo_offset * sizeof(struct BSPModelVertex)));
+		RENDER_STATE_CALL(glEnableVertexAttribArray(loc));
+		renderStateBuffer(GL_ARRAY_BUFFER, buffer->gl_name);
+		RENDER_STATE_CALL(glVertexAttribPointer(loc, a->components, a->type, a->normalize, a->stride, (const char*)a->ptr + vbo_offset * sizeof(struct BSPModelVertex)));
+	}
+}
+
+/* Model vertices starting at vbo_offset, with one call if the model has vertex array objects.
+ * Otherwise the model index buffer has to be bound already */
+static void renderApplyModelAttribs(const struct BSPModel *model, unsigned int vbo_offset) {
+	for (int i = 0; i < model->vertex_arrays_count; ++i)
+		if (model->vertex_arrays[i].vbo_offset == vbo_offset) {
+			renderBindVertexArray(model->vertex_arrays[i].gl_name);
+			return;
+		}
+
+	renderBindVertexArray(0);
+	renderApplyAttribs(attribs, &model->vbo, vbo_offset);
+}
+
+/* Index buffer is a part of vertex array objects, only the default one needs it bound */
+static void renderBindModelIndices(const struct BSPModel *model) {
+	if (model->vertex_arrays_count)
+		return;
+
+	renderBindVertexArray(0);
+	renderStateBuffer(GL_ELEMENT_ARRAY_BUFFER, model->ibo.gl_name);
+}
+
+/* Uploads count floats to uniform kind of the current program, unless it has them already.
+ * count is 1, 2, 3 or 16 for a matrix */
+static void renderUniform(int kind, int count, const float *value) {
+	struct RUniformValues *const cache = r.current_uniform_values;
+	const GLint location = r.current_program->uniform_locations[kind];
+	if (location < 0)
+		return;
+
+	if (!renderStateChange(!cache->set[kind] || memcmp(cache->values[kind], value, count * sizeof(float)) != 0))
+		return;
+
+	switch (count) {
+		case 1: GL_CALL(glUniform1f(location, value[0])); break;
+		case 2: GL_CALL(glUniform2f(location, value[0], value[1])); break;
+		case 3: GL_CALL(glUniform3f(location, value[0], value[1], value[2])); break;
+		case 16: GL_CALL(glUniformMatrix4fv(location, 1, GL_FALSE, value)); break;
+		default: ATTO_ASSERT(!"Unsupported uniform size");
 	}
+
+	memcpy(cache->values[kind], value, count * sizeof(float));
+	cache->set[kind] = 1;
+}
+
+static void renderUniform2f(int kind, float x, float y) {
+	const float value[2] = {x, y};
+	renderUniform(kind, 2, value);
+}
+
+/* mvp and far of r.uniforms */
+static void renderUniformsCommon() {
+	if (r.uniforms.mvp)
+		renderUniform(RUniformKind_mvp, 16, r.uniforms.mvp);
+	renderUniform(RUniformKind_far, 1, &r.uniforms.far);
 }
 
 static int render_ProgramUse(RProgram *prog) {
 	if (r.current_program == prog)
 		return 0;
 
-	if (r.current_program) {
+	/* vertex array objects keep all attributes enabled, programs only read the ones they have */
+	if (r.current_program && !r.vertex_arrays.bound) {
 		for (int i = 0; i < RAttribKind_COUNT; ++i) {
 			const int loc = r.current_program->attrib_locations[i];
 			if (loc >= 0)
-				GL_CALL(glDisableVertexAttribArray(loc));
+				RENDER_STATE_CALL(glDisableVertexAttribArray(loc));
 		}
 	}
 
-	GL_CALL(glUseProgram(prog->name));
-	GL_CALL(glUniform1i(prog->uniform_locations[RUniformKind_lightmap], 0));
-	GL_CALL(glUniform1i(prog->uniform_locations[RUniformKind_tex0], 1));
-
-	GL_CALL(glUniformMatrix4fv(prog->uniform_locations[RUniformKind_mvp], 1, GL_FALSE, r.uniforms.mvp));
-	GL_CALL(glUniform1f(prog->uniform_locations[RUniformKind_far], r.uniforms.far));
+	renderStateProgram(prog->name);
 
 	r.current_program = prog;
 	r.current_tex0 = NULL;
+	r.current_uniform_values = NULL;
+	for (int i = 0; i < r.uniform_values_count; ++i)
+		if (r.uniform_values[i].program == (GLuint)prog->name)
+			r.current_uniform_values = r.uniform_values + i;
+	ATTO_ASSERT(r.current_uniform_values);
+
+	renderUniformsCommon();
 
 	return 1;
 }
 
-static int render_ProgramInit(RProgram *prog) {
+/* version is the #version line, empty for the default one */
+static int render_ProgramInitVersion(RProgram *prog, const char *version) {
 	GLuint program;
 	GLuint vertex_shader, fragment_shader;
 	const char *sources[] = {
-		prog->shader_sources.common, prog->shader_sources.fragment, 0
+		version,
+		render_shader_header, prog->shader_sources.common, prog->shader_sources.fragment, 0
 	};
 	fragment_shader = render_ShaderCreate(GL_FRAGMENT_SHADER, sources);
 	if (fragment_shader == 0)
 		return -1;
 
-	sources[1] = prog->shader_sources.vertex;
+	sources[3] = prog->shader_sources.vertex;
 	vertex_shader = render_ShaderCreate(GL_VERTEX_SHADER, sources);
 	if (vertex_shader == 0) {
 		GL_CALL(glDeleteShader(fragment_shader));
@@ -544,6 +1373,9 @@ static int render_ProgramInit(RProgram *prog) {
 	program = glCreateProgram();
 	GL_CALL(glAttachShader(program, fragment_shader));
 	GL_CALL(glAttachShader(program, vertex_shader));
+	for (int i = 0; i < RAttribKind_COUNT; ++i)
+		GL_CALL(glBindAttribLocation(program, i, attribs[i].name));
+	GL_CALL(glBindAttribLocation(program, RENDER_ATTRIB_DRAW, "a_draw"));
 	GL_CALL(glLinkProgram(program));
 
 	GL_CALL(glDeleteShader(fragment_shader));
@@ -577,25 +1409,311 @@ static int render_ProgramInit(RProgram *prog) {
 			PRINTF("Cannot locate uniform %s", uniforms[i].name);
 	}
 
+	if (r.uniform_values_count == RENDER_MAX_PROGRAMS) {
+		PRINT("Too many programs");
+		return -4;
+	}
+	memset(r.uniform_values + r.uniform_values_count, 0, sizeof(r.uniform_values[0]));
+	r.uniform_values[r.uniform_values_count++].program = program;
+
+	/* samplers never change. Programs that fail to link cannot be used */
+	GLint linked = GL_FALSE;
+	GL_CALL(glGetProgramiv(program, GL_LINK_STATUS, &linked));
+	if (linked == GL_TRUE) {
+		renderStateProgram(program);
+		GL_CALL(glUniform1i(prog->uniform_locations[RUniformKind_lightmap], 0));
+		GL_CALL(glUniform1i(prog->uniform_locations[RUniformKind_tex0], 1));
+	}
+
 	return 0;
 }
 
-int renderInit() {
-	PRINTF("GL extensions: %s", glGetString(GL_EXTENSIONS));
+static int render_ProgramInit(RProgram *prog) {
+	return render_ProgramInitVersion(prog, "");
+}
+
+#if !defined(ATTO_GL_ES) && (defined(RENDER_VERTEX_ARRAYS) || defined(RENDER_GPU_CULLING))
+/* major * 10 + minor, 0 if unknown. Skips any vendor prefix */
+static int renderGlVersion() {
+	int major = 0, minor = 0;
+	const char *version = (const char*)glGetString(GL_VERSION);
+	if (!version)
+		return 0;
+	while (*version && (*version < '0' || *version > '9'))
+		++version;
+	if (sscanf(version, "%d.%d", &major, &minor) != 2)
+		return 0;
+	return major * 10 + minor;
+}
+#endif
+
+/* Returns 0 if neither GL 3.0 nor the extension is there, attributes are set up call by call then */
+static int renderVertexArraysInit() {
+#ifdef RENDER_VERTEX_ARRAYS
+	const char *const extensions = (const char*)glGetString(GL_EXTENSIONS);
+#ifdef ATTO_GL_ES
+	if (!extensions || !strstr(extensions, "GL_OES_vertex_array_object"))
+		return 0;
+	render_GenVertexArrays = (PFNGLGENVERTEXARRAYSOESPROC)eglGetProcAddress("glGenVertexArraysOES");
+	render_BindVertexArray = (PFNGLBINDVERTEXARRAYOESPROC)eglGetProcAddress("glBindVertexArrayOES");
+	render_DeleteVertexArrays = (PFNGLDELETEVERTEXARRAYSOESPROC)eglGetProcAddress("glDeleteVertexArraysOES");
+	return render_GenVertexArrays && render_BindVertexArray && render_DeleteVertexArrays;
+#else
+	/* there is no extensions string in core profiles */
+	if (renderGlVersion() < 30 && !(extensions && strstr(extensions, "GL_ARB_vertex_array_object")))
+		return 0;
+
 #ifdef _WIN32
 #define WGL__FUNCLIST_DO(T, N) \
 	gl##N = (T)wglGetProcAddress("gl" #N); \
-	ASSERT(gl##N);
+	if (!gl##N) return 0;
 
-	WGL__FUNCLIST
+	WGL__FUNCLIST_VERTEX_ARRAYS
 #undef WGL__FUNCLIST_DO
 #endif
+	return 1;
+#endif
+#else
+	return 0;
+#endif
+}
 
-	memset(&stats, 0, sizeof(stats));
+/* Returns 0 if GL 4.3 is not there, GPU culling is never enabled then */
+static int renderGpuCullingInit() {
+#ifdef RENDER_GPU_CULLING
+	if (renderGlVersion() < 43) {
+		PRINTF("No GPU culling with GL %s", glGetString(GL_VERSION));
+		return 0;
+	}
 
-	r.current_program = NULL;
+#ifdef _WIN32
+#define WGL__FUNCLIST_DO(T, N) \
+	gl##N = (T)wglGetProcAddress("gl" #N); \
+	if (!gl##N) return 0;
+
+	WGL__FUNCLIST_GPU_CULLING
+#undef WGL__FUNCLIST_DO
+#endif
+
+	const char *sources[] = { render_cull_shader, 0 };
+	const GLuint shader = render_ShaderCreate(GL_COMPUTE_SHADER, sources);
+	if (!shader)
+		return 0;
+
+	const GLuint program = glCreateProgram();
+	GL_CALL(glAttachShader(program, shader));
+	GL_CALL(glLinkProgram(program));
+	GL_CALL(glDeleteShader(shader));
+
+	GLint status;
+	GL_CALL(glGetProgramiv(program, GL_LINK_STATUS, &status));
+	if (status != GL_TRUE) {
+		char buffer[1024];
+		GL_CALL(glGetProgramInfoLog(program, sizeof(buffer), 0, buffer));
+		PRINTF("Culling program linking error: %s", buffer);
+		GL_CALL(glDeleteProgram(program));
+		return 0;
+	}
+
+	r.gpu_culling.program = program;
+	r.gpu_culling.planes_location = glGetUniformLocation(program, "u_planes");
+	r.gpu_culling.count_location = glGetUniformLocation(program, "u_count");
+
+	const uint32_t all_groups = 0xffffffffu;
+	renderBufferCreate(&r.gpu_culling.groups_buffer, RBufferType_Storage, sizeof(all_groups), &all_groups);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Needs GPU culling for indirect commands, returns 0 if multi draw shaders do not build */
+static int renderMultiDrawInit() {
+#ifdef RENDER_GPU_CULLING
+	if (!r.gpu_culling.supported)
+		return 0;
+
+	for (int i = 0; i < MShader_COUNT; ++i) {
+		RProgram *const prog = multi_draw_programs + i;
+		r.multi_draw.draw_locations[i] = -1;
+		if (!prog->shader_sources.common)
+			continue;
+
+		GLint status = GL_FALSE;
+		if (render_ProgramInitVersion(prog, "#version 430 compatibility\n") == 0)
+			GL_CALL(glGetProgramiv(prog->name, GL_LINK_STATUS, &status));
+		if (status != GL_TRUE) {
+			PRINTF("No multi draw, cannot create program %d", i);
+			return 0;
+		}
+
+		r.multi_draw.draw_locations[i] = glGetAttribLocation(prog->name, "a_draw");
+	}
+
+	renderBufferCreate(&r.multi_draw.draw_ids, RBufferType_Vertex, sizeof(uint32_t) * RENDER_MAX_MULTI_DRAWS, NULL);
+	for (int i = 0; i < RENDER_MAX_MULTI_DRAWS; i += 1024) {
+		uint32_t ids[1024];
+		for (int j = 0; j < 1024; ++j)
+			ids[j] = i + j;
+		GL_CALL(glBufferSubData(GL_ARRAY_BUFFER, sizeof(uint32_t) * i, sizeof(ids), ids));
+	}
+
+	GL_CALL(glGenFramebuffers(1, &r.multi_draw.copy_framebuffer));
+
+	const uint16_t white = 0xffffu;
+	GL_CALL(glGenTextures(1, &r.multi_draw.white_array));
+	renderStateTexture(state.active_unit, GL_TEXTURE_2D_ARRAY, r.multi_draw.white_array);
+	GL_CALL(glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, GL_RGB565, 1, 1, 1));
+	GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST));
+	GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST));
+	GL_CALL(glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, 0, 1, 1, 1, GL_RGB, GL_UNSIGNED_SHORT_5_6_5, &white));
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+int renderTextureArrayAdd(const RTexture *texture, RTextureLayer *layer) {
+#ifdef RENDER_GPU_CULLING
+	/* only RGB565 is renderable, for copying on GPU */
+	if (!r.multi_draw.supported || texture->gl_name <= 0 || texture->format != RTexFormat_RGB565)
+		return 0;
+
+	unsigned int slot = (unsigned)texture->gl_name * 2654435761u % RENDER_MAX_ARRAY_TEXTURES;
+	while (r.multi_draw.textures[slot].gl_name) {
+		if (r.multi_draw.textures[slot].gl_name == texture->gl_name) {
+			*layer = r.multi_draw.textures[slot].layer;
+			return 1;
+		}
+		slot = (slot + 1) % RENDER_MAX_ARRAY_TEXTURES;
+	}
+
+	/* keep probing short */
+	if (r.multi_draw.textures_count * 2 >= RENDER_MAX_ARRAY_TEXTURES)
+		return 0;
+
+	/* mips are generated down to 1x1, or not at all */
+	renderStateTexture(state.active_unit, GL_TEXTURE_2D, texture->gl_name);
+	int levels = 0;
+	for (;;) {
+		GLint width = 0;
+		GL_CALL(glGetTexLevelParameteriv(GL_TEXTURE_2D, levels, GL_TEXTURE_WIDTH, &width));
+		if (!width)
+			break;
+		++levels;
+	}
+
+	int array = 0;
+	for (; array < r.multi_draw.arrays_count; ++array)
+		if (r.multi_draw.arrays[array].width == texture->width && r.multi_draw.arrays[array].height == texture->height
+				&& r.multi_draw.arrays[array].levels == levels
+				&& r.multi_draw.arrays[array].layers_count < RENDER_TEXTURE_ARRAY_LAYERS)
+			break;
+
+	if (array == r.multi_draw.arrays_count) {
+		if (array == RENDER_MAX_TEXTURE_ARRAYS)
+			return 0;
+
+		GLuint name;
+		GL_CALL(glGenTextures(1, &name));
+		renderStateTexture(state.active_unit, GL_TEXTURE_2D_ARRAY, name);
+		GL_CALL(glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGB565, texture->width, texture->height, RENDER_TEXTURE_ARRAY_LAYERS));
+		GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR));
+		GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+		GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT));
+		GL_CALL(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT));
+
+		r.multi_draw.arrays[array].gl_name = name;
+		r.multi_draw.arrays[array].width = texture->width;
+		r.multi_draw.arrays[array].height = texture->height;
+		r.multi_draw.arrays[array].levels = levels;
+		r.multi_draw.arrays[array].layers_count = 0;
+		++r.multi_draw.arrays_count;
+
+		++stats.textures_count;
+		for (int level = 0; level < levels; ++level) {
+			const int width = texture->width >> level, height = texture->height >> level;
+			stats.textures_size += RENDER_TEXTURE_ARRAY_LAYERS * renderTextureImageSize(RTexFormat_RGB565,
+				width ? width : 1, height ? height : 1);
+		}
+		renderPrintMemUsage();
+	}
+
+	const int index = r.multi_draw.arrays[array].layers_count++;
+	renderStateTexture(state.active_unit, GL_TEXTURE_2D_ARRAY, r.multi_draw.arrays[array].gl_name);
+	GL_CALL(glBindFramebuffer(GL_READ_FRAMEBUFFER, r.multi_draw.copy_framebuffer));
+	for (int level = 0; level < levels; ++level) {
+		const int width = texture->width >> level, height = texture->height >> level;
+		GL_CALL(glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture->gl_name, level));
+		GL_CALL(glCopyTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, index, 0, 0, width ? width : 1, height ? height : 1));
+	}
+	GL_CALL(glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, 0, 0));
+	GL_CALL(glBindFramebuffer(GL_READ_FRAMEBUFFER, 0));
+
+	layer->array = array;
+	layer->layer = index;
+	layer->width = texture->width;
+	layer->height = texture->height;
+
+	r.multi_draw.textures[slot].gl_name = texture->gl_name;
+	r.multi_draw.textures[slot].layer = *layer;
+	++r.multi_draw.textures_count;
+	return 1;
+#else
+	(void)texture; (void)layer;
+	return 0;
+#endif
+}
+
+int renderSetMultiDraw(int enable) {
+	r.multi_draw.enabled = enable && r.multi_draw.supported;
+	return r.multi_draw.enabled;
+}
+
+int renderSupportsGpuCulling() {
+	return r.gpu_culling.supported;
+}
+
+int renderSetGpuCulling(int enable) {
+	r.gpu_culling.enabled = enable && r.gpu_culling.supported;
+	return r.gpu_culling.enabled;
+}
+
+int renderInit() {
+	PRINTF("GL extensions: %s", glGetString(GL_EXTENSIONS));
+#ifdef _WIN32
+#define WGL__FUNCLIST_DO(T, N) \
+	gl##N = (T)wglGetProcAddress("gl" #N); \
+	ASSERT(gl##N);
+
+	WGL__FUNCLIST
+#undef WGL__FUNCLIST_DO
+#endif
+
+	memset(&stats, 0, sizeof(stats));
+	renderStateInit();
+	r.uniform_values_count = 0;
+
+	r.vertex_arrays.supported = renderVertexArraysInit();
+	r.vertex_arrays.bound = 0;
+	PRINTF("Vertex array objects %s", r.vertex_arrays.supported ? "supported" : "not supported");
+
+#ifndef ATTO_PLATFORM_RPI
+	{
+		const char *const extensions = (const char*)glGetString(GL_EXTENSIONS);
+		r.dxt1_supported = extensions && (strstr(extensions, "GL_EXT_texture_compression_s3tc")
+			|| strstr(extensions, "GL_EXT_texture_compression_dxt1"));
+		PRINTF("DXT1 textures %s", r.dxt1_supported ? "supported" : "not supported");
+	}
+#endif
+
+	r.current_program = NULL;
 	r.current_tex0 = NULL;
+	r.current_lightmap = NULL;
 	r.uniforms.mvp = NULL;
+	r.depth_prepass = 0;
+	r.overdraw.enabled = 0;
+	r.overdraw.average = -1.f;
 
 	for (int i = 0; i < MShader_COUNT; ++i) {
 		if (render_ProgramInit(programs + i) != 0) {
@@ -604,6 +1722,28 @@ int renderInit() {
 		}
 	}
 
+	if (render_ProgramInit(&skybox_program) != 0) {
+		PRINT("Cannot create skybox program");
+		return 0;
+	}
+
+	if (render_ProgramInit(&depth_program) != 0) {
+		PRINT("Cannot create depth prepass program");
+		return 0;
+	}
+
+	if (render_ProgramInit(&overdraw_program) != 0) {
+		PRINT("Cannot create overdraw program");
+		return 0;
+	}
+
+#ifdef ATTO_GL_DESKTOP
+	if (render_ProgramInit(&occlusion_program) != 0) {
+		PRINT("Cannot create occlusion query program");
+		return 0;
+	}
+#endif
+
 	struct Texture default_texture;
 	RTextureUploadParams params;
 	params.type = RTexType_2D;
@@ -635,21 +1775,43 @@ int renderInit() {
 
 	renderBufferCreate(&box_buffer, RBufferType_Vertex, sizeof(box), box);
 
-	GL_CALL(glEnable(GL_DEPTH_TEST));
-	GL_CALL(glEnable(GL_CULL_FACE));
+	/* both are off until enabled, they are not measured to be faster everywhere */
+	r.gpu_culling.supported = renderGpuCullingInit();
+	r.gpu_culling.enabled = 0;
+	r.multi_draw.supported = renderMultiDrawInit();
+	r.multi_draw.enabled = 0;
+	r.submit_time = 0;
+	r.triangles = r.last_triangles = 0;
+	r.frame = 0;
+
+	renderStateEnable(GL_DEPTH_TEST, 1);
+	renderStateEnable(GL_CULL_FACE, 1);
 	return 1;
 }
 
-static void renderBindTexture(const RTexture *texture, int slot, int norepeat) {
-	GL_CALL(glActiveTexture(GL_TEXTURE0 + slot));
-	GL_CALL(glBindTexture(GL_TEXTURE_2D, texture->gl_name));
-	if (norepeat) {
-		const GLuint wrap = GL_CLAMP_TO_EDGE;
-		GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, wrap));
-		GL_CALL(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, wrap));
+int renderSupportsTextureFormat(RTexFormat format) {
+	switch (format) {
+#ifndef ATTO_PLATFORM_RPI
+		case RTexFormat_Compressed_DXT1:
+			return r.dxt1_supported;
+#endif
+		default:
+			return 1;
 	}
 }
 
+int renderGetMaxTextureSize() {
+	GLint max_size = 0;
+	GL_CALL(glGetIntegerv(GL_MAX_TEXTURE_SIZE, &max_size));
+	return max_size;
+}
+
+static void renderBindTexture(const RTexture *texture, int slot, int norepeat) {
+	renderStateTexture(slot, GL_TEXTURE_2D, texture->gl_name);
+	if (norepeat)
+		renderStateTextureWrap(slot, GL_TEXTURE_2D, texture->gl_name, GL_CLAMP_TO_EDGE);
+}
+
 static int renderUseMaterial(const Material *m) {
 	const int program_changed = render_ProgramUse(programs + m->shader);
 
@@ -657,9 +1819,9 @@ static int renderUseMaterial(const Material *m) {
 		const RTexture *t = &m->base_texture.texture->texture;
 		if (t != r.current_tex0) {
 			renderBindTexture(&m->base_texture.texture->texture, 1, m->shader == MShader_UnlitGeneric);
-			GL_CALL(glUniform2f(r.current_program->uniform_locations[RUniformKind_tex0_size], (float)t->width, (float)t->height));
-			GL_CALL(glUniform2f(r.current_program->uniform_locations[RUniformKind_tex0_scale], m->base_texture.transform.scale.x, m->base_texture.transform.scale.y));
-			GL_CALL(glUniform2f(r.current_program->uniform_locations[RUniformKind_tex0_translate], m->base_texture.transform.translate.x, m->base_texture.transform.translate.y));
+			renderUniform2f(RUniformKind_tex0_size, (float)t->width, (float)t->height);
+			renderUniform2f(RUniformKind_tex0_scale, m->base_texture.transform.scale.x, m->base_texture.transform.scale.y);
+			renderUniform2f(RUniformKind_tex0_translate, m->base_texture.transform.translate.x, m->base_texture.transform.translate.y);
 			r.current_tex0 = t;
 		}
 	}
@@ -667,52 +1829,424 @@ static int renderUseMaterial(const Material *m) {
 	return program_changed;
 }
 
+/* Marks groups of the node subtree visible or not, plane_mask is of planes its parent wasn't inside of.
+ * Subtrees that pass frustum culling are still tested against software occlusion down to the groups */
+static void renderCullNodes(const struct BSPModel *model, int index, const struct CameraFrustum *frustum,
+		unsigned int plane_mask, struct AVec3f translation) {
+	const struct BSPNode *node = model->nodes + index;
+	const enum CameraCull cull = cameraCullAABB(frustum, node->aabb.min, node->aabb.max, &plane_mask);
+	const int visible = cull != CameraCull_Outside
+		&& occlusionVisible(aVec3fAdd(node->aabb.min, translation), aVec3fAdd(node->aabb.max, translation));
+
+	if (!visible || (node->children[0] < 0 && node->children[1] < 0)) {
+		memset(model->groups_visible + node->first_group, visible, node->groups_count);
+		return;
+	}
+
+	for (int k = 0; k < 2; ++k)
+		if (node->children[k] >= 0)
+			renderCullNodes(model, node->children[k], frustum, plane_mask, translation);
+}
+
+/* Hides groups none of whose clusters the camera cluster can see */
+static void renderCullClusters(const struct BSPModel *model, int cluster) {
+	const unsigned char *const pvs = bspClusterPVS(model, cluster);
+	if (!pvs)
+		return;
+
+	for (int g = 0; g < model->groups_count; ++g) {
+		const unsigned int first = model->group_first_cluster[g], end = model->group_first_cluster[g + 1];
+		if (!model->groups_visible[g] || first == end)
+			continue;
+
+		int visible = 0;
+		for (unsigned int i = first; i < end && !visible; ++i)
+			visible = (pvs[model->group_clusters[i] >> 3] >> (model->group_clusters[i] & 7)) & 1;
+		model->groups_visible[g] = (unsigned char)visible;
+	}
+}
+
+/* Draws with node group ranges only draw ranges of visible groups, adjacent ones as one call */
 static void renderDrawSet(const struct BSPModel *model, const struct BSPDrawSet *drawset) {
 	unsigned int vbo_offset = 0;
+	int attribs_applied = 0;
 	for (int i = 0; i < drawset->draws_count; ++i) {
 		const struct BSPDraw *draw = drawset->draws + i;
+		const struct BSPDrawRange *const ranges = model->ranges + draw->first_range;
+
+		unsigned int j = 0;
+		while (j < draw->ranges_count && !model->groups_visible[ranges[j].group])
+			++j;
+		if (draw->ranges_count && j == draw->ranges_count)
+			continue;
+
+		if (draw->lightmap != r.current_lightmap) {
+			renderBindTexture(draw->lightmap, 0, 0);
+			r.current_lightmap = draw->lightmap;
+		}
 
-		if (renderUseMaterial(draw->material) || i == 0 || draw->vbo_offset != vbo_offset) {
+		if (renderUseMaterial(draw->material) || !attribs_applied || draw->vbo_offset != vbo_offset) {
 			vbo_offset = draw->vbo_offset;
-			renderApplyAttribs(attribs, &model->vbo, draw->vbo_offset);
+			renderApplyModelAttribs(model, draw->vbo_offset);
+			attribs_applied = 1;
 		}
 
-		GL_CALL(glDrawElements(GL_TRIANGLES, draw->count, GL_UNSIGNED_SHORT, (void*)(sizeof(uint16_t) * draw->start)));
+		if (!draw->ranges_count) {
+			GL_CALL(glDrawElements(GL_TRIANGLES, draw->count, RENDER_INDEX_TYPE, (void*)(sizeof(BSPIndex) * draw->start)));
+			continue;
+		}
+
+		while (j < draw->ranges_count) {
+			const unsigned int start = ranges[j].start;
+			unsigned int end = start + ranges[j].count;
+			for (++j; j < draw->ranges_count && model->groups_visible[ranges[j].group]; ++j)
+				end = ranges[j].start + ranges[j].count;
+
+			GL_CALL(glDrawElements(GL_TRIANGLES, end - start, RENDER_INDEX_TYPE, (void*)(sizeof(BSPIndex) * start)));
+
+			while (j < draw->ranges_count && !model->groups_visible[ranges[j].group])
+				++j;
+		}
 	}
 }
 
+static void renderDrawRun(unsigned int start, unsigned int end) {
+	if (end > start)
+		GL_CALL(glDrawElements(GL_TRIANGLES, end - start, RENDER_INDEX_TYPE, (void*)(sizeof(BSPIndex) * start)));
+}
+
+/* Depth only version of renderDrawSet(). Draws follow each other in the index buffer,
+ * so with no materials to switch visible ranges of different draws merge too */
+static void renderDrawSetDepth(const struct BSPModel *model, const struct BSPDrawSet *drawset) {
+	render_ProgramUse(&depth_program);
+
+	/* neighbouring ranges only merge in index buffer order */
+	const unsigned int *const order = drawset == &model->detailed ? model->detailed_order : NULL;
+
+	unsigned int vbo_offset = 0, start = 0, end = 0;
+	int attribs_applied = 0;
+	for (int i = 0; i < drawset->draws_count; ++i) {
+		const struct BSPDraw *draw = drawset->draws + (order ? order[i] : (unsigned)i);
+		if (!attribs_applied || draw->vbo_offset != vbo_offset) {
+			renderDrawRun(start, end);
+			start = end = 0;
+			vbo_offset = draw->vbo_offset;
+			renderApplyModelAttribs(model, vbo_offset);
+			attribs_applied = 1;
+		}
+
+		if (!draw->ranges_count) {
+			if (draw->start != end) {
+				renderDrawRun(start, end);
+				start = draw->start;
+			}
+			end = draw->start + draw->count;
+			continue;
+		}
+
+		const struct BSPDrawRange *const ranges = model->ranges + draw->first_range;
+		for (unsigned int j = 0; j < draw->ranges_count; ++j) {
+			if (!model->groups_visible[ranges[j].group])
+				continue;
+
+			if (ranges[j].start != end) {
+				renderDrawRun(start, end);
+				start = ranges[j].start;
+			}
+			end = ranges[j].start + ranges[j].count;
+		}
+	}
+
+	renderDrawRun(start, end);
+}
+
+/* Culls clusters of detailed draws with a compute shader, leaves model commands buffer bound
+ * for indirect draws. Groups are culled on CPU already, by nodes and by visibility, and
+ * uploaded as bits. Only maps near enough to be drawn detailed are culled this way,
+ * the coarse sets of all the others stay on CPU, so their cost still grows with maps count.
+ * Returns 0 if the model is to be drawn on CPU */
+#ifdef RENDER_GPU_CULLING
+static int renderCullDrawClusters(const struct BSPModel *model, const struct CameraFrustum *frustum) {
+	if (!r.gpu_culling.enabled || !model->commands_buffer.gl_name)
+		return 0;
+
+	renderStateProgram(r.gpu_culling.program);
+	r.current_program = NULL;
+
+	GL_CALL(glUniform4fv(r.gpu_culling.planes_location, 6, &frustum->planes[0].x));
+	GL_CALL(glUniform1ui(r.gpu_culling.count_location, model->draw_clusters_count));
+
+	const int words = (model->groups_count + 31) / 32;
+	renderStateBuffer(GL_SHADER_STORAGE_BUFFER, r.gpu_culling.groups_buffer.gl_name);
+	GL_CALL(glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * (words ? words : 1), NULL, GL_STREAM_DRAW));
+	for (int first = 0; first < words; first += 256) {
+		uint32_t bits[256];
+		const int count = words - first < 256 ? words - first : 256;
+		for (int i = 0; i < count; ++i) {
+			bits[i] = 0;
+			for (int j = 0; j < 32; ++j) {
+				const int group = (first + i) * 32 + j;
+				if (group < model->groups_count && model->groups_visible[group])
+					bits[i] |= 1u << j;
+			}
+		}
+		GL_CALL(glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(uint32_t) * first, sizeof(uint32_t) * count, bits));
+	}
+
+	renderStateBufferBase(GL_SHADER_STORAGE_BUFFER, 0, model->clusters_buffer.gl_name);
+	renderStateBufferBase(GL_SHADER_STORAGE_BUFFER, 1, model->commands_buffer.gl_name);
+	renderStateBufferBase(GL_SHADER_STORAGE_BUFFER, 2, r.gpu_culling.groups_buffer.gl_name);
+	GL_CALL(glDispatchCompute((model->draw_clusters_count + 63) / 64, 1, 1));
+	GL_CALL(glMemoryBarrier(GL_COMMAND_BARRIER_BIT));
+
+	renderStateBuffer(GL_DRAW_INDIRECT_BUFFER, model->commands_buffer.gl_name);
+	return 1;
+}
+#endif
+
+#ifdef RENDER_GPU_CULLING
+/* renderDrawSet() with one indirect draw of all clusters per draw.
+ * On desktop the whole model is one vertex range, so vbo_offset is always 0 */
+static void renderDrawIndirect(const struct BSPModel *model, const struct BSPDraw *draw, int *attribs_applied) {
+	if (!draw->clusters_count)
+		return;
+
+	if (draw->lightmap != r.current_lightmap) {
+		renderBindTexture(draw->lightmap, 0, 0);
+		r.current_lightmap = draw->lightmap;
+	}
+
+	if (renderUseMaterial(draw->material) || !*attribs_applied) {
+		renderApplyModelAttribs(model, 0);
+		*attribs_applied = 1;
+	}
+
+	GL_CALL(glMultiDrawElementsIndirect(GL_TRIANGLES, RENDER_INDEX_TYPE,
+		(void*)(sizeof(uint32_t) * 5 * draw->first_cluster), draw->clusters_count, 0));
+}
+
+static void renderDrawSetIndirect(const struct BSPModel *model, const struct BSPDrawSet *drawset) {
+	int attribs_applied = 0;
+	for (int i = 0; i < drawset->draws_count; ++i)
+		renderDrawIndirect(model, drawset->draws + i, &attribs_applied);
+}
+
+/* a_draw is instanced, it has to be disabled before any other program uses its location */
+static void renderMultiDrawIds(int location, int enable) {
+	/* vertex array objects have it enabled already */
+	if (location < 0 || r.vertex_arrays.bound)
+		return;
+
+	if (enable) {
+		RENDER_STATE_CALL(glEnableVertexAttribArray(location));
+		renderStateBuffer(GL_ARRAY_BUFFER, r.multi_draw.draw_ids.gl_name);
+		RENDER_STATE_CALL(glVertexAttribIPointer(location, 1, GL_UNSIGNED_INT, 0, 0));
+		RENDER_STATE_CALL(glVertexAttribDivisor(location, 1));
+	} else {
+		RENDER_STATE_CALL(glVertexAttribDivisor(location, 0));
+		RENDER_STATE_CALL(glDisableVertexAttribArray(location));
+	}
+}
+
+/* One indirect multi draw per batch, draws find their BSPDrawMaterial by base instance */
+static void renderDrawBatchesIndirect(const struct BSPModel *model) {
+	renderStateBufferBase(GL_SHADER_STORAGE_BUFFER, 3, model->materials_buffer.gl_name);
+
+	int attribs_applied = 0, draw_location = -1;
+	for (int i = 0; i < model->draw_batches_count; ++i) {
+		const struct BSPDrawBatch *const batch = model->draw_batches + i;
+		if (!batch->clusters_count)
+			continue;
+
+		if (batch->per_draw) {
+			renderMultiDrawIds(draw_location, 0);
+			draw_location = -1;
+			attribs_applied = 0;
+			for (unsigned int j = 0; j < batch->draws_count; ++j)
+				renderDrawIndirect(model, model->detailed.draws + batch->first_draw + j, &attribs_applied);
+			attribs_applied = 0;
+			continue;
+		}
+
+		if (batch->lightmap != r.current_lightmap) {
+			renderBindTexture(batch->lightmap, 0, 0);
+			r.current_lightmap = batch->lightmap;
+		}
+
+		const MShader shader = batch->material->shader;
+		RProgram *const program = multi_draw_programs[shader].name >= 0 ? multi_draw_programs + shader : programs + shader;
+		if (render_ProgramUse(program) || !attribs_applied) {
+			renderMultiDrawIds(draw_location, 0);
+			renderApplyModelAttribs(model, 0);
+			draw_location = r.multi_draw.draw_locations[shader];
+			renderMultiDrawIds(draw_location, 1);
+			attribs_applied = 1;
+		}
+
+		renderStateTexture(1, GL_TEXTURE_2D_ARRAY, batch->texture_array >= 0
+			? r.multi_draw.arrays[batch->texture_array].gl_name : r.multi_draw.white_array);
+
+		GL_CALL(glMultiDrawElementsIndirect(GL_TRIANGLES, RENDER_INDEX_TYPE,
+			(void*)(sizeof(uint32_t) * 5 * batch->first_cluster), batch->clusters_count, 0));
+	}
+
+	renderMultiDrawIds(draw_location, 0);
+}
+
+/* there are no materials in depth pass, all clusters are drawn at once */
+static void renderDrawSetDepthIndirect(const struct BSPModel *model) {
+	render_ProgramUse(&depth_program);
+	renderApplyModelAttribs(model, 0);
+	GL_CALL(glMultiDrawElementsIndirect(GL_TRIANGLES, RENDER_INDEX_TYPE, NULL, model->draw_clusters_count, 0));
+}
+#endif
+
 static void renderSkybox(const struct Camera *camera, const struct BSPModel *model) {
+	if (!model || !model->skybox)
+		return;
+
 	const struct AMat4f op = aMat4fMul(camera->projection, aMat4f3(camera->orientation, aVec3ff(0)));
 	r.uniforms.mvp = &op.X.x;
 
-	GL_CALL(glDisable(GL_CULL_FACE));
-	for (int i = 0; i < BSPSkyboxDir_COUNT; ++i) {
-		if (!model->skybox[i] || !model->skybox[i]->base_texture.texture)
-			continue;
-		renderUseMaterial(model->skybox[i]);
-		renderApplyAttribs(attribs, &box_buffer, 0);
-		GL_CALL(glDrawArrays(GL_TRIANGLES, i*6, 6));
+	renderBindVertexArray(0);
+	render_ProgramUse(&skybox_program);
+	renderStateTexture(1, GL_TEXTURE_CUBE_MAP, model->skybox->texture.gl_name);
+	const int loc = skybox_program.attrib_locations[RAttribKind_vertex];
+	RENDER_STATE_CALL(glEnableVertexAttribArray(loc));
+	renderStateBuffer(GL_ARRAY_BUFFER, box_buffer.gl_name);
+	RENDER_STATE_CALL(glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, 0));
+
+	renderStateEnable(GL_CULL_FACE, 0);
+	renderStateDepthFunc(GL_LEQUAL);
+	renderStateDepthMask(0);
+	GL_CALL(glDrawArrays(GL_TRIANGLES, 0, sizeof(box) / sizeof(*box) / 3));
+	renderStateDepthMask(1);
+	renderStateDepthFunc(GL_LESS);
+	renderStateEnable(GL_CULL_FACE, 1);
+	r.uniforms.mvp = NULL;
+}
+
+static int renderCoarseDrawCompare(const void *a, const void *b) {
+	const struct RCoarseDraw *ca = a, *cb = b;
+	if (ca->draw->lightmap != cb->draw->lightmap)
+		return (uintptr_t)ca->draw->lightmap < (uintptr_t)cb->draw->lightmap ? -1 : 1;
+	/* front to back within a lightmap page */
+	if (ca->distance != cb->distance)
+		return ca->distance < cb->distance ? -1 : 1;
+	if (ca->model != cb->model)
+		return (uintptr_t)ca->model < (uintptr_t)cb->model ? -1 : 1;
+	return ca->draw < cb->draw ? -1 : (ca->draw > cb->draw);
+}
+
+static void renderCoarseFlush() {
+	if (!r.coarse.count)
+		return;
+
+	qsort(r.coarse.draws, r.coarse.count, sizeof(*r.coarse.draws), renderCoarseDrawCompare);
+
+	r.current_tex0 = NULL;
+	r.current_lightmap = NULL;
+
+	const struct BSPModel *model = NULL;
+	unsigned int vbo_offset = 0;
+	for (int i = 0; i < r.coarse.count; ++i) {
+		const struct RCoarseDraw *coarse = r.coarse.draws + i;
+		const struct BSPDraw *draw = coarse->draw;
+
+		if (draw->lightmap != r.current_lightmap) {
+			renderBindTexture(draw->lightmap, 0, 0);
+			r.current_lightmap = draw->lightmap;
+		}
+
+		r.uniforms.mvp = &coarse->mvp.X.x;
+		const int program_changed = renderUseMaterial(draw->material);
+		if (!program_changed)
+			renderUniform(RUniformKind_mvp, 16, r.uniforms.mvp);
+
+		if (coarse->model != model)
+			renderBindModelIndices(coarse->model);
+
+		if (program_changed || coarse->model != model || draw->vbo_offset != vbo_offset) {
+			model = coarse->model;
+			vbo_offset = draw->vbo_offset;
+			renderApplyModelAttribs(model, vbo_offset);
+		}
+
+		GL_CALL(glDrawElements(GL_TRIANGLES, draw->count, RENDER_INDEX_TYPE, (void*)(sizeof(BSPIndex) * draw->start)));
 	}
-	GL_CALL(glEnable(GL_CULL_FACE));
+
+	r.coarse.count = 0;
+}
+
+/* also expands quantized vertex positions back to world units */
+static struct AMat4f renderModelMatrix(const struct BSPModel *model, struct AVec3f translation) {
+	const struct AVec3f scale = aVec3fMulf(aVec3fSub(model->vertex_box.max, model->vertex_box.min), 1.f / 65535.f);
+	const struct AVec3f origin = aVec3fAdd(translation, model->vertex_box.min);
+	struct AMat4f m;
+	m.X = aVec4f(scale.x, 0.f, 0.f, 0.f);
+	m.Y = aVec4f(0.f, scale.y, 0.f, 0.f);
+	m.Z = aVec4f(0.f, 0.f, scale.z, 0.f);
+	m.W = aVec4f(origin.x, origin.y, origin.z, 1.f);
+	return m;
 }
 
 static float aMaxf(float a, float b) { return a > b ? a : b; }
 //static float aMinf(float a, float b) { return a < b ? a : b; }
 
+/* how many pixels coarse level surface is allowed to be off by */
+#define RENDER_COARSE_LOD_PIXELS 1.f
+
+/* the simplest set whose error, seen from distance, stays within a pixel or so.
+ * Detailed one is drawn from inside the map bounds, or while even coarse[0] shows its error */
+static const struct BSPDrawSet *renderSelectSet(const struct BSPModel *model, const struct Camera *camera,
+		float distance) {
+	if (distance < 0.f)
+		return &model->detailed;
+
+	const float pixels_per_unit = camera->projection.Y.y * .5f * r.viewport_height / aMaxf(distance, 1.f);
+	if (model->coarse[0].error * pixels_per_unit > RENDER_COARSE_LOD_PIXELS)
+		return &model->detailed;
+
+	int level = 0;
+	while (level + 1 < BSP_COARSE_LODS && model->coarse[level + 1].draws_count
+			&& model->coarse[level + 1].error * pixels_per_unit <= RENDER_COARSE_LOD_PIXELS)
+		++level;
+	return model->coarse + level;
+}
+
+/* Triangles of set draws in visible groups, GPU culling may drop some more of them */
+static int renderSetTriangles(const struct BSPModel *model, const struct BSPDrawSet *set) {
+	int triangles = 0;
+	for (int i = 0; i < set->draws_count; ++i) {
+		const struct BSPDraw *const draw = set->draws + i;
+		if (!draw->ranges_count)
+			triangles += draw->count / 3;
+
+		for (unsigned int j = draw->first_range; j < draw->first_range + draw->ranges_count; ++j)
+			if (model->groups_visible[model->ranges[j].group])
+				triangles += model->ranges[j].count / 3;
+	}
+	return triangles;
+}
+
 void renderModelDraw(const RDrawParams *params, const struct BSPModel *model) {
 	if (!model->detailed.draws_count) return;
 
 	const struct AMat4f mvp = aMat4fMul(params->camera->view_projection,
-			aMat4fTranslation(params->translation));
+			renderModelMatrix(model, params->translation));
 
-	GL_CALL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->ibo.gl_name));
-	renderBindTexture(&model->lightmap, 0, 0);
+	renderBindModelIndices(model);
 
 	const struct AVec3f rel_pos = aVec3fSub(params->camera->pos, params->translation);
 
-	r.current_program = NULL;
+	/* the program stays, texture bindings may have been replaced by uploads.
+	 * Binding the same ones again is skipped by the state tracker */
+	r.current_tex0 = NULL;
+	r.current_lightmap = NULL;
 	r.uniforms.mvp = &mvp.X.x;
 	r.uniforms.far = params->camera->z_far;
+	if (r.current_program)
+		renderUniformsCommon();
 
 	const float distance =
 		aMaxf(aMaxf(
@@ -725,39 +2259,305 @@ void renderModelDraw(const RDrawParams *params, const struct BSPModel *model) {
 			rel_pos.x, rel_pos.y, rel_pos.z, distance);
 	*/
 
-	if (distance < r.closest_map.distance) {
-		r.closest_map.distance = distance;
-		r.closest_map.model = model;
-	}
-
 	if (params->selected) {
-		GL_CALL(glEnable(GL_BLEND));
-		GL_CALL(glBlendColor(1, 1, 1, .5f));
-		//GL_CALL(glBlendFunc(GL_CONSTANT_ALPHA, GL_ONE));
-		GL_CALL(glBlendFunc(GL_ONE, GL_CONSTANT_ALPHA));
-		GL_CALL(glBlendEquation(GL_FUNC_ADD));
+		renderStateEnable(GL_BLEND, 1);
+		renderStateBlendColor(1, 1, 1, .5f);
+		//renderStateBlendFunc(GL_CONSTANT_ALPHA, GL_ONE);
+		renderStateBlendFunc(GL_ONE, GL_CONSTANT_ALPHA);
+		renderStateBlendEquation(GL_FUNC_ADD);
 	}
 
-	if (distance < 0.f)
-		renderDrawSet(model, &model->detailed);
-	else
-		renderDrawSet(model, &model->coarse);
+	const struct BSPDrawSet *const set = renderSelectSet(model, params->camera, distance);
+
+	if (set == &model->detailed) {
+		struct CameraFrustum frustum;
+		cameraFrustum(params->camera, params->translation, &frustum);
+		const int cluster = bspFindCluster(model, rel_pos);
+
+		renderCullNodes(model, 0, &frustum, (1u << 6) - 1, params->translation);
+		if (cluster >= 0)
+			renderCullClusters(model, cluster);
+#ifdef RENDER_GPU_CULLING
+		const int gpu_culled = renderCullDrawClusters(model, &frustum);
+#endif
+
+		if (r.depth_prepass) {
+			/* pushed back a little, so that shading passes depth test regardless of precision */
+			renderStateColorMask(0);
+			renderStateEnable(GL_POLYGON_OFFSET_FILL, 1);
+			renderStatePolygonOffset(1.f, 1.f);
+			if (r.overdraw.enabled)
+				renderStateStencilMask(0);
+
+#ifdef RENDER_GPU_CULLING
+			if (gpu_culled)
+				renderDrawSetDepthIndirect(model);
+			else
+#endif
+				renderDrawSetDepth(model, &model->detailed);
+
+			if (r.overdraw.enabled)
+				renderStateStencilMask(0xff);
+			renderStateEnable(GL_POLYGON_OFFSET_FILL, 0);
+			renderStateColorMask(1);
+			renderStateDepthFunc(GL_LEQUAL);
+		}
+
+		const ATimeUs submit_start = aAppTime();
+#ifdef RENDER_GPU_CULLING
+		if (gpu_culled && r.multi_draw.enabled && model->draw_batches_count
+				&& model->detailed.draws_count <= RENDER_MAX_MULTI_DRAWS)
+			renderDrawBatchesIndirect(model);
+		else if (gpu_culled)
+			renderDrawSetIndirect(model, &model->detailed);
+		else
+#endif
+			renderDrawSet(model, &model->detailed);
+		r.submit_time += aAppTime() - submit_start;
+
+		if (r.depth_prepass)
+			renderStateDepthFunc(GL_LESS);
+	}
+	else if (params->selected)
+		renderDrawSet(model, set);
+	else {
+		/* distant maps share lightmap pages, draw them grouped by page at the end */
+		for (int i = 0; i < set->draws_count; ++i) {
+			if (r.coarse.count == RENDER_MAX_COARSE_DRAWS)
+				renderCoarseFlush();
+
+			struct RCoarseDraw *coarse = r.coarse.draws + r.coarse.count++;
+			coarse->model = model;
+			coarse->draw = set->draws + i;
+			coarse->mvp = mvp;
+			coarse->distance = distance;
+		}
+	}
+	r.triangles += renderSetTriangles(model, set);
 
 	if (params->selected) {
-		GL_CALL(glDisable(GL_BLEND));
+		renderStateEnable(GL_BLEND, 0);
 	}
+
+	/* points to this frame */
+	r.uniforms.mvp = NULL;
 }
 
 void renderResize(int w, int h) {
 	glViewport(0, 0, w, h);
+	r.viewport_width = w;
+	r.viewport_height = h;
+}
+
+void renderSetDepthPrepass(int enable) {
+	r.depth_prepass = enable;
+}
+
+void renderSetOverdraw(int enable) {
+	if (enable) {
+		GLint bits = 0;
+		GL_CALL(glGetIntegerv(GL_STENCIL_BITS, &bits));
+		if (bits < 4) {
+			PRINTF("Cannot count overdraw with %d stencil bits", bits);
+			enable = 0;
+		}
+	}
+
+#ifdef ATTO_GL_DESKTOP
+	if (enable && !r.overdraw.queries[0])
+		GL_CALL(glGenQueries(RENDER_OVERDRAW_LEVELS, r.overdraw.queries));
+#endif
+
+	if (!enable)
+		renderStateEnable(GL_STENCIL_TEST, 0);
+	r.overdraw.enabled = enable;
+}
+
+float renderGetOverdraw() {
+	return r.overdraw.average;
 }
 
 void renderBegin() {
+	state.last_issued = state.issued;
+	state.last_skipped = state.skipped;
+	state.issued = state.skipped = 0;
+	r.last_triangles = r.triangles;
+	r.triangles = 0;
+	++r.frame;
+
 	glClearColor(0.f,1.f,0.f,0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	r.closest_map.distance = 1e9f;
+	if (r.overdraw.enabled) {
+		/* every fragment that passes depth test increments its pixel */
+		renderStateEnable(GL_STENCIL_TEST, 1);
+		renderStateStencilFunc(GL_ALWAYS, 0, 0xff);
+		renderStateStencilOp(GL_KEEP, GL_KEEP, GL_INCR);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+	} else
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+	r.coarse.count = 0;
+	r.occlusion.count = 0;
+}
+
+int renderOcclusionVisible(ROcclusion *query, const struct Camera *camera, struct AVec3f min, struct AVec3f max) {
+#ifdef ATTO_GL_DESKTOP
+	/* a query still in flight is simply reused, its result is of whatever was issued last */
+	if (query->frame + 1 != r.frame)
+		query->pending = query->occluded = 0;
+	query->frame = r.frame;
+
+	if (query->pending) {
+		GLuint available = 0;
+		GL_CALL(glGetQueryObjectuiv(query->gl_name, GL_QUERY_RESULT_AVAILABLE, &available));
+		if (available) {
+			GLuint samples = 0;
+			GL_CALL(glGetQueryObjectuiv(query->gl_name, GL_QUERY_RESULT, &samples));
+			query->occluded = samples == 0;
+			query->pending = 0;
+		}
+	}
+
+	/* box faces around the camera would be clipped by the near plane */
+	const float margin = camera->z_near * 2.f;
+	const struct AVec3f p = camera->pos;
+	if (p.x > min.x - margin && p.x < max.x + margin
+			&& p.y > min.y - margin && p.y < max.y + margin
+			&& p.z > min.z - margin && p.z < max.z + margin) {
+		query->occluded = 0;
+		return 1;
+	}
+
+	if (!query->pending && r.occlusion.count < RENDER_MAX_OCCLUSION_QUERIES) {
+		if (!query->gl_name)
+			GL_CALL(glGenQueries(1, &query->gl_name));
+
+		const struct AVec3f center = aVec3fMulf(aVec3fAdd(min, max), .5f);
+		const struct AVec3f half = aVec3fMulf(aVec3fSub(max, min), .5f);
+		struct AMat4f m;
+		m.X = aVec4f(half.x, 0.f, 0.f, 0.f);
+		m.Y = aVec4f(0.f, half.y, 0.f, 0.f);
+		m.Z = aVec4f(0.f, 0.f, half.z, 0.f);
+		m.W = aVec4f(center.x, center.y, center.z, 1.f);
+
+		r.occlusion.boxes[r.occlusion.count].query = query;
+		r.occlusion.boxes[r.occlusion.count].mvp = aMat4fMul(camera->view_projection, m);
+		++r.occlusion.count;
+		query->pending = 1;
+	}
+
+	return !query->occluded;
+#else
+	(void)query; (void)camera; (void)min; (void)max;
+	return 1;
+#endif
+}
+
+static void renderOcclusionFlush() {
+#ifdef ATTO_GL_DESKTOP
+	if (!r.occlusion.count)
+		return;
+
+	r.uniforms.mvp = &r.occlusion.boxes[0].mvp.X.x;
+	renderBindVertexArray(0);
+	render_ProgramUse(&occlusion_program);
+	const int loc = occlusion_program.attrib_locations[RAttribKind_vertex];
+	RENDER_STATE_CALL(glEnableVertexAttribArray(loc));
+	renderStateBuffer(GL_ARRAY_BUFFER, box_buffer.gl_name);
+	RENDER_STATE_CALL(glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, 0));
+
+	/* box faces can coincide with the geometry inside */
+	renderStateColorMask(0);
+	renderStateDepthMask(0);
+	if (r.overdraw.enabled)
+		renderStateStencilMask(0);
+	renderStateDepthFunc(GL_LEQUAL);
+	renderStateEnable(GL_CULL_FACE, 0);
+
+	for (int i = 0; i < r.occlusion.count; ++i) {
+		renderUniform(RUniformKind_mvp, 16, &r.occlusion.boxes[i].mvp.X.x);
+		GL_CALL(glBeginQuery(GL_SAMPLES_PASSED, r.occlusion.boxes[i].query->gl_name));
+		GL_CALL(glDrawArrays(GL_TRIANGLES, 0, sizeof(box) / sizeof(*box) / 3));
+		GL_CALL(glEndQuery(GL_SAMPLES_PASSED));
+	}
+
+	renderStateEnable(GL_CULL_FACE, 1);
+	renderStateDepthFunc(GL_LESS);
+	renderStateDepthMask(1);
+	renderStateColorMask(1);
+	if (r.overdraw.enabled)
+		renderStateStencilMask(0xff);
+	r.occlusion.count = 0;
+	r.uniforms.mvp = NULL;
+#endif
+}
+
+/* Replaces the frame with a color for every stencil count, blue for 1 to red for
+ * RENDER_OVERDRAW_LEVELS or more. On desktop the pixels of each count are also counted with
+ * queries, results are waited for right away, so frame time is off in this mode */
+static void renderOverdrawFlush() {
+	if (!r.overdraw.enabled)
+		return;
+
+	renderBindVertexArray(0);
+	render_ProgramUse(&overdraw_program);
+	const int loc = overdraw_program.attrib_locations[RAttribKind_vertex];
+	RENDER_STATE_CALL(glEnableVertexAttribArray(loc));
+	renderStateBuffer(GL_ARRAY_BUFFER, box_buffer.gl_name);
+	RENDER_STATE_CALL(glVertexAttribPointer(loc, 3, GL_FLOAT, GL_FALSE, 0, 0));
+
+	renderStateEnable(GL_DEPTH_TEST, 0);
+	renderStateEnable(GL_CULL_FACE, 0);
+	renderStateStencilMask(0);
+	renderStateStencilOp(GL_KEEP, GL_KEEP, GL_KEEP);
+
+	for (int level = 1; level <= RENDER_OVERDRAW_LEVELS; ++level) {
+		const float t = (level - 1.f) / (RENDER_OVERDRAW_LEVELS - 1.f);
+		const float color[3] = {t, 1.f - fabsf(2.f * t - 1.f), 1.f - t};
+		renderUniform(RUniformKind_color, 3, color);
+		/* level <= stencil */
+		renderStateStencilFunc(GL_LEQUAL, level, 0xff);
+#ifdef ATTO_GL_DESKTOP
+		GL_CALL(glBeginQuery(GL_SAMPLES_PASSED, r.overdraw.queries[level - 1]));
+#endif
+		/* +z face of the box covers the whole screen */
+		GL_CALL(glDrawArrays(GL_TRIANGLES, 24, 6));
+#ifdef ATTO_GL_DESKTOP
+		GL_CALL(glEndQuery(GL_SAMPLES_PASSED));
+#endif
+	}
+
+#ifdef ATTO_GL_DESKTOP
+	/* pixels drawn n times pass n levels */
+	unsigned int fragments = 0;
+	for (int i = 0; i < RENDER_OVERDRAW_LEVELS; ++i) {
+		GLuint samples = 0;
+		GL_CALL(glGetQueryObjectuiv(r.overdraw.queries[i], GL_QUERY_RESULT, &samples));
+		fragments += samples;
+	}
+	r.overdraw.average = (float)fragments / (r.viewport_width * r.viewport_height);
+#endif
+
+	renderStateStencilMask(0xff);
+	renderStateEnable(GL_CULL_FACE, 1);
+	renderStateEnable(GL_DEPTH_TEST, 1);
 }
 
-void renderEnd(const struct Camera *camera) {
-	renderSkybox(camera, r.closest_map.model);
+void renderGetStateCalls(int *issued, int *skipped) {
+	*issued = state.last_issued;
+	*skipped = state.last_skipped;
+}
+
+int renderGetTriangles() {
+	return r.last_triangles;
+}
+
+void renderEnd(const struct Camera *camera, const struct BSPModel *closest) {
+	/* named by mode, so that profiler shows them apart */
+	profileEvent(!r.gpu_culling.enabled ? "detailed submit"
+		: r.multi_draw.enabled ? "detailed submit, multi draw" : "detailed submit, indirect", r.submit_time);
+	r.submit_time = 0;
+
+	renderCoarseFlush();
+	renderOcclusionFlush();
+	renderSkybox(camera, closest);
+	renderOverdrawFlush();
 }
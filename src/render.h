@@ -5,6 +5,8 @@ typedef enum {
 	RTexFormat_RGB565,
 #ifdef ATTO_PLATFORM_RPI
 	RTexFormat_Compressed_ETC1,
+#else
+	RTexFormat_Compressed_DXT1,
 #endif
 } RTexFormat;
 
@@ -28,6 +30,7 @@ typedef struct {
 	RTexFormat format;
 	int gl_name;
 	int type_flags;
+	int size; // bytes uploaded to gl_name, for memory stats
 } RTexture;
 
 typedef struct {
@@ -35,27 +38,76 @@ typedef struct {
 	int width, height;
 	RTexFormat format;
 	const void *pixels;
-	int mip_level; // -1 means generate; -2 means don't need
+	int mip_level; // -1 means generate; -2 means don't need; on desktop GL levels above the last uploaded one are not used
 	RTexWrap wrap;
 } RTextureUploadParams;
 
 #define renderTextureInit(texture_ptr) do { (texture_ptr)->gl_name = -1; } while (0)
 void renderTextureUpload(RTexture *texture, RTextureUploadParams params);
+/* deletes the GL texture, if there is one, and makes texture uninitialized again */
+void renderTextureDestroy(RTexture *texture);
+/* update a width x height region at x, y of mip_level of an already uploaded 2D texture
+ * compressed regions must be block aligned */
+void renderTextureUploadRegion(RTexture *texture, int x, int y, RTextureUploadParams params);
+
+/* Where a 2D texture was copied to in texture arrays shared by all maps */
+typedef struct {
+	int array, layer;
+	/* of the array */
+	int width, height;
+} RTextureLayer;
+
+/* Copies the texture with all its mips to a texture array of its size, unless it is already in one.
+ * The texture itself is kept, the CPU path, per draw batches and multi draw switched off at
+ * runtime all sample it. So base textures in arrays take twice their memory.
+ * Only if renderSupportsGpuCulling(), returns 0 if the texture does not fit in any array */
+int renderTextureArrayAdd(const RTexture *texture, RTextureLayer *layer);
 
 typedef struct {
 	int gl_name;
 	int type;
 } RBuffer;
 
+/* Model vertex attributes from a vertex buffer starting at vbo_offset, and its index buffer,
+ * bound with one call. gl_name is 0 if vertex array objects are not supported */
+typedef struct {
+	unsigned int gl_name;
+	unsigned int vbo_offset;
+} RVertexArray;
+
+/* Occlusion query state of a box, zero-initialized */
+typedef struct {
+	unsigned int gl_name;
+	/* issued, result not read back yet */
+	int pending;
+	int occluded;
+	/* renderer frame it was last tested in, older results are dropped */
+	unsigned int frame;
+} ROcclusion;
+
 typedef enum {
 	RBufferType_Vertex,
-	RBufferType_Index
+	RBufferType_Index,
+	/* only if renderSupportsGpuCulling() */
+	RBufferType_Storage,
+	RBufferType_Indirect
 } RBufferType;
 
 int renderInit();
 void renderResize(int w, int h);
 
+/* GL_MAX_TEXTURE_SIZE, valid after renderInit() */
+int renderGetMaxTextureSize();
+
+/* Returns 0 if textures of format cannot be uploaded, valid after renderInit() */
+int renderSupportsTextureFormat(RTexFormat format);
+
+/* GL 4.3 compute shaders and indirect draws are available, valid after renderInit() */
+int renderSupportsGpuCulling();
+
 void renderBufferCreate(RBuffer *buffer, RBufferType type, int size, const void *data);
+void renderVertexArrayCreate(RVertexArray *array, const RBuffer *vbo, const RBuffer *ibo, unsigned int vbo_offset);
+void renderVertexArrayDestroy(RVertexArray *array);
 
 struct BSPModel;
 struct Camera;
@@ -70,4 +122,39 @@ typedef struct {
 
 void renderModelDraw(const RDrawParams *params, const struct BSPModel *model);
 
-void renderEnd(const struct Camera *camera);
+/* Clusters of detailed draws of models with cluster buffers are culled by a compute shader
+ * that writes indirect draw commands, after node groups are culled on CPU. Off by default.
+ * Returns 0 if not supported */
+int renderSetGpuCulling(int enable);
+
+/* Detailed draws of models with draw batches are submitted as one indirect multi draw per batch,
+ * with base textures from texture arrays. Only along with GPU culling, off by default.
+ * Returns 0 if not supported */
+int renderSetMultiDraw(int enable);
+
+/* Detailed maps are first drawn to depth only, then shaded only where they are visible */
+void renderSetDepthPrepass(int enable);
+
+/* Counts shaded fragments of every pixel in stencil, renderEnd() then shows the counts
+ * instead of the frame. Stays off if the framebuffer has no stencil */
+void renderSetOverdraw(int enable);
+
+/* Average shaded fragments per pixel in the last frame with overdraw on, counts above
+ * a few are clamped. Negative if it was never measured, always on GLES2 */
+float renderGetOverdraw();
+
+/* GL state changes made and skipped as redundant in the last frame */
+void renderGetStateCalls(int *issued, int *skipped);
+
+/* Triangles of the sets drawn in the last frame, counted before GPU culling */
+int renderGetTriangles();
+
+/* Returns 0 if the box was found fully hidden by a query issued a frame or more ago.
+ * A new query is then drawn at renderEnd() against the depth of everything drawn in
+ * this frame. Results of boxes not tested in the previous frame are out of date,
+ * such boxes are visible until queried again. Boxes around the camera are always
+ * visible. Always 1 on GLES2 */
+int renderOcclusionVisible(ROcclusion *query, const struct Camera *camera, struct AVec3f min, struct AVec3f max);
+
+/* skybox is that of the closest model, can be NULL */
+void renderEnd(const struct Camera *camera, const struct BSPModel *closest);
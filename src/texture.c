@@ -205,6 +205,33 @@ static uint16_t *textureUnpackToTemp(struct Stack *tmp, struct IFile *file, size
 	return dst_texture;
 }
 
+/* Source skybox faces are square images that are seen from inside the box,
+ * with up and down faces turned relative to GL cube map layout.
+ * Half-height faces get their last row repeated down to the bottom. */
+static uint16_t *textureSkyboxFaceToTemp(struct Stack *tmp, const uint16_t *src, int width, int height,
+		RTexType tex_type, int *out_side) {
+	const int side = width > height ? width : height;
+	uint16_t *dst = stackAlloc(tmp, sizeof(uint16_t) * side * side);
+	if (!dst) return NULL;
+
+	for (int y = 0; y < side; ++y) {
+		for (int x = 0; x < side; ++x) {
+			int sx = x, sy = y;
+			switch (tex_type) {
+				case RTexType_CubePY: sx = side - 1 - y; sy = x; break;
+				case RTexType_CubeNY: sx = side - 1 - x; sy = side - 1 - y; break;
+				default: break;
+			}
+			if (sx >= width) sx = width - 1;
+			if (sy >= height) sy = height - 1;
+			dst[x + y * side] = src[sx + sy * width];
+		}
+	}
+
+	*out_side = side;
+	return dst;
+}
+
 static int textureUploadMipmapType(struct Stack *tmp, struct IFile *file, size_t cursor,
 		const struct VTFHeader *hdr, int miplevel, RTexture *tex, RTexType tex_type) {
 	for (int mip = hdr->mipmap_count - 1; mip > miplevel; --mip) {
@@ -224,20 +251,32 @@ static int textureUploadMipmapType(struct Stack *tmp, struct IFile *file, size_t
 		return 0;
 	}
 
+	int width = hdr->width, height = hdr->height;
+	const int is_cube_face = tex_type != RTexType_2D;
+	if (is_cube_face) {
+		int side;
+		dst_texture = textureSkyboxFaceToTemp(tmp, dst_texture, width, height, tex_type, &side);
+		if (!dst_texture) {
+			PRINT("Not enough temp memory for cube face");
+			return 0;
+		}
+		width = height = side;
+	}
+
 #ifdef ATTO_PLATFORM_RPI
 	{
 		const uint16_t *p565 = dst_texture;
-		uint8_t *etc1_data = stackAlloc(tmp, hdr->width * hdr->height / 2);
+		uint8_t *etc1_data = stackAlloc(tmp, width * height / 2);
 		uint8_t *block = etc1_data;
 
 		// FIXME assumes w and h % 4 == 0
-		for (int by = 0; by < hdr->height; by += 4) {
-			for (int bx = 0; bx < hdr->width; bx += 4) {
-				const uint16_t *bp = p565 + bx + by * hdr->width;
+		for (int by = 0; by < height; by += 4) {
+			for (int bx = 0; bx < width; bx += 4) {
+				const uint16_t *bp = p565 + bx + by * width;
 				ETC1Color ec[16];
 				for (int x = 0; x < 4; ++x) {
 					for (int y = 0; y < 4; ++y) {
-						const unsigned p = bp[x + y * hdr->width];
+						const unsigned p = bp[x + y * width];
 						ec[x*4+y].r = (p & 0xf800u) >> 8;
 						ec[x*4+y].g = (p & 0x07e0u) >> 3;
 						ec[x*4+y].b = (p & 0x001fu) << 3;
@@ -251,8 +290,8 @@ static int textureUploadMipmapType(struct Stack *tmp, struct IFile *file, size_t
 
 		const RTextureUploadParams params = {
 			.type = tex_type,
-			.width = hdr->width,
-			.height = hdr->height,
+			.width = width,
+			.height = height,
 			.format = RTexFormat_Compressed_ETC1,
 			.pixels = etc1_data,
 			.mip_level = -2,//miplevel,
@@ -267,11 +306,12 @@ static int textureUploadMipmapType(struct Stack *tmp, struct IFile *file, size_t
 
 	const RTextureUploadParams params = {
 		.type = tex_type,
-		.width = hdr->width,
-		.height = hdr->height,
+		.width = width,
+		.height = height,
 		.format = RTexFormat_RGB565,
 		.pixels = dst_texture,
-		.mip_level = -1,//miplevel,
+		/* cube mips can only be generated once all faces are there */
+		.mip_level = is_cube_face ? -2 : -1,//miplevel,
 		.wrap =  RTexWrap_Repeat
 	};
 
@@ -380,3 +420,57 @@ const Texture *textureGet(const char *name, struct ICollection *collection, stru
 	texfile->close(texfile);
 	return tex ? tex : cacheGetTexture("opensource/placeholder");
 }
+
+static const char *texture_skybox_suffix[6] = {
+	"rt", "lf", "bk", "ft", "up", "dn" };
+
+static const RTexType texture_skybox_face[6] = {
+	RTexType_CubePX, RTexType_CubeNX, RTexType_CubePZ, RTexType_CubeNZ, RTexType_CubePY, RTexType_CubeNY };
+
+const Texture *textureGetSkybox(const char *name, struct ICollection *collection, struct Stack *tmp) {
+	const int name_length = strlen(name);
+	char *zname = alloca(name_length + 3 + 7);
+	memset(zname, 0, name_length + 3 + 7);
+	memcpy(zname, "skybox/", 7);
+	memcpy(zname + 7, name, name_length);
+
+	int all_faces = 0;
+	for (int i = 0; i < 6; ++i)
+		all_faces |= texture_skybox_face[i];
+
+	/* whole cubemap is cached under the suffix-less name. So are the ones that failed to load,
+	 * with no faces and no GL texture, so that they are not tried again for every map */
+	const Texture *tex = cacheGetTexture(zname);
+	if (tex) return (tex->texture.type_flags & all_faces) == all_faces ? tex : NULL;
+
+	struct Texture localtex;
+	renderTextureInit(&localtex.texture);
+	localtex.texture.type_flags = 0;
+	for (int i = 0; i < 6; ++i) {
+		memcpy(zname + name_length + 7, texture_skybox_suffix[i], 2);
+
+		struct IFile *texfile;
+		if (CollectionOpen_Success != collectionChainOpen(collection, zname, File_Texture, &texfile)) {
+			PRINTF("Skybox face \"%s\" not found", zname);
+			localtex.texture.type_flags = 0;
+			break;
+		}
+
+		const int result = textureLoad(texfile, &localtex, tmp, texture_skybox_face[i]);
+		texfile->close(texfile);
+		if (result == 0) {
+			PRINTF("Skybox face \"%s\" found, but could not be loaded", zname);
+			localtex.texture.type_flags = 0;
+			break;
+		}
+	}
+
+	/* faces loaded before the failure are not needed, only the name is cached */
+	if (!localtex.texture.type_flags)
+		renderTextureDestroy(&localtex.texture);
+
+	zname[name_length + 7] = '\0';
+	cachePutTexture(zname, &localtex);
+	tex = cacheGetTexture(zname);
+	return (tex->texture.type_flags & all_faces) == all_faces ? tex : NULL;
+}
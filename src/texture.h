@@ -4,8 +4,14 @@
 #include "mempools.h"
 
 typedef struct Texture {
+	/* dense, assigned by cache in interning order */
+	int id;
 	RTexture texture;
 	struct AVec3f avg_color;
 } Texture;
 
 const Texture *textureGet(const char *name, struct ICollection *collection, struct Stack *tmp);
+
+/* Loads skybox/<name>{rt,lf,bk,ft,up,dn} into a single cube map, NULL if any face is missing.
+ * Failures are cached too, the files are not opened again for the same name */
+const Texture *textureGetSkybox(const char *name, struct ICollection *collection, struct Stack *tmp);
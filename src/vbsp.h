@@ -156,6 +156,8 @@ enum VBSPSurfaceFlags {
 	VBSP_Surface_Light = 0x0001,
 	VBSP_Surface_Sky2D = 0x0002,
 	VBSP_Surface_Sky = 0x0004,
+	VBSP_Surface_Warp = 0x0008,
+	VBSP_Surface_Trans = 0x0010,
 	VBSP_Surface_NoDraw = 0x0080,
 	VBSP_Surface_NoLight = 0x0400
 };